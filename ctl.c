@@ -0,0 +1,170 @@
+/*
+ * Copyright (c) 2018, Bjorn Andersson <bjorn@kryo.se>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ctl.h"
+
+static int ctl_addr(const char *path, struct sockaddr_un *addr)
+{
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+
+	if (strlen(path) >= sizeof(addr->sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	strcpy(addr->sun_path, path);
+
+	return 0;
+}
+
+int ctl_listen(const char *path)
+{
+	struct sockaddr_un addr;
+	int sock;
+
+	if (ctl_addr(path, &addr) < 0)
+		return -1;
+
+	sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+	if (sock < 0)
+		return -1;
+
+	unlink(path);
+
+	if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    listen(sock, 8) < 0) {
+		close(sock);
+		return -1;
+	}
+
+	return sock;
+}
+
+int ctl_connect(const char *path)
+{
+	struct sockaddr_un addr;
+	int sock;
+
+	if (ctl_addr(path, &addr) < 0)
+		return -1;
+
+	sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (sock < 0)
+		return -1;
+
+	if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		close(sock);
+		return -1;
+	}
+
+	return sock;
+}
+
+ssize_t ctl_send(int sock, const void *buf, size_t len, const int *fds,
+		 unsigned num_fds)
+{
+	char control[CMSG_SPACE(sizeof(int) * CTL_MAX_FDS)] = {};
+	struct iovec iov = { (void *)buf, len };
+	struct msghdr msg = {};
+	struct cmsghdr *cmsg;
+
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+
+	if (num_fds) {
+		if (num_fds > CTL_MAX_FDS) {
+			errno = EINVAL;
+			return -1;
+		}
+
+		msg.msg_control = control;
+		msg.msg_controllen = CMSG_SPACE(sizeof(int) * num_fds);
+
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int) * num_fds);
+		memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * num_fds);
+	}
+
+	return sendmsg(sock, &msg, MSG_NOSIGNAL);
+}
+
+ssize_t ctl_recv(int sock, void *buf, size_t len, int *fds,
+		 unsigned *num_fds)
+{
+	char control[CMSG_SPACE(sizeof(int) * CTL_MAX_FDS)];
+	struct iovec iov = { buf, len };
+	struct msghdr msg = {};
+	struct cmsghdr *cmsg;
+	unsigned max_fds = num_fds ? *num_fds : 0;
+	unsigned n;
+	ssize_t ret;
+
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	/* No descriptors are passed back unless some were received */
+	if (num_fds)
+		*num_fds = 0;
+
+	ret = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+	if (ret < 0)
+		return ret;
+
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET ||
+		    cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+
+		n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+
+		/* Don't leak descriptors the caller did not ask for */
+		if (n > max_fds) {
+			while (n--)
+				close(((int *)CMSG_DATA(cmsg))[n]);
+			continue;
+		}
+
+		memcpy(fds, CMSG_DATA(cmsg), n * sizeof(int));
+		*num_fds = n;
+	}
+
+	return ret;
+}
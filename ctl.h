@@ -0,0 +1,143 @@
+/*
+ * Copyright (c) 2018, Bjorn Andersson <bjorn@kryo.se>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef __CTL_H__
+#define __CTL_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Requests on the local control socket. Every request is answered with a
+ * struct ta_ctl_resp, possibly carrying file descriptors.
+ */
+enum {
+	TA_CTL_SNAPSHOT = 1,
+	TA_CTL_HANDOFF = 2,
+	TA_CTL_EXPORT = 3,
+	TA_CTL_IMPORT = 4,
+	TA_CTL_STATS = 5,
+	TA_CTL_PERF = 6,
+	TA_CTL_TRACE = 7,
+};
+
+/*
+ * TA_CTL_EXPORT and TA_CTL_IMPORT carry one descriptor. The archive of a
+ * partition written to, or read from, it is the partition's snapshot image,
+ * see snapshot.h. Exports are answered once the whole archive is written.
+ */
+
+struct ta_ctl_req {
+	uint32_t cmd;
+	uint32_t instance;
+};
+
+struct ta_ctl_resp {
+	int32_t status;
+	uint32_t reserved;
+	uint64_t generation;
+};
+
+/*
+ * TA_CTL_STATS is answered with the service's counters, letting benchmarks
+ * verify that serving requests neither allocates nor runs into limits.
+ */
+struct ta_ctl_stats {
+	int32_t status;
+	uint32_t reserved;
+
+	uint64_t requests;
+	uint64_t allocs;
+	uint64_t frees;
+	uint64_t limit_hits;
+};
+
+#define TA_CTL_PERF_ENTRIES	32
+#define TA_CTL_PERF_STAGES	5
+#define TA_CTL_PERF_COUNTERS	4
+
+/*
+ * TA_CTL_PERF is answered with the hardware counters of each stage of the
+ * requests served, per service and message, see perf.h for the order of the
+ * stages and counters. The status is -EOPNOTSUPP unless profiling is enabled.
+ */
+struct ta_ctl_perf_entry {
+	uint16_t service;
+	uint16_t msg_id;
+	uint32_t reserved;
+
+	uint64_t samples;
+	uint64_t parked;
+	uint64_t park_ns;
+	uint64_t counters[TA_CTL_PERF_STAGES][TA_CTL_PERF_COUNTERS];
+};
+
+struct ta_ctl_perf {
+	int32_t status;
+	uint32_t num_entries;
+
+	struct ta_ctl_perf_entry entries[TA_CTL_PERF_ENTRIES];
+};
+
+/*
+ * TA_CTL_TRACE is answered with a memfd holding the in-memory trace ring, in
+ * the format of a trace file, see trace.h. The status is -EOPNOTSUPP unless
+ * tracing is enabled, or -EBUSY if the ring is drained into a trace file.
+ */
+
+#define CTL_MAX_FDS	16
+
+/*
+ * TA_CTL_HANDOFF is answered with one of these per partition, carrying the
+ * partition's snapshot memfd followed by the QRTR sockets of its services,
+ * after which the sender stops receiving requests and exits. On failure a
+ * single message with a negative status and no descriptors is sent.
+ */
+struct ta_ctl_handoff {
+	int32_t status;
+	uint32_t instance;
+	uint32_t num_partitions;
+	uint32_t num_services;
+	uint32_t services[CTL_MAX_FDS - 1];
+	uint32_t reserved;
+
+	/* CLOCK_MONOTONIC time at which the sender stopped receiving */
+	uint64_t stopped_ns;
+};
+
+int ctl_listen(const char *path);
+int ctl_connect(const char *path);
+
+ssize_t ctl_send(int sock, const void *buf, size_t len, const int *fds,
+		 unsigned num_fds);
+ssize_t ctl_recv(int sock, void *buf, size_t len, int *fds,
+		 unsigned *num_fds);
+
+#endif
@@ -0,0 +1,480 @@
+/*
+ * Copyright (c) 2018, Bjorn Andersson <bjorn@kryo.se>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#define _GNU_SOURCE
+#include <sys/timerfd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "layout.h"
+#include "log.h"
+#include "ta.h"
+
+#define MIN(x, y) ((x) < (y) ? (x) : (y))
+
+/*
+ * The unit store is periodically rebuilt with the payloads read most often
+ * packed at its front, see ta_compact(). The resulting order is kept in a
+ * layout file of "instance unit reads" records, hottest first, so that the
+ * next start lays out the partitions the same way right after loading them.
+ *
+ * Compaction runs from the event loop, so everything it needs is allocated
+ * as partitions are loaded, and the file is written by a thread of its own.
+ */
+struct layout_unit {
+	unsigned instance;
+	unsigned unit;
+	unsigned long reads;
+};
+
+static const char *layout_path;
+static char *layout_tmp;
+static int timer_fd = -1;
+static bool due;
+
+/* layout as read at startup, or as last saved, and the one being built */
+static struct layout_unit *hint;
+static unsigned num_hint;
+static struct layout_unit *records;
+static unsigned num_records;
+
+/* number of units per partition, and the space reserved for their records */
+static unsigned *instance_units;
+static unsigned num_instances;
+static unsigned file_hint;
+static unsigned max_records;
+
+/* scratch space for a single partition */
+static unsigned *ids;
+static unsigned long *reads;
+static unsigned max_units;
+
+/* records handed to the writer, guarded by save_lock */
+static pthread_mutex_t save_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t save_cond = PTHREAD_COND_INITIALIZER;
+static struct layout_unit *saving;
+static unsigned num_saving;
+static bool save_busy;
+static unsigned long save_errors;
+static unsigned long save_errors_seen;
+static unsigned long save_skipped;
+
+static unsigned long rounds;
+static unsigned long rebuilt;
+static unsigned long long compact_ns;
+
+static uint64_t layout_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int layout_read(const char *path)
+{
+	struct layout_unit entry;
+	struct layout_unit *tmp;
+	unsigned size = 0;
+	FILE *fp;
+
+	fp = fopen(path, "r");
+	if (!fp)
+		return errno == ENOENT ? 0 : -1;
+
+	while (fscanf(fp, "%u %u %lu", &entry.instance, &entry.unit,
+		      &entry.reads) == 3) {
+		if (num_hint == size) {
+			size = size ? size * 2 : 256;
+			tmp = realloc(hint, size * sizeof(*hint));
+			if (!tmp) {
+				fclose(fp);
+				return -1;
+			}
+			hint = tmp;
+		}
+
+		hint[num_hint++] = entry;
+	}
+
+	fclose(fp);
+
+	file_hint = num_hint;
+
+	return 0;
+}
+
+static int layout_write_all(int fd, const char *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len) {
+		n = write(fd, buf, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return -1;
+
+		buf += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/* Write the handed over records, without allocating or logging */
+static int layout_write(void)
+{
+	static char buf[4096];
+	size_t len = 0;
+	unsigned i;
+	int ret = 0;
+	int fd;
+
+	fd = open(layout_tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return -1;
+
+	for (i = 0; i < num_saving && !ret; i++) {
+		len += snprintf(buf + len, sizeof(buf) - len, "%u %u %lu\n",
+				saving[i].instance, saving[i].unit,
+				saving[i].reads);
+
+		/* A record is at most 64 bytes */
+		if (len > sizeof(buf) - 64) {
+			ret = layout_write_all(fd, buf, len);
+			len = 0;
+		}
+	}
+
+	if (!ret)
+		ret = layout_write_all(fd, buf, len);
+
+	if (close(fd) || ret)
+		return -1;
+
+	return rename(layout_tmp, layout_path);
+}
+
+static void *layout_writer(void *data)
+{
+	int ret;
+
+	pthread_mutex_lock(&save_lock);
+	for (;;) {
+		while (!save_busy)
+			pthread_cond_wait(&save_cond, &save_lock);
+		pthread_mutex_unlock(&save_lock);
+
+		ret = layout_write();
+
+		pthread_mutex_lock(&save_lock);
+		if (ret < 0)
+			save_errors++;
+		save_busy = false;
+		pthread_cond_broadcast(&save_cond);
+	}
+
+	return NULL;
+}
+
+/*
+ * Rebuild the layout every interval_s seconds, while the service is idle, and
+ * keep it in the file at path if given.
+ */
+int layout_init(const char *path, unsigned interval_s)
+{
+	struct itimerspec its = {};
+	pthread_t thread;
+
+	layout_path = path;
+
+	if (path) {
+		if (layout_read(path) < 0)
+			return -1;
+
+		if (asprintf(&layout_tmp, "%s.tmp", path) < 0)
+			return -1;
+
+		if (pthread_create(&thread, NULL, layout_writer, NULL))
+			return -1;
+
+		pthread_detach(thread);
+	}
+
+	if (!interval_s)
+		return 0;
+
+	timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (timer_fd < 0)
+		return -1;
+
+	its.it_value.tv_sec = interval_s;
+	its.it_interval.tv_sec = interval_s;
+
+	return timerfd_settime(timer_fd, 0, &its, NULL);
+}
+
+static int layout_grow(void **buf, size_t size)
+{
+	void *tmp;
+
+	tmp = realloc(*buf, size);
+	if (!tmp)
+		return -1;
+
+	*buf = tmp;
+
+	return 0;
+}
+
+/*
+ * Reserve the records of all partitions as they are now: a partition records
+ * at most one entry per unit, or keeps those of the file read at startup.
+ */
+static int layout_reserve(unsigned instance, unsigned units)
+{
+	unsigned total = file_hint;
+	unsigned i;
+	int ret = 0;
+
+	if (instance >= num_instances) {
+		if (layout_grow((void **)&instance_units,
+				(instance + 1) * sizeof(*instance_units)) < 0)
+			return -1;
+
+		memset(instance_units + num_instances, 0,
+		       (instance + 1 - num_instances) * sizeof(*instance_units));
+		num_instances = instance + 1;
+	}
+
+	instance_units[instance] = units;
+
+	if (units > max_units) {
+		if (layout_grow((void **)&ids, units * sizeof(*ids)) < 0 ||
+		    layout_grow((void **)&reads, units * sizeof(*reads)) < 0)
+			return -1;
+
+		max_units = units;
+	}
+
+	if (!layout_path)
+		return 0;
+
+	for (i = 0; i < num_instances; i++)
+		total += instance_units[i];
+
+	if (total <= max_records)
+		return 0;
+
+	if (layout_grow((void **)&hint, total * sizeof(*hint)) < 0 ||
+	    layout_grow((void **)&records, total * sizeof(*records)) < 0)
+		return -1;
+
+	/* The writer may still be busy with the previous buffer */
+	pthread_mutex_lock(&save_lock);
+	while (save_busy)
+		pthread_cond_wait(&save_cond, &save_lock);
+
+	if (layout_grow((void **)&saving, total * sizeof(*saving)) < 0)
+		ret = -1;
+	pthread_mutex_unlock(&save_lock);
+
+	if (!ret)
+		max_records = total;
+
+	return ret;
+}
+
+/*
+ * Lay out a freshly loaded partition as recorded by the previous run, and
+ * prepare for compacting it later on.
+ */
+void layout_apply(unsigned instance, struct ta *ta)
+{
+	struct ta_stats stats;
+	unsigned n = 0;
+	unsigned i;
+
+	if (timer_fd < 0 && !num_hint)
+		return;
+
+	ta_get_stats(ta, &stats);
+	if (layout_reserve(instance, stats.units) < 0) {
+		log_err("failed to reserve layout of partition %u", instance);
+		return;
+	}
+
+	for (i = 0; i < num_hint && n < max_units; i++) {
+		if (hint[i].instance == instance) {
+			ids[n] = hint[i].unit;
+			reads[n++] = hint[i].reads;
+		}
+	}
+
+	if (ta_compact(ta, ids, reads, n) < 0)
+		log_err("failed to apply layout to partition %u", instance);
+}
+
+int layout_fd(void)
+{
+	return timer_fd;
+}
+
+void layout_expired(void)
+{
+	uint64_t expirations;
+
+	read(timer_fd, &expirations, sizeof(expirations));
+	due = true;
+}
+
+bool layout_due(void)
+{
+	return due;
+}
+
+/*
+ * Append the layout of a partition to the new set of records, falling back to
+ * the previous records of partitions that saw no reads since the last round.
+ */
+static unsigned layout_collect(struct layout_unit *out, unsigned instance,
+			       struct ta *ta, unsigned max)
+{
+	unsigned n;
+	unsigned i;
+
+	n = ta_get_layout(ta, ids, reads, MIN(instance_units[instance], max));
+	for (i = 0; i < n; i++) {
+		out[i].instance = instance;
+		out[i].unit = ids[i];
+		out[i].reads = reads[i];
+	}
+
+	if (n)
+		return n;
+
+	for (i = 0; i < num_hint && n < max; i++) {
+		if (hint[i].instance == instance)
+			out[n++] = hint[i];
+	}
+
+	return n;
+}
+
+/* Hand the records to the writer, unless it is still busy with the last */
+static void layout_save(void)
+{
+	unsigned long errors;
+
+	pthread_mutex_lock(&save_lock);
+	errors = save_errors;
+
+	if (save_busy) {
+		save_skipped++;
+	} else {
+		memcpy(saving, hint, num_hint * sizeof(*hint));
+		num_saving = num_hint;
+		save_busy = true;
+		pthread_cond_broadcast(&save_cond);
+	}
+	pthread_mutex_unlock(&save_lock);
+
+	if (errors != save_errors_seen)
+		log_err("failed to write layout %s", layout_path);
+	save_errors_seen = errors;
+}
+
+/*
+ * Rebuild the layout of all partitions from the reads since the last round,
+ * and record the result. Only to be called while no requests are queued.
+ */
+void layout_compact(struct ta *(*partition_ta)(unsigned instance),
+		    unsigned count)
+{
+	struct layout_unit *tmp;
+	uint64_t start = layout_now();
+	bool collect;
+	unsigned i;
+	int ret;
+
+	due = false;
+
+	/* Partitions never passed to layout_apply() have no space reserved */
+	collect = layout_path && count <= num_instances;
+
+	/* Collected first, as compacting ages the read counters */
+	num_records = 0;
+	for (i = 0; i < count && collect; i++)
+		num_records += layout_collect(records + num_records, i,
+					      partition_ta(i),
+					      max_records - num_records);
+
+	for (i = 0; i < count; i++) {
+		ret = ta_compact(partition_ta(i), NULL, NULL, 0);
+		if (ret < 0)
+			log_err("failed to compact partition %u", i);
+		else if (ret > 0)
+			rebuilt++;
+	}
+
+	rounds++;
+	compact_ns += layout_now() - start;
+
+	if (!collect)
+		return;
+
+	tmp = hint;
+	hint = records;
+	num_hint = num_records;
+	records = tmp;
+
+	layout_save();
+}
+
+void layout_dump_stats(FILE *fp)
+{
+	if (timer_fd < 0 && !layout_path)
+		return;
+
+	fprintf(fp, "layout: %u units recorded, %lu saves skipped, %lu failed\n",
+		num_hint, save_skipped, save_errors_seen);
+	fprintf(fp, "layout compactions: %lu rebuilt in %lu rounds (avg %llu us)\n",
+		rebuilt, rounds, rounds ? compact_ns / rounds / 1000 : 0);
+}
@@ -0,0 +1,272 @@
+/*
+ * Copyright (c) 2018, Bjorn Andersson <bjorn@kryo.se>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+
+#define LOG_FLUSH_INTERVAL_MS	50
+#define LOG_MSG_SIZE		192
+
+#define LOG_MAX_SITES		64
+#define LOG_BURST		10
+#define LOG_WINDOW_NS		1000000000ull
+
+/*
+ * Diagnostics are formatted into a single producer, single consumer ring by
+ * the event loop and written out by a background thread, so logging never
+ * waits for stderr. Each call site, identified by its format string, may log
+ * LOG_BURST messages per second; the rest are counted and reported with the
+ * next message that gets through. Messages are dropped when the ring is full.
+ */
+struct log_record {
+	uint64_t timestamp;
+	int level;
+	unsigned long suppressed;
+	char msg[LOG_MSG_SIZE];
+};
+
+struct log_site {
+	const char *fmt;
+	uint64_t window;
+	unsigned count;
+	unsigned long suppressed;
+};
+
+static struct log_record *ring;
+static unsigned ring_size;
+static _Atomic uint64_t ring_head;
+static _Atomic uint64_t ring_tail;
+static _Atomic unsigned long dropped;
+
+/* serializes the background thread with log_flush() */
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct log_site sites[LOG_MAX_SITES];
+static unsigned long total_suppressed;
+
+static const char *level_names[] = {
+	[LOG_ERR] = "error",
+	[LOG_WARN] = "warning",
+	[LOG_INFO] = "info",
+};
+
+static uint64_t log_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void log_write(const struct log_record *rec)
+{
+	char line[LOG_MSG_SIZE + 96];
+	size_t len;
+	ssize_t n;
+	char *buf;
+
+	len = snprintf(line, sizeof(line), "%llu.%06llu %s: %s",
+		       (unsigned long long)(rec->timestamp / 1000000000ull),
+		       (unsigned long long)(rec->timestamp % 1000000000ull) / 1000,
+		       level_names[rec->level], rec->msg);
+	if (len < sizeof(line) && rec->suppressed)
+		len += snprintf(line + len, sizeof(line) - len,
+				" (%lu similar messages suppressed)",
+				rec->suppressed);
+	if (len > sizeof(line) - 2)
+		len = sizeof(line) - 2;
+	line[len++] = '\n';
+
+	for (buf = line; len; buf += n, len -= n) {
+		n = write(STDERR_FILENO, buf, len);
+		if (n < 0 && errno == EINTR)
+			n = 0;
+		else if (n < 0)
+			return;
+	}
+}
+
+static void log_drain(void)
+{
+	uint64_t head;
+	uint64_t tail;
+
+	pthread_mutex_lock(&drain_lock);
+
+	head = atomic_load_explicit(&ring_head, memory_order_acquire);
+	tail = atomic_load_explicit(&ring_tail, memory_order_relaxed);
+
+	while (tail != head) {
+		log_write(&ring[tail % ring_size]);
+		tail++;
+
+		atomic_store_explicit(&ring_tail, tail, memory_order_release);
+	}
+
+	pthread_mutex_unlock(&drain_lock);
+}
+
+static void *log_flush_thread(void *data)
+{
+	struct timespec interval = { 0, LOG_FLUSH_INTERVAL_MS * 1000000 };
+
+	for (;;) {
+		log_drain();
+		nanosleep(&interval, NULL);
+	}
+
+	return NULL;
+}
+
+/*
+ * Write out the queued messages before returning, e.g. as the process exits,
+ * where the last ones tend to explain why.
+ */
+void log_flush(void)
+{
+	if (ring)
+		log_drain();
+}
+
+int log_init(unsigned entries)
+{
+	pthread_t thread;
+	int ret;
+
+	ring_size = entries;
+	ring = calloc(entries, sizeof(*ring));
+	if (!ring)
+		return -1;
+
+	ret = pthread_create(&thread, NULL, log_flush_thread, NULL);
+	if (ret) {
+		free(ring);
+		ring = NULL;
+		return -1;
+	}
+
+	pthread_detach(thread);
+
+	atexit(log_flush);
+
+	return 0;
+}
+
+static struct log_site *log_site(const char *fmt)
+{
+	unsigned hash = ((uintptr_t)fmt >> 3) % LOG_MAX_SITES;
+	unsigned i;
+
+	for (i = 0; i < LOG_MAX_SITES; i++) {
+		struct log_site *site = &sites[(hash + i) % LOG_MAX_SITES];
+
+		if (site->fmt == fmt)
+			return site;
+
+		if (!site->fmt) {
+			site->fmt = fmt;
+			return site;
+		}
+	}
+
+	/* Out of sites, rate limit what's left together */
+	return &sites[hash];
+}
+
+void log_printf(int level, const char *fmt, ...)
+{
+	struct log_record *rec;
+	struct log_site *site;
+	uint64_t head;
+	uint64_t tail;
+	uint64_t now;
+	va_list ap;
+
+	now = log_now();
+
+	site = log_site(fmt);
+	if (now - site->window >= LOG_WINDOW_NS) {
+		site->window = now;
+		site->count = 0;
+	}
+
+	if (site->count >= LOG_BURST) {
+		site->suppressed++;
+		total_suppressed++;
+		return;
+	}
+	site->count++;
+
+	/* Not started yet, or failed to start, write it directly */
+	if (!ring) {
+		va_start(ap, fmt);
+		vfprintf(stderr, fmt, ap);
+		va_end(ap);
+		fputc('\n', stderr);
+		return;
+	}
+
+	head = atomic_load_explicit(&ring_head, memory_order_relaxed);
+	tail = atomic_load_explicit(&ring_tail, memory_order_acquire);
+	if (head - tail >= ring_size) {
+		atomic_fetch_add(&dropped, 1);
+		return;
+	}
+
+	rec = &ring[head % ring_size];
+	rec->timestamp = now;
+	rec->level = level;
+	rec->suppressed = site->suppressed;
+	site->suppressed = 0;
+
+	va_start(ap, fmt);
+	vsnprintf(rec->msg, sizeof(rec->msg), fmt, ap);
+	va_end(ap);
+
+	atomic_store_explicit(&ring_head, head + 1, memory_order_release);
+}
+
+void log_dump_stats(FILE *fp)
+{
+	fprintf(fp, "log messages: %llu (%lu dropped, %lu suppressed)\n",
+		(unsigned long long)atomic_load(&ring_head),
+		atomic_load(&dropped), total_suppressed);
+}
@@ -0,0 +1,206 @@
+/*
+ * Copyright (c) 2018, Bjorn Andersson <bjorn@kryo.se>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdint.h>
+#include <string.h>
+
+#include "lz.h"
+
+#define LZ_HASH_BITS		12
+#define LZ_MIN_MATCH		4
+#define LZ_LAST_LITERALS	5
+#define LZ_MFLIMIT		12
+#define LZ_MAX_OFFSET		0xffff
+
+static uint32_t lz_read32(const uint8_t *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static unsigned lz_hash(uint32_t v)
+{
+	return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+static uint8_t *lz_put_len(uint8_t *op, size_t len)
+{
+	for (; len >= 255; len -= 255)
+		*op++ = 255;
+	*op++ = len;
+
+	return op;
+}
+
+/* Worst case number of bytes needed to encode a sequence */
+static size_t lz_seq_size(size_t litlen, size_t matchlen)
+{
+	return 1 + litlen / 255 + 1 + litlen + 2 + matchlen / 255 + 1;
+}
+
+ssize_t lz_compress(const void *src, size_t len, void *dst, size_t cap)
+{
+	uint32_t table[1 << LZ_HASH_BITS] = { 0 };
+	const uint8_t *base = src;
+	const uint8_t *iend = base + len;
+	const uint8_t *anchor = base;
+	const uint8_t *ip = base;
+	const uint8_t *ref;
+	uint8_t *op = dst;
+	uint8_t *oend = op + cap;
+	uint8_t *token;
+	size_t litlen;
+	size_t ml;
+	unsigned h;
+
+	while (len >= LZ_MFLIMIT && ip < iend - LZ_MFLIMIT) {
+		h = lz_hash(lz_read32(ip));
+		ref = base + table[h];
+		table[h] = ip - base;
+
+		if (ref >= ip || ip - ref > LZ_MAX_OFFSET ||
+		    lz_read32(ref) != lz_read32(ip)) {
+			ip++;
+			continue;
+		}
+
+		ml = LZ_MIN_MATCH;
+		while (ip + ml < iend - LZ_LAST_LITERALS && ref[ml] == ip[ml])
+			ml++;
+
+		litlen = ip - anchor;
+		if (lz_seq_size(litlen, ml) > oend - op)
+			return -1;
+
+		token = op++;
+		*token = (litlen >= 15 ? 15 : litlen) << 4;
+		if (litlen >= 15)
+			op = lz_put_len(op, litlen - 15);
+
+		memcpy(op, anchor, litlen);
+		op += litlen;
+
+		*op++ = (ip - ref) & 0xff;
+		*op++ = (ip - ref) >> 8;
+
+		ml -= LZ_MIN_MATCH;
+		*token |= ml >= 15 ? 15 : ml;
+		if (ml >= 15)
+			op = lz_put_len(op, ml - 15);
+
+		ip += ml + LZ_MIN_MATCH;
+		anchor = ip;
+	}
+
+	litlen = iend - anchor;
+	if (lz_seq_size(litlen, 0) > oend - op)
+		return -1;
+
+	token = op++;
+	*token = (litlen >= 15 ? 15 : litlen) << 4;
+	if (litlen >= 15)
+		op = lz_put_len(op, litlen - 15);
+
+	memcpy(op, anchor, litlen);
+	op += litlen;
+
+	return op - (uint8_t *)dst;
+}
+
+static int lz_get_len(const uint8_t **ip, const uint8_t *iend, size_t *len)
+{
+	uint8_t b;
+
+	do {
+		if (*ip >= iend)
+			return -1;
+
+		b = *(*ip)++;
+		*len += b;
+	} while (b == 255);
+
+	return 0;
+}
+
+ssize_t lz_decompress(const void *src, size_t len, void *dst, size_t cap)
+{
+	const uint8_t *ip = src;
+	const uint8_t *iend = ip + len;
+	const uint8_t *ref;
+	uint8_t *op = dst;
+	uint8_t *oend = op + cap;
+	size_t litlen;
+	size_t offset;
+	size_t ml;
+	uint8_t token;
+
+	while (ip < iend) {
+		token = *ip++;
+
+		litlen = token >> 4;
+		if (litlen == 15 && lz_get_len(&ip, iend, &litlen) < 0)
+			return -1;
+
+		if (litlen > iend - ip || litlen > oend - op)
+			return -1;
+
+		memcpy(op, ip, litlen);
+		op += litlen;
+		ip += litlen;
+
+		/* The last sequence carries literals only */
+		if (ip == iend)
+			break;
+
+		if (iend - ip < 2)
+			return -1;
+
+		offset = ip[0] | ip[1] << 8;
+		ip += 2;
+		if (!offset || offset > op - (uint8_t *)dst)
+			return -1;
+
+		ml = token & 15;
+		if (ml == 15 && lz_get_len(&ip, iend, &ml) < 0)
+			return -1;
+		ml += LZ_MIN_MATCH;
+
+		if (ml > oend - op)
+			return -1;
+
+		/* Byte-wise, as the match may overlap the output */
+		for (ref = op - offset; ml; ml--)
+			*op++ = *ref++;
+	}
+
+	return op - (uint8_t *)dst;
+}
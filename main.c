@@ -28,463 +28,1867 @@
  * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
  * POSSIBILITY OF SUCH DAMAGE.
  */
+#define _GNU_SOURCE
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 #include <libqrtr.h>
 
 #include "qmi_ta227.h"
 #include "qmi_ta228.h"
 #include "qmi_svc229.h"
+#include "alloc.h"
+#include "ctl.h"
+#include "layout.h"
+#include "log.h"
+#include "peer.h"
+#include "perf.h"
+#include "qmi_size.h"
+#include "resident.h"
+#include "rules.h"
+#include "rt.h"
+#include "service.h"
+#include "snapshot.h"
 #include "ta.h"
+#include "trace.h"
+#include "warmup.h"
 
 #define MAX(x, y) ((x) > (y) ? (x) : (y))
 
+#define REQUEST_POOL_SIZE	256
+#define RECV_BATCH		16
+#define FLUSH_INTERVAL_US	5000
+#define MAX_CTL_CONNS		8
+#define LOAD_BUDGET		64
+#define MAX_RULE_SERVICES	16
+#define MAX_PRIORITIES		16
+#define LOG_RING_SIZE		256
+#define HANDOFF_DRAIN_MS	1000
+#define RESIDENT_STACK_SIZE	(256 * 1024)
+#define LAYOUT_INTERVAL		60
+#define WARMUP_WINDOW		30
+
+#ifndef F_SEAL_FUTURE_WRITE
+#define F_SEAL_FUTURE_WRITE	0x0010
+#endif
+
 extern char *__progname;
 
-static int iterator = 0;
+struct partition {
+	const char *path;
+	struct ta *ta;
+
+	int iterator;
+
+	/* requests for units the load hasn't reached yet */
+	struct request *parked_head;
+	struct request *parked_tail;
+	unsigned long parked;
+
+	/* snapshot of the unit store handed out to local clients */
+	uint64_t generation;
+	int snap_fd;
+	int gen_fd;
+	struct ta_snap_gen *gen;
+};
+
+static struct partition *partitions;
+static unsigned num_partitions;
+
+static struct service *services;
+static unsigned num_services;
+
+static volatile sig_atomic_t dump_requested;
+static volatile sig_atomic_t reload_requested;
+
+static int ctl_sock = -1;
+static int ctl_conns[MAX_CTL_CONNS];
 
-static int ta227_open(int sock, struct qrtr_packet *pkt)
+static int handed_off;
+static uint64_t handoff_deadline;
+
+static unsigned long requests;
+
+/* Wakeups of the main loop, and the timer of the coalescing services */
+static unsigned long wakeups;
+static int coalesce_fd = -1;
+
+static uint64_t now_ns(void)
 {
-	DEFINE_QRTR_PACKET(resp_buf, 32);
-	struct ta227_open_resp resp;
-	struct ta227_open_req req = {};
-	unsigned int txn;
-	int ret;
+	struct timespec ts;
 
-	ret = qmi_decode_message(&req, &txn, pkt, QMI_REQUEST, TA227_OPEN,
-				 ta227_open_req_ei);
-	if (ret < 0) {
-		fprintf(stderr, "failed to decode TA227 open request\n");
-		resp.result = 1;
-	} else {
-		resp.result = 0;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
 
-		/* Reset iterator */
-		iterator = 0;
+static void dump_stats(void)
+{
+	static unsigned long last_wakeups;
+	static uint64_t last_dump;
+	struct ta_stats stats;
+	struct service *svc;
+	uint64_t now;
+	unsigned i;
+
+	for (i = 0; i < num_partitions; i++) {
+		ta_get_stats(partitions[i].ta, &stats);
+
+		fprintf(stderr, "partition %u: %s%s\n", i, partitions[i].path,
+			ta_loaded(partitions[i].ta) ? "" : " (loading)");
+		fprintf(stderr, "units: %u (%zu bytes)\n", stats.units, stats.total_bytes);
+		fprintf(stderr, "payloads: %u (%zu bytes)\n", stats.blobs, stats.unique_bytes);
+		fprintf(stderr, "resident: %zu bytes (%u compressed, %zu bytes raw)\n",
+			stats.stored_bytes + stats.hot_bytes, stats.compressed,
+			stats.compressed_bytes);
+		fprintf(stderr, "hot cache: %zu bytes\n", stats.hot_bytes);
+		fprintf(stderr, "hot reads: %lu (avg %llu ns)\n", stats.hot_reads,
+			stats.hot_reads ? stats.hot_ns / stats.hot_reads : 0);
+		fprintf(stderr, "cold reads: %lu (avg %llu ns)\n", stats.cold_reads,
+			stats.cold_reads ? stats.cold_ns / stats.cold_reads : 0);
+		fprintf(stderr, "compactions: %u (read payloads span %zu bytes)\n",
+			stats.compactions, stats.hot_span);
+		fprintf(stderr, "parked requests: %lu\n", partitions[i].parked);
 	}
 
-	ret = qmi_encode_message(&resp_buf, QMI_RESPONSE, TA227_OPEN, txn,
-				 &resp, ta227_open_resp_ei);
-	if (ret < 0) {
-		fprintf(stderr, "failed to encode TA227 open response\n");
-		return ret;
+	fprintf(stderr, "requests: %lu\n", requests);
+
+	now = now_ns();
+	fprintf(stderr, "wakeups: %lu (%llu/s since last dump)\n", wakeups,
+		(unsigned long long)(wakeups - last_wakeups) * 1000000000ull /
+		(now - last_dump));
+	last_wakeups = wakeups;
+	last_dump = now;
+
+	for (i = 0; i < num_services; i++) {
+		svc = &services[i];
+		if (!svc->batches)
+			continue;
+
+		fprintf(stderr, "service %u:%u: %lu requests in %lu coalesced wakeups (avg delay %llu us)\n",
+			svc->type->id, svc->instance, svc->batched,
+			svc->batches,
+			(unsigned long long)svc->delay_ns / svc->batches / 1000);
 	}
 
-	ret = qrtr_sendto(sock, pkt->node, pkt->port, resp_buf.data,
-			  resp_buf.data_len);
-	if (ret < 0)
-		fprintf(stderr, "failed to send TA227 open response\n");
+	peer_dump_stats(stderr);
+	warmup_dump_stats(stderr);
+	layout_dump_stats(stderr);
+	rules_dump_stats(stderr);
+	trace_dump_stats(stderr);
+	resident_dump_stats(stderr);
+	alloc_dump_stats(stderr);
+	perf_dump_stats(stderr);
+	rt_dump_stats(stderr);
+	log_dump_stats(stderr);
+}
+
+static void sigusr1_handler(int sig)
+{
+	dump_requested = 1;
+}
+
+static void sighup_handler(int sig)
+{
+	reload_requested = 1;
+}
+
+/* Units not indexed yet are answered once the load reaches them */
+static bool unit_pending(struct partition *part, unsigned unit)
+{
+	size_t size;
+
+	return !ta_loaded(part->ta) && ta_get_size(part->ta, unit, &size) < 0;
+}
+
+static int ta227_open(struct service *svc, struct qrtr_packet *pkt,
+		      unsigned int txn, const void *req, void *resp)
+{
+	struct ta227_open_resp *open_resp = resp;
+
+	open_resp->result = 0;
+
+	/* Reset iterator */
+	svc->part->iterator = 0;
 
 	return 0;
 }
 
-static int ta227_close(int sock, struct qrtr_packet *pkt)
+static int ta227_close(struct service *svc, struct qrtr_packet *pkt,
+		       unsigned int txn, const void *req, void *resp)
 {
-	DEFINE_QRTR_PACKET(resp_buf, 32);
-	struct ta227_close_resp resp = { 0 };
-	struct ta227_close_req req = {};
-	unsigned int txn;
-	int ret;
+	struct ta227_close_resp *close_resp = resp;
 
-	ret = qmi_decode_message(&req, &txn, pkt, QMI_REQUEST, TA227_CLOSE,
-				 ta227_close_req_ei);
-	if (ret < 0) {
-		fprintf(stderr, "failed to decode TA227 close request\n");
-		resp.result = 1;
+	close_resp->result = 0;
+
+	return 0;
+}
+
+static void ta227_read_fill(const void *buf, size_t size,
+			    struct ta227_read_resp *resp)
+{
+	/* XXX: Not sure what to do beyond SMD's maximum of 4k */
+	if (!buf || size > 4096) {
+		resp->result = 1;
 	} else {
-		resp.result = 0;
+		resp->result = 0;
+		resp->data_len = size;
+		memcpy(resp->data, buf, size);
 	}
+}
 
-	ret = qmi_encode_message(&resp_buf, QMI_RESPONSE, TA227_CLOSE, txn,
-				 &resp, ta227_close_resp_ei);
-	if (ret < 0) {
-		fprintf(stderr, "failed to encode TA227 close response\n");
-		return ret;
+static int ta227_read(struct service *svc, struct qrtr_packet *pkt,
+		      unsigned int txn, const void *req, void *resp)
+{
+	const struct ta227_read_req *read_req = req;
+	size_t size;
+	size_t len;
+	void *buf;
+
+	trace_unit(read_req->unit);
+	if (unit_pending(svc->part, read_req->unit))
+		return SERVICE_PARKED;
+
+	warmup_record(svc->instance, read_req->unit);
+
+	buf = warmup_response(svc->instance, read_req->unit, WARM_TA227_READ,
+			      &len);
+	if (buf) {
+		ta_count_read(svc->part->ta, read_req->unit);
+		service_send_prepared(svc, pkt, txn, buf, len);
+		return SERVICE_RESPONDED;
 	}
 
-	ret = qrtr_sendto(sock, pkt->node, pkt->port, resp_buf.data,
-			  resp_buf.data_len);
-	if (ret < 0)
-		fprintf(stderr, "failed to send TA227 close response\n");
+	buf = ta_get(svc->part->ta, read_req->unit, &size);
+	perf_mark(PERF_LOOKUP);
+	ta227_read_fill(buf, size, resp);
+	perf_mark(PERF_COPY);
 
-	return ret;
+	return 0;
 }
 
-static int ta227_read(int sock, struct qrtr_packet *pkt)
+static int ta227_iterate(struct service *svc, struct qrtr_packet *pkt,
+			 unsigned int txn, const void *req, void *resp)
 {
-	DEFINE_QRTR_PACKET(resp_buf, 8192);
-	struct ta227_read_resp resp = {};
-	struct ta227_read_req req = {};
-	unsigned int txn;
+	struct ta227_iterate_resp *iterate_resp = resp;
 	size_t size;
-	void *buf;;
-	int ret;
 
-	ret = qmi_decode_message(&req, &txn, pkt, QMI_REQUEST, TA227_READ,
-				 ta227_read_req_ei);
-	if (ret < 0) {
-		fprintf(stderr, "[TA227] failed to decode read message\n");
-		resp.result = 1;
-	} else {
-		buf = ta_get(req.unit, &size);
+	/* The iteration order is only stable once all units are indexed */
+	if (!ta_loaded(svc->part->ta))
+		return SERVICE_PARKED;
 
-		/* XXX: Not sure what to do beyond SMD's maximum of 4k */
-		if (size > 4096) {
-			resp.result = 1;
-		} else {
-			resp.result = 0;
-			resp.data_len = size;
-			memcpy(resp.data, buf, size);
-		}
-	}
+	svc->part->iterator = ta_get_next(svc->part->ta, svc->part->iterator,
+					  &size);
+	if (svc->part->iterator < 0) {
+		iterate_resp->result = 1;
+	} else {
+		iterate_resp->result = 0;
+		iterate_resp->unit_valid = true;
+		iterate_resp->unit = svc->part->iterator;
 
-	ret = qmi_encode_message(&resp_buf, QMI_RESPONSE, TA227_READ, txn,
-				 &resp, ta227_read_resp_ei);
-	if (ret < 0) {
-		fprintf(stderr, "[TA227] failed to encode read response\n");
-		return ret;
+		iterate_resp->size_valid = true;
+		iterate_resp->size = size;
 	}
 
-	ret = qrtr_sendto(sock, pkt->node, pkt->port, resp_buf.data,
-			  resp_buf.data_len);
-	if (ret < 0)
-		printf("[TA227] failed to send read response\n");
-
-	return  ret;
+	return 0;
 }
 
-static int ta227_iterate(int sock, struct qrtr_packet *pkt)
+static const struct qmi_handler ta227_handlers[] = {
+	{ TA227_OPEN, "open", ta227_open_req_ei, ta227_open_resp_ei, ta227_open },
+	{ TA227_CLOSE, "close", ta227_close_req_ei, ta227_close_resp_ei, ta227_close },
+	{ TA227_READ, "read", ta227_read_req_ei, ta227_read_resp_ei, ta227_read },
+	{ TA227_ITERATE, "iterate", ta227_iterate_req_ei, ta227_iterate_resp_ei, ta227_iterate },
+	{}
+};
+
+static int ta228_get_size(struct service *svc, struct qrtr_packet *pkt,
+			  unsigned int txn, const void *req, void *resp)
 {
-	DEFINE_QRTR_PACKET(resp_buf, 64);
-	struct ta227_iterate_resp resp = { 0 };
-	struct ta227_iterate_req req = {};
-	unsigned int txn;
+	const struct ta228_get_size_req *size_req = req;
+	struct ta228_get_size_resp *size_resp = resp;
 	size_t size;
 	int ret;
 
-	ret = qmi_decode_message(&req, &txn, pkt, QMI_REQUEST, TA227_ITERATE,
-				 ta227_iterate_req_ei);
+	trace_unit(size_req->unit);
+	if (unit_pending(svc->part, size_req->unit))
+		return SERVICE_PARKED;
+
+	ret = ta_get_size(svc->part->ta, size_req->unit, &size);
 	if (ret < 0) {
-		fprintf(stderr, "failed to decode TA227 iterate request\n");
-		resp.result = 1;
+		size_resp->result = 1;
 	} else {
-		iterator = ta_get_next(iterator, &size);
-		if (iterator < 0) {
-			resp.result = 1;
-		} else {
-			resp.result = 0;
-			resp.unit_valid = true;
-			resp.unit = iterator;
-
-			resp.size_valid = true;
-			resp.size = size;
-		}
+		size_resp->result = 0;
+		size_resp->size_valid = true;
+		size_resp->size = size;
 	}
 
-	ret = qmi_encode_message(&resp_buf, QMI_RESPONSE, TA227_ITERATE, txn,
-				 &resp, ta227_iterate_resp_ei);
-	if (ret < 0) {
-		fprintf(stderr, "failed to encode TA227 iterate response\n");
-		return ret;
+	return 0;
+}
+
+static void ta228_read_fill(const void *buf, size_t size,
+			    struct ta228_read_resp *resp)
+{
+	if (!buf) {
+		resp->result = 1;
+	} else {
+		resp->result = 0;
+		resp->data_len = size;
+		memcpy(resp->data, buf, size);
 	}
+}
+
+static int ta228_read(struct service *svc, struct qrtr_packet *pkt,
+		      unsigned int txn, const void *req, void *resp)
+{
+	const struct ta228_read_req *read_req = req;
+	size_t size;
+	size_t len;
+	void *buf;
 
-	ret = qrtr_sendto(sock, pkt->node, pkt->port, resp_buf.data,
-			  resp_buf.data_len);
-	if (ret < 0)
-		fprintf(stderr, "failed to send TA227 iterate response\n");
+	trace_unit(read_req->unit);
+	if (unit_pending(svc->part, read_req->unit))
+		return SERVICE_PARKED;
 
+	warmup_record(svc->instance, read_req->unit);
 
-	return ret;
+	buf = warmup_response(svc->instance, read_req->unit, WARM_TA228_READ,
+			      &len);
+	if (buf) {
+		ta_count_read(svc->part->ta, read_req->unit);
+		service_send_prepared(svc, pkt, txn, buf, len);
+		return SERVICE_RESPONDED;
+	}
+
+	buf = ta_get(svc->part->ta, read_req->unit, &size);
+	perf_mark(PERF_LOOKUP);
+	ta228_read_fill(buf, size, resp);
+	perf_mark(PERF_COPY);
+
+	return 0;
 }
 
-static int handle_ta227(int sock, struct qrtr_packet *pkt)
-{
-	unsigned int msg_id;
-	int ret;
+static const struct qmi_handler ta228_handlers[] = {
+	{ TA228_GET_SIZE, "get_size", ta228_get_size_req_ei, ta228_get_size_resp_ei, ta228_get_size },
+	{ TA228_READ, "read", ta228_read_req_ei, ta228_read_resp_ei, ta228_read },
+	{}
+};
 
-	switch (pkt->type) {
-	case QRTR_TYPE_DATA:
-		ret = qmi_decode_header(pkt, &msg_id);
-		if (ret < 0)
-			return ret;
+static int svc229_handle_1(struct service *svc, struct qrtr_packet *pkt,
+			   unsigned int txn, const void *req, void *resp)
+{
+	struct svc229_resp *msg1_resp = resp;
 
-		switch (msg_id) {
-		case TA227_OPEN:
-			ta227_open(sock, pkt);
-			break;
-		case TA227_CLOSE:
-			ta227_close(sock, pkt);
-			break;
-		case TA227_READ:
-			ta227_read(sock, pkt);
-			break;
-		case TA227_ITERATE:
-			ta227_iterate(sock, pkt);
-			break;
-		default:
-			fprintf(stderr, "Unhandled TA227 message: %d\n",
-				msg_id);
-			break;
-		}
-		break;
-	}
+	msg1_resp->result = 0;
+	msg1_resp->data_len = 1;
+	msg1_resp->data[0] = 0;
 
 	return 0;
 }
 
-static int ta228_get_size(int sock, struct qrtr_packet *pkt)
+static const struct qmi_handler svc229_handlers[] = {
+	{ SVC229_MSG1, "msg1", svc229_req_ei, svc229_resp_ei, svc229_handle_1 },
+	{}
+};
+
+/* Services known only from the rules file, answered by their rules alone */
+static const struct qmi_handler rule_handlers[] = {
+	{}
+};
+
+static const struct service_type builtin_types[] = {
+	{ 227, "TA227", ta227_handlers, 1 },
+	{ 228, "TA228", ta228_handlers, 1 },
+	{ 229, "SVC229", svc229_handlers, 1 },
+};
+
+#define NUM_BUILTIN_TYPES	(sizeof(builtin_types) / sizeof(builtin_types[0]))
+
+static struct service_type *service_types;
+static unsigned num_service_types;
+
+static int dispatch_request(struct request *req)
 {
-	DEFINE_QRTR_PACKET(resp_buf, 32);
-	struct ta228_get_size_resp resp = {};
-	struct ta228_get_size_req req = {};
-	unsigned int txn;
-	size_t size;
-	void *buf;;
+	struct service *svc = &services[req->svc];
+	struct partition *part = svc->part;
+	uint64_t parked_ns = 0;
+	uint64_t since;
 	int ret;
 
-	ret = qmi_decode_message(&req, &txn, pkt, QMI_REQUEST, TA228_GET_SIZE,
-				 ta228_get_size_req_ei);
-	if (ret < 0) {
-		fprintf(stderr, "[TA228] failed to decode get_size message\n");
-		resp.result = 1;
-	} else {
-		buf = ta_get(req.unit, &size);
-
-		if (!buf) {
-			resp.result = 1;
-		} else {
-			resp.result = 0;
-			resp.size_valid = true;
-			resp.size = size;;
-		}
+	if (req->dispatched && perf_enabled())
+		parked_ns = now_ns() - req->dispatched;
+
+	since = trace_begin(&req->pkt, svc->type->id, svc->instance,
+			    req->dispatched);
+	perf_begin(&req->pkt, svc->type->id, parked_ns);
+	resident_fault_begin();
+	ret = service_dispatch(svc, &req->pkt);
+	resident_fault_end();
+	if (ret != SERVICE_PARKED) {
+		perf_end();
+		trace_end();
+		return 0;
 	}
 
-	ret = qmi_encode_message(&resp_buf, QMI_RESPONSE, TA228_GET_SIZE, txn,
-				 &resp, ta228_get_size_resp_ei);
-	if (ret < 0) {
-		fprintf(stderr, "[TA228] failed to encode get_size response\n");
-		return ret;
-	}
+	/* Traced and profiled from the first dispatch once it's answered */
+	perf_park();
+	if (!req->dispatched)
+		req->dispatched = since ? since : now_ns();
 
-	ret = qrtr_sendto(sock, pkt->node, pkt->port, resp_buf.data,
-			  resp_buf.data_len);
-	if (ret < 0)
-		fprintf(stderr, "[TA228] failed to send response\n");
+	req->next = NULL;
+	if (part->parked_tail)
+		part->parked_tail->next = req;
+	else
+		part->parked_head = req;
+	part->parked_tail = req;
 
-	return ret;
+	return 1;
 }
 
-static int ta228_read(int sock, struct qrtr_packet *pkt)
+static int serve_request(struct request *req)
 {
-	DEFINE_QRTR_PACKET(resp_buf, 8192);
-	struct ta228_read_resp resp = {};
-	struct ta228_read_req req = {};
-	unsigned int txn;
-	size_t size;
-	void *buf;
-	int ret;
+	struct service *svc = &services[req->svc];
 
-	ret = qmi_decode_message(&req, &txn, pkt, QMI_REQUEST, TA228_READ,
-				 ta228_read_req_ei);
-	if (ret < 0) {
-		fprintf(stderr, "[TA228] failed to decode message\n");
-		resp.result = 1;
-	} else {
-		buf = ta_get(req.unit, &size);
+	requests++;
 
-		resp.result = 0;
-		resp.data_len = size;
-		memcpy(resp.data, buf, size);
-	}
+	if (!dispatch_request(req))
+		return 0;
 
-	ret = qmi_encode_message(&resp_buf, QMI_RESPONSE, TA228_READ, txn,
-				 &resp, ta228_read_resp_ei);
-	if (ret < 0) {
-		fprintf(stderr, "[TA228] failed to encode response\n");
-		return ret;
+	svc->part->parked++;
+	return 1;
+}
+
+/* Retry the parked requests, those still not answerable are parked again */
+static void partition_unpark(struct partition *part)
+{
+	struct request *req;
+	struct request *next;
+
+	req = part->parked_head;
+	part->parked_head = NULL;
+	part->parked_tail = NULL;
+
+	for (; req; req = next) {
+		next = req->next;
+
+		if (!dispatch_request(req))
+			request_free(req);
 	}
+}
 
-	ret = qrtr_sendto(sock, pkt->node, pkt->port, resp_buf.data,
-			  resp_buf.data_len);
-	if (ret < 0)
-		printf("[TA228] failed to send response\n");
+static void partition_drop_parked(unsigned node, unsigned port)
+{
+	struct request **link;
+	struct partition *part;
+	struct request *req;
+	unsigned i;
+
+	for (i = 0; i < num_partitions; i++) {
+		part = &partitions[i];
+		part->parked_tail = NULL;
+
+		for (link = &part->parked_head; (req = *link); ) {
+			if (req->pkt.node == node &&
+			    (port == PEER_ANY_PORT || req->pkt.port == port)) {
+				*link = req->next;
+				request_free(req);
+			} else {
+				part->parked_tail = req;
+				link = &req->next;
+			}
+		}
+	}
+}
 
-	return ret;
+/* Answer busy to a request that could not be queued, tracing it as shed */
+static void service_shed(struct service *svc, struct request *req)
+{
+	trace_begin(&req->pkt, svc->type->id, svc->instance, 0);
+	trace_disposition(TRACE_SHED);
+	service_send_busy(svc, &req->pkt);
+	trace_mark(TRACE_SEND);
+	trace_end();
 }
 
-static int handle_ta228(int sock, struct qrtr_packet *pkt)
+/* Returns the number of packets received, or a negative error */
+static int service_recv(struct service *svc)
 {
-	unsigned int msg_id;
+	static struct request shed_req;
+	struct sockaddr_qrtr sq;
+	struct request *req;
+	const void *resp;
+	socklen_t sl;
+	size_t len;
 	int ret;
+	int n;
 
-	switch (pkt->type) {
-	case QRTR_TYPE_DATA:
-		ret = qmi_decode_header(pkt, &msg_id);
-		if (ret < 0)
+	for (n = 0; n < RECV_BATCH; n++) {
+		/* Out of request slots, receive into a spare one and shed it */
+		req = request_alloc();
+		if (!req)
+			req = &shed_req;
+
+		sl = sizeof(sq);
+		ret = recvfrom(svc->sock, req->buf, sizeof(req->buf), MSG_DONTWAIT,
+			       (struct sockaddr *)&sq, &sl);
+		if (ret < 0) {
+			if (req != &shed_req)
+				request_free(req);
+
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return n;
+
+			log_err("recvfrom failed: %d", ret);
 			return ret;
+		}
 
-		switch (msg_id) {
-		case TA228_GET_SIZE:
-			ta228_get_size(sock, pkt);
-			break;
-		case TA228_READ:
-			ta228_read(sock, pkt);
+		/* A malformed packet only costs its sender the request */
+		ret = qrtr_decode(&req->pkt, req->buf, ret, &sq);
+		if (ret < 0) {
+			log_err("failed to decode message from %u:%u",
+				sq.sq_node, sq.sq_port);
+			if (req != &shed_req)
+				request_free(req);
+			continue;
+		}
+
+		switch (req->pkt.type) {
+		case QRTR_TYPE_DATA:
+			req->svc = svc - services;
+			req->weight = svc->type->weight;
+
+			/* A retransmit of a request answered moments ago */
+			resp = peer_cached_response(svc->sock, &req->pkt, &len);
+			if (resp) {
+				trace_begin(&req->pkt, svc->type->id,
+					    svc->instance, 0);
+				trace_disposition(TRACE_CACHED);
+				peer_send(svc->sock, req->pkt.node, req->pkt.port,
+					  resp, len);
+				trace_mark(TRACE_SEND);
+				trace_end();
+				break;
+			}
+
+			if (req == &shed_req) {
+				peer_note_shed(req->pkt.node, req->pkt.port);
+				service_shed(svc, req);
+				continue;
+			}
+
+			ret = peer_enqueue(req);
+			if (ret < 0) {
+				service_shed(svc, req);
+			} else if (ret > 0) {
+				trace_begin(&req->pkt, svc->type->id,
+					    svc->instance, 0);
+				trace_disposition(TRACE_DUPLICATE);
+				trace_end();
+			}
+			if (ret != 0)
+				request_free(req);
+			continue;
+		case QRTR_TYPE_DEL_CLIENT:
+			peer_remove(req->pkt.node, req->pkt.port);
+			partition_drop_parked(req->pkt.node, req->pkt.port);
 			break;
-		default:
-			fprintf(stderr, "Unhandled TA228 message: %d\n", msg_id);
+		case QRTR_TYPE_BYE:
+			peer_remove(req->pkt.node, PEER_ANY_PORT);
+			partition_drop_parked(req->pkt.node, PEER_ANY_PORT);
 			break;
 		}
-		break;
+
+		if (req != &shed_req)
+			request_free(req);
 	}
 
-	return 0;
+	return n;
 }
 
-static int svc229_handle_1(int sock, struct qrtr_packet *pkt)
+/*
+ * Prefetch the units of the warmup set and encode their read responses, so
+ * that the first requests after boot are answered without touching the store.
+ */
+static void warmup_encode(struct warm_unit *warm, int kind, int msg_id,
+			  const void *resp, struct qmi_elem_info *ei)
 {
-	DEFINE_QRTR_PACKET(resp_buf, 8192);
-	struct svc229_resp resp = {};
-	struct svc229_req req = {};
-	unsigned int txn;
+	struct qrtr_packet resp_buf;
 	int ret;
 
-	ret = qmi_decode_message(&req, &txn, pkt, QMI_REQUEST, SVC229_MSG1,
-				 svc229_req_ei);
-	if (ret < 0) {
-		fprintf(stderr, "[SVC229] failed to decode message\n");
-		resp.result = 1;
-	} else {
-		resp.result = 0;
-		resp.data_len = 1;
-		resp.data[0] = 0;
-	}
-
-	ret = qmi_encode_message(&resp_buf, QMI_RESPONSE, SVC229_MSG1, txn,
-				 &resp, svc229_resp_ei);
-	if (ret < 0) {
-		fprintf(stderr, "[SVC229] failed to encode response\n");
-		return ret;
-	}
+	resp_buf.data_len = qmi_encoded_size(ei);
+	resp_buf.data = malloc(resp_buf.data_len);
+	if (!resp_buf.data)
+		return;
 
-	ret = qrtr_sendto(sock, pkt->node, pkt->port, resp_buf.data, resp_buf.data_len);
-	if (ret < 0)
-		fprintf(stderr, "[SVC229] failed to send response\n");
+	ret = qmi_encode_message(&resp_buf, QMI_RESPONSE, msg_id, 0, resp, ei);
+	if (ret >= 0)
+		warmup_set_response(warm, kind, resp_buf.data, resp_buf.data_len);
 
-	return ret;
+	free(resp_buf.data);
 }
 
-static int handle_svc229(int sock, struct qrtr_packet *pkt)
+/* Called as the partition loads, each unit is prepared once it's indexed */
+static void warmup_prepare(unsigned instance)
 {
-	unsigned int msg_id;
-	int ret;
+	struct ta *ta = partitions[instance].ta;
+	struct ta227_read_resp *resp227 = NULL;
+	struct ta228_read_resp *resp228 = NULL;
+	struct warm_unit *warm;
+	size_t size;
+	void *buf;
+	unsigned i;
 
-	switch (pkt->type) {
-	case QRTR_TYPE_DATA:
-		ret = qmi_decode_header(pkt, &msg_id);
-		if (ret < 0)
-			return ret;
+	for (i = 0; i < warmup_count(); i++) {
+		warm = warmup_entry(i);
+		if (warm->instance != instance ||
+		    warm->resp[WARM_TA227_READ] || warm->resp[WARM_TA228_READ])
+			continue;
 
-		switch (msg_id) {
-		case 1:
-			svc229_handle_1(sock, pkt);
-			break;
-		default:
-			fprintf(stderr, "Unhandled SVC229 message: %d\n", msg_id);
-			break;
+		if (ta_prefetch(ta, warm->unit) < 0)
+			continue;
+
+		if (!resp227) {
+			resp227 = malloc(sizeof(*resp227));
+			resp228 = malloc(sizeof(*resp228));
+			if (!resp227 || !resp228)
+				break;
 		}
+
+		/* Preparing the responses doesn't count as reading the unit */
+		buf = ta_peek(ta, warm->unit, &size);
+
+		memset(resp227, 0, offsetof(struct ta227_read_resp, data));
+		ta227_read_fill(buf, size, resp227);
+		warmup_encode(warm, WARM_TA227_READ, TA227_READ, resp227,
+			      ta227_read_resp_ei);
+
+		memset(resp228, 0, offsetof(struct ta228_read_resp, data));
+		ta228_read_fill(buf, size, resp228);
+		warmup_encode(warm, WARM_TA228_READ, TA228_READ, resp228,
+			      ta228_read_resp_ei);
 	}
 
+	free(resp227);
+	free(resp228);
+}
+
+static int snapshot_publish(struct partition *part)
+{
+	int fd;
+
+	fd = ta_snapshot(part->ta, part->generation + 1);
+	if (fd < 0)
+		return -1;
+
+	if (part->snap_fd >= 0)
+		close(part->snap_fd);
+	part->snap_fd = fd;
+	part->generation++;
+
+	atomic_store_explicit((_Atomic uint64_t *)&part->gen->generation,
+			      part->generation, memory_order_release);
+
 	return 0;
 }
 
-int main(int argc, char **argv)
+/*
+ * Clients map the generation page read-only to detect new snapshots, only the
+ * mapping created here may write to it.
+ */
+static int snapshot_init(struct partition *part)
+{
+	part->snap_fd = -1;
+
+	part->gen_fd = memfd_create("ta-snapshot-gen",
+				    MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (part->gen_fd < 0)
+		return -1;
+
+	if (ftruncate(part->gen_fd, sizeof(*part->gen)) < 0)
+		return -1;
+
+	part->gen = mmap(NULL, sizeof(*part->gen), PROT_READ | PROT_WRITE,
+			 MAP_SHARED, part->gen_fd, 0);
+	if (part->gen == MAP_FAILED)
+		return -1;
+
+	if (fcntl(part->gen_fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW |
+					     F_SEAL_FUTURE_WRITE) < 0)
+		fcntl(part->gen_fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW);
+
+	/* The first snapshot is published once the partition is loaded */
+	return 0;
+}
+
+static void ctl_accept(void)
 {
-	struct sockaddr_qrtr sq;
-	struct qrtr_packet pkt;
-	socklen_t sl;
-	char buf[4096];
-	fd_set rfds;
-	int fds[3];
 	int sock;
-	int nfds;
-	int ret;
 	int i;
 
-	if (argc != 2) {
-		fprintf(stderr, "%s <partition>\n", __progname);
-		exit(1);
+	sock = accept4(ctl_sock, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+	if (sock < 0)
+		return;
+
+	for (i = 0; i < MAX_CTL_CONNS; i++) {
+		if (ctl_conns[i] < 0) {
+			ctl_conns[i] = sock;
+			return;
+		}
 	}
 
-	ret = ta_load(argv[1]);
-	if (ret < 0)
-		exit(1);
+	close(sock);
+}
 
-	for (i = 0; i < 3; i++) {
-		fds[i] = qrtr_open(0);
-		if (fds[i] < 0) {
-			fprintf(stderr, "failed to create qrtr socket");
-			exit(1);
+/*
+ * Pass the snapshot and the QRTR sockets of every partition to a newly
+ * started ta-service. The services stay published throughout, as the
+ * sockets live on in the new process, and this one only answers what it
+ * has already queued before exiting.
+ */
+static void handoff_send(int sock)
+{
+	struct ta_ctl_handoff msg = {};
+	struct partition *part;
+	int fds[CTL_MAX_FDS];
+	unsigned n;
+	unsigned i;
+	unsigned j;
+
+	for (i = 0; i < num_partitions; i++) {
+		if (partitions[i].snap_fd < 0) {
+			msg.status = -EAGAIN;
+			goto err;
 		}
+	}
 
-		ret = qrtr_publish(fds[i], 227 + i, 1, 0);
-		if (ret < 0) {
-			fprintf(stderr, "failed to publish service %d", 227 + i);
-			exit(1);
-		}
+	if (num_service_types > CTL_MAX_FDS - 1) {
+		msg.status = -E2BIG;
+		goto err;
 	}
 
-	for (;;) {
-		FD_ZERO(&rfds);
-		nfds = 0;
+	msg.stopped_ns = now_ns();
+	msg.num_partitions = num_partitions;
+
+	for (i = 0; i < num_partitions; i++) {
+		part = &partitions[i];
+
+		msg.instance = i;
+		fds[0] = part->snap_fd;
+
+		for (j = 0, n = 0; j < num_services; j++) {
+			if (services[j].part != part)
+				continue;
 
-		for (i = 0; i < 3; i++) {
-			FD_SET(fds[i], &rfds);
-			nfds = MAX(nfds, fds[i]);
+			msg.services[n] = services[j].type->id;
+			fds[++n] = services[j].sock;
 		}
+		msg.num_services = n;
 
-		ret = select(nfds + 1, &rfds, NULL, NULL, NULL);
-		if (ret < 0) {
-			fprintf(stderr, "select failed: %d\n", ret);
-			break;
-		} else if (ret == 0) {
-			continue;
+		if (ctl_send(sock, &msg, sizeof(msg), fds, n + 1) < 0) {
+			log_err("failed to hand off partition %u, still serving", i);
+			return;
 		}
+	}
 
-		for (i = 0; i < 3; i++) {
-			sock = fds[i];
+	log_info("handed off %u partitions, draining", num_partitions);
 
-			if (!FD_ISSET(sock, &rfds))
-				continue;
+	handed_off = 1;
+	handoff_deadline = now_ns() + HANDOFF_DRAIN_MS * 1000000ull;
+	return;
 
-			sl = sizeof(sq);
-			ret = recvfrom(sock, buf, sizeof(buf), 0,
-				       (struct sockaddr *)&sq, &sl);
-			if (ret < 0) {
-				fprintf(stderr, "recvfrom failed: %d\n", ret);
-				return ret;
-			}
+err:
+	ctl_send(sock, &msg, sizeof(msg), NULL, 0);
+}
 
-			ret = qrtr_decode(&pkt, buf, ret, &sq);
-			if (ret < 0) {
-				fprintf(stderr, "failed to decode message\n");
-				return ret;
-			}
+/*
+ * Take over the partitions and sockets of the running ta-service listening
+ * on path. Returns the time at which it stopped receiving requests.
+ */
+static uint64_t handoff_recv(const char *path)
+{
+	struct ta_ctl_req req = { .cmd = TA_CTL_HANDOFF };
+	struct ta_ctl_handoff msg;
+	struct partition *part;
+	struct service *svc;
+	unsigned received = 0;
+	int fds[CTL_MAX_FDS];
+	unsigned num_fds;
+	unsigned i;
+	unsigned j;
+	int sock;
+	int ret;
 
-			switch (i) {
-			case 0:
-				handle_ta227(sock, &pkt);
-				break;
-			case 1:
-				handle_ta228(sock, &pkt);
-				break;
-			case 2:
-				handle_svc229(sock, &pkt);
-				break;
+	sock = ctl_connect(path);
+	if (sock < 0 || ctl_send(sock, &req, sizeof(req), NULL, 0) < 0) {
+		fprintf(stderr, "failed to connect to %s\n", path);
+		exit(1);
+	}
+
+	do {
+		num_fds = CTL_MAX_FDS;
+		ret = ctl_recv(sock, &msg, sizeof(msg), fds, &num_fds);
+		if (ret != sizeof(msg) || msg.status < 0 ||
+		    num_fds != msg.num_services + 1) {
+			fprintf(stderr, "handoff from %s failed: %d\n", path,
+				ret == sizeof(msg) ? msg.status : -EPROTO);
+			exit(1);
+		}
+
+		/* Partitions or services this binary doesn't serve are dropped */
+		if (msg.instance < num_partitions) {
+			part = &partitions[msg.instance];
+
+			part->ta = ta_import(fds[0]);
+			if (!part->ta) {
+				fprintf(stderr, "invalid snapshot of %s\n",
+					part->path);
+				exit(1);
+			}
+		}
+		close(fds[0]);
+
+		for (i = 0; i < msg.num_services; i++) {
+			for (j = 0; j < num_services; j++) {
+				svc = &services[j];
+				if (svc->instance == msg.instance &&
+				    svc->type->id == msg.services[i] &&
+				    svc->sock < 0)
+					break;
 			}
+
+			if (j < num_services)
+				services[j].sock = fds[i + 1];
+			else
+				close(fds[i + 1]);
 		}
+	} while (++received < msg.num_partitions);
+
+	close(sock);
+
+	return msg.stopped_ns;
+}
+
+static struct ta *partition_ta(unsigned instance)
+{
+	return partitions[instance].ta;
+}
+
+static void partition_loaded(struct partition *part)
+{
+	struct ta_stats stats;
+
+	ta_get_stats(part->ta, &stats);
+	log_info("loaded %s: %u units, %zu bytes (%zu unique in %u payloads)",
+		 part->path, stats.units, stats.total_bytes, stats.unique_bytes,
+		 stats.blobs);
+
+	if (ctl_sock >= 0 && snapshot_publish(part) < 0)
+		log_err("failed to publish snapshot of %s", part->path);
+
+	layout_apply(part - partitions, part->ta);
+	warmup_prepare(part - partitions);
+
+	/* Retransmits are answered from the units as they are now */
+	peer_cache_clear();
+
+	/* Whatever is still missing now doesn't exist */
+	partition_unpark(part);
+}
+
+struct export {
+	int sock;
+	int out_fd;
+	int snap_fd;
+	struct ta_ctl_resp resp;
+};
+
+/*
+ * Copy the snapshot to the client's descriptor, which may be a slow pipe, on
+ * a thread of its own. The snapshot is sealed, so nothing is shared with the
+ * event loop.
+ */
+static void *export_thread(void *data)
+{
+	struct export *export = data;
+	struct pollfd pfd = { export->out_fd, POLLOUT };
+	struct stat st;
+	off_t offset = 0;
+	ssize_t n;
+
+	if (fstat(export->snap_fd, &st) < 0) {
+		export->resp.status = -errno;
+		goto out;
+	}
+
+	while (offset < st.st_size) {
+		n = sendfile(export->out_fd, export->snap_fd, &offset,
+			     st.st_size - offset);
+		if (n < 0 && errno == EAGAIN) {
+			poll(&pfd, 1, -1);
+		} else if (n < 0 && errno != EINTR) {
+			export->resp.status = -errno;
+			break;
+		} else if (n == 0) {
+			export->resp.status = -EIO;
+			break;
+		}
+	}
+
+out:
+	ctl_send(export->sock, &export->resp, sizeof(export->resp), NULL, 0);
+
+	close(export->sock);
+	close(export->out_fd);
+	close(export->snap_fd);
+	free(export);
+
+	return NULL;
+}
+
+static int export_start(int sock, struct partition *part, int out_fd)
+{
+	struct export *export;
+	pthread_attr_t attr;
+	pthread_t thread;
+	int ret;
+
+	export = calloc(1, sizeof(*export));
+	if (!export)
+		return -ENOMEM;
+
+	/* A reload may replace the partition's snapshot meanwhile */
+	export->snap_fd = dup(part->snap_fd);
+	if (export->snap_fd < 0) {
+		free(export);
+		return -errno;
+	}
+
+	export->sock = sock;
+	export->out_fd = out_fd;
+	export->resp.generation = part->generation;
+
+	/* Not inheriting the event loop's real-time policy, if any */
+	pthread_attr_init(&attr);
+	pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+
+	ret = pthread_create(&thread, &attr, export_thread, export);
+	pthread_attr_destroy(&attr);
+	if (ret) {
+		close(export->snap_fd);
+		free(export);
+		return -EAGAIN;
+	}
+
+	pthread_detach(thread);
+
+	return 0;
+}
+
+/* Replace the unit store of a partition with the content of an archive */
+static int import_archive(struct partition *part, int in_fd)
+{
+	struct ta *ta;
+
+	ta = ta_import(in_fd);
+	if (!ta)
+		return -EINVAL;
+
+	ta_free(part->ta);
+	part->ta = ta;
+	part->iterator = 0;
+
+	/* Units missing from the archive must not be answered from the old store */
+	warmup_reset_instance(part - partitions);
+
+	partition_loaded(part);
+
+	return 0;
+}
+
+static void perf_reply(int sock)
+{
+	static struct perf_stats stats[PERF_MAX_ENTRIES];
+	static struct ta_ctl_perf resp;
+	struct ta_ctl_perf_entry *entry;
+	unsigned stage;
+	unsigned n;
+	unsigned i;
+	unsigned j;
+
+	memset(&resp, 0, sizeof(resp));
+
+	if (!perf_enabled()) {
+		resp.status = -EOPNOTSUPP;
+		ctl_send(sock, &resp, sizeof(resp), NULL, 0);
+		return;
+	}
+
+	n = perf_get_stats(stats, TA_CTL_PERF_ENTRIES);
+	for (i = 0; i < n; i++) {
+		entry = &resp.entries[i];
+		entry->service = stats[i].service;
+		entry->msg_id = stats[i].msg_id;
+		entry->samples = stats[i].samples;
+		entry->parked = stats[i].parked;
+		entry->park_ns = stats[i].park_ns;
+
+		for (stage = 0; stage < PERF_NUM_STAGES; stage++) {
+			for (j = 0; j < PERF_NUM_COUNTERS; j++)
+				entry->counters[stage][j] = stats[i].counters[stage][j];
+		}
+	}
+	resp.num_entries = n;
+
+	ctl_send(sock, &resp, sizeof(resp), NULL, 0);
+}
+
+static void ctl_handle(int idx)
+{
+	struct ta_ctl_stats stats = {};
+	struct ta_ctl_resp resp = {};
+	struct alloc_stats allocs;
+	struct partition *part;
+	struct ta_ctl_req req;
+	int sock = ctl_conns[idx];
+	unsigned num_fds = 1;
+	int arg_fd = -1;
+	int fds[2];
+	int ret;
+
+	ret = ctl_recv(sock, &req, sizeof(req), &arg_fd, &num_fds);
+	if (ret < 0 && errno == EAGAIN)
+		return;
+
+	if (!num_fds)
+		arg_fd = -1;
+
+	if (ret != sizeof(req))
+		goto out;
+
+	switch (req.cmd) {
+	case TA_CTL_SNAPSHOT:
+		if (req.instance >= num_partitions) {
+			resp.status = -EINVAL;
+			break;
+		}
+
+		part = &partitions[req.instance];
+		if (part->snap_fd < 0) {
+			resp.status = -EAGAIN;
+			break;
+		}
+
+		fds[0] = part->snap_fd;
+		fds[1] = part->gen_fd;
+		resp.generation = part->generation;
+
+		ctl_send(sock, &resp, sizeof(resp), fds, 2);
+		goto out;
+	case TA_CTL_HANDOFF:
+		handoff_send(sock);
+		goto out;
+	case TA_CTL_EXPORT:
+		if (req.instance >= num_partitions || arg_fd < 0) {
+			resp.status = -EINVAL;
+			break;
+		}
+
+		part = &partitions[req.instance];
+		if (part->snap_fd < 0) {
+			resp.status = -EAGAIN;
+			break;
+		}
+
+		resp.status = export_start(sock, part, arg_fd);
+		if (resp.status < 0)
+			break;
+
+		/* The export thread answers and closes the connection */
+		ctl_conns[idx] = -1;
+		return;
+	case TA_CTL_IMPORT:
+		if (req.instance >= num_partitions || arg_fd < 0 || handed_off) {
+			resp.status = -EINVAL;
+			break;
+		}
+
+		resp.status = import_archive(&partitions[req.instance], arg_fd);
+		resp.generation = partitions[req.instance].generation;
+		break;
+	case TA_CTL_STATS:
+		alloc_get_stats(&allocs);
+
+		stats.requests = requests;
+		stats.allocs = allocs.allocs;
+		stats.frees = allocs.frees;
+		stats.limit_hits = peer_limit_hits();
+
+		ctl_send(sock, &stats, sizeof(stats), NULL, 0);
+		goto out;
+	case TA_CTL_PERF:
+		perf_reply(sock);
+		goto out;
+	case TA_CTL_TRACE:
+		fds[0] = memfd_create("ta-trace", MFD_CLOEXEC);
+		if (fds[0] < 0) {
+			resp.status = -errno;
+			break;
+		}
+
+		resp.status = trace_dump(fds[0]);
+		if (!resp.status)
+			ctl_send(sock, &resp, sizeof(resp), fds, 1);
+		close(fds[0]);
+
+		if (!resp.status)
+			goto out;
+		break;
+	default:
+		resp.status = -EINVAL;
+		break;
+	}
+
+	ctl_send(sock, &resp, sizeof(resp), NULL, 0);
+
+out:
+	if (arg_fd >= 0)
+		close(arg_fd);
+	close(sock);
+	ctl_conns[idx] = -1;
+}
+
+/*
+ * Index another batch of units of the partitions still loading, returns
+ * non-zero while any load is in progress.
+ */
+static int load_partitions(void)
+{
+	struct partition *part;
+	int loading = 0;
+	unsigned i;
+
+	for (i = 0; i < num_partitions; i++) {
+		part = &partitions[i];
+		if (ta_loaded(part->ta))
+			continue;
+
+		if (ta_load_step(part->ta, LOAD_BUDGET)) {
+			warmup_prepare(i);
+			partition_unpark(part);
+			loading = 1;
+		} else {
+			partition_loaded(part);
+		}
+	}
+
+	return loading;
+}
+
+static void reload_partitions(void)
+{
+	struct partition *part;
+	struct ta *ta;
+	unsigned i;
+
+	warmup_reset();
+
+	for (i = 0; i < num_partitions; i++) {
+		part = &partitions[i];
+
+		ta = ta_load(part->path);
+		ta_free(part->ta);
+		part->ta = ta;
+		part->iterator = 0;
+
+		partition_loaded(part);
+	}
+}
+
+static void service_types_init(void)
+{
+	unsigned ids[MAX_RULE_SERVICES];
+	struct service_type *type;
+	unsigned num_ids;
+	unsigned i;
+	unsigned j;
+
+	num_ids = rules_services(ids, MAX_RULE_SERVICES);
+
+	service_types = calloc(NUM_BUILTIN_TYPES + num_ids, sizeof(*service_types));
+	if (!service_types) {
+		fprintf(stderr, "failed to allocate service types");
+		exit(1);
+	}
+
+	memcpy(service_types, builtin_types, sizeof(builtin_types));
+	num_service_types = NUM_BUILTIN_TYPES;
+
+	for (i = 0; i < num_ids; i++) {
+		for (j = 0; j < NUM_BUILTIN_TYPES; j++) {
+			if (builtin_types[j].id == ids[i])
+				break;
+		}
+
+		if (j < NUM_BUILTIN_TYPES)
+			continue;
+
+		type = &service_types[num_service_types++];
+		type->id = ids[i];
+		type->handlers = rule_handlers;
+		type->weight = 1;
+
+		type->name = malloc(16);
+		if (!type->name) {
+			fprintf(stderr, "failed to allocate service types");
+			exit(1);
+		}
+		snprintf((char *)type->name, 16, "SVC%u", ids[i]);
+	}
+}
+
+static struct service_type *service_type_find(unsigned id)
+{
+	unsigned i;
+
+	for (i = 0; i < num_service_types; i++) {
+		if (service_types[i].id == id)
+			return &service_types[i];
+	}
+
+	return NULL;
+}
+
+static int parse_priority(const char *arg)
+{
+	struct service_type *type;
+	unsigned weight;
+	unsigned id;
+
+	if (sscanf(arg, "%u:%u", &id, &weight) != 2 || !weight)
+		return -1;
+
+	type = service_type_find(id);
+	if (!type)
+		return -1;
+
+	type->weight = weight;
+	return 0;
+}
+
+static int parse_coalesce(const char *arg)
+{
+	struct service_type *type;
+	unsigned delay;
+	unsigned id;
+
+	if (sscanf(arg, "%u:%u", &id, &delay) != 2)
+		return -1;
+
+	type = service_type_find(id);
+	if (!type)
+		return -1;
+
+	type->coalesce_us = delay;
+	return 0;
+}
+
+/*
+ * Services with a coalescing delay aren't handled as soon as a request
+ * arrives. Their socket is left alone until the delay has passed and is
+ * then drained in one go, so a burst of requests costs a single wakeup.
+ */
+static void coalesce_arm(void)
+{
+	struct itimerspec its = {};
+	uint64_t next = 0;
+	unsigned i;
+
+	for (i = 0; i < num_services; i++) {
+		if (services[i].deadline &&
+		    (!next || services[i].deadline < next))
+			next = services[i].deadline;
+	}
+
+	/* A zero deadline disarms the timer */
+	its.it_value.tv_sec = next / 1000000000ull;
+	its.it_value.tv_nsec = next % 1000000000ull;
+
+	timerfd_settime(coalesce_fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+static int coalesce_drain(struct service *svc, uint64_t now)
+{
+	int ret;
+
+	svc->batches++;
+	svc->delay_ns += now - svc->deadline + svc->type->coalesce_us * 1000ull;
+	svc->deadline = 0;
+
+	do {
+		ret = service_recv(svc);
+		if (ret < 0)
+			return ret;
+
+		svc->batched += ret;
+	} while (ret == RECV_BATCH);
+
+	return 0;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"%s [options] <partition>...\n"
+		"  -z, --compress=MIN     keep payloads of MIN bytes or more compressed\n"
+		"  -c, --hot-cache=BYTES  size of the decompressed hot cache (default 65536)\n"
+		"  -H, --hot-hits=N       reads before a unit enters the hot cache (default 2)\n"
+		"  -p, --priority=SVC:W   scheduling weight of service SVC (default 1)\n"
+		"  -q, --queue-depth=N    requests queued per client before shedding (default 16)\n"
+		"  -o, --out-queue=BYTES  responses held per slow client (default 131072)\n"
+		"  -w, --warmup=FILE      record and prefetch the units read during boot\n"
+		"  -W, --warmup-size=N    number of accesses recorded (default 64), within\n"
+		"                         the first 30 seconds\n"
+		"  -t, --trace=FILE       write a binary trace of all requests to FILE\n"
+		"  -T, --trace-size=N     requests held in the in-memory trace ring\n"
+		"  -s, --socket=PATH      serve unit store snapshots on a local socket\n"
+		"  -r, --rules=FILE       answer stub service messages from FILE\n"
+		"  -u, --upgrade=PATH     take over from the ta-service listening on PATH\n"
+		"  -d, --coalesce=SVC:US  delay service SVC up to US to batch wakeups (default 0)\n"
+		"  -m, --resident         keep the unit store and buffers locked in memory\n"
+		"  -f, --fault-stats      count the page faults taken by each request\n"
+		"  -P, --max-peers=N      clients served at a time (default 32)\n"
+		"  -R, --retransmit-size=BYTES\n"
+		"                         cache responses of up to BYTES, 4 per client, to\n"
+		"                         answer retransmits (default 1024)\n"
+		"  -S, --sched=POLICY     run the event loop as fifo:PRIO, rr:PRIO or nice:N\n"
+		"  -a, --affinity=CPUS    run the event loop on CPUS, e.g. 0,2-3\n"
+		"  -b, --boost-window=MS  drop -S and -a MS after start\n"
+		"  -i, --boost-idle=MS    drop -S and -a once idle for MS\n"
+		"  -l, --latency-probe=US sample the event loop's wakeup latency every US\n"
+		"  -k, --compact=SECONDS  reorder the unit store by reads every SECONDS\n"
+		"                         (default 60 with -L), keeping twice the store in memory\n"
+		"  -L, --layout=FILE      record the unit store order, and restore it on start\n"
+		"  -C, --perf-counters    count cycles, instructions and misses per request stage\n",
+		__progname);
+	exit(1);
+}
+
+static const struct option options[] = {
+	{ "compress", required_argument, NULL, 'z' },
+	{ "hot-cache", required_argument, NULL, 'c' },
+	{ "hot-hits", required_argument, NULL, 'H' },
+	{ "priority", required_argument, NULL, 'p' },
+	{ "queue-depth", required_argument, NULL, 'q' },
+	{ "out-queue", required_argument, NULL, 'o' },
+	{ "warmup", required_argument, NULL, 'w' },
+	{ "warmup-size", required_argument, NULL, 'W' },
+	{ "trace", required_argument, NULL, 't' },
+	{ "trace-size", required_argument, NULL, 'T' },
+	{ "socket", required_argument, NULL, 's' },
+	{ "rules", required_argument, NULL, 'r' },
+	{ "upgrade", required_argument, NULL, 'u' },
+	{ "coalesce", required_argument, NULL, 'd' },
+	{ "resident", no_argument, NULL, 'm' },
+	{ "fault-stats", no_argument, NULL, 'f' },
+	{ "max-peers", required_argument, NULL, 'P' },
+	{ "retransmit-size", required_argument, NULL, 'R' },
+	{ "sched", required_argument, NULL, 'S' },
+	{ "affinity", required_argument, NULL, 'a' },
+	{ "boost-window", required_argument, NULL, 'b' },
+	{ "boost-idle", required_argument, NULL, 'i' },
+	{ "latency-probe", required_argument, NULL, 'l' },
+	{ "compact", required_argument, NULL, 'k' },
+	{ "layout", required_argument, NULL, 'L' },
+	{ "perf-counters", no_argument, NULL, 'C' },
+	{}
+};
+
+int main(int argc, char **argv)
+{
+	size_t hot_cache_size = 65536;
+	size_t out_queue_size = 131072;
+	const char *warmup_path = NULL;
+	unsigned warmup_size = 64;
+	const char *trace_path = NULL;
+	unsigned trace_size = 0;
+	const char *ctl_path = NULL;
+	const char *rules_path = NULL;
+	const char *upgrade_path = NULL;
+	uint64_t stopped_ns = 0;
+	const char *priorities[MAX_PRIORITIES];
+	unsigned num_priorities = 0;
+	const char *coalesces[MAX_PRIORITIES];
+	unsigned num_coalesces = 0;
+	uint64_t now;
+	unsigned queue_depth = 16;
+	unsigned max_peers = 32;
+	ssize_t retransmit_size = -1;
+	const char *sched_policy = NULL;
+	const char *sched_cpus = NULL;
+	unsigned boost_window = 0;
+	unsigned boost_idle = 0;
+	unsigned latency_probe = 0;
+	unsigned compact_interval = 0;
+	const char *layout_path = NULL;
+	uint64_t last_active = 0;
+	unsigned hot_hits = 2;
+	size_t compress = 0;
+	struct timeval poll_tv;
+	struct partition *part;
+	struct service *svc;
+	uint64_t expirations;
+	int resident = 0;
+	int profile = 0;
+	int loading = 1;
+	int blocked = 0;
+	int rearm;
+	int pending = 0;
+	fd_set rfds;
+	int nfds;
+	int ret;
+	int i;
+
+	while ((ret = getopt_long(argc, argv, "z:c:H:p:q:o:w:W:t:T:s:r:u:d:mfP:R:S:a:b:i:l:k:L:C", options, NULL)) != -1) {
+		switch (ret) {
+		case 'z':
+			compress = strtoul(optarg, NULL, 0);
+			break;
+		case 'c':
+			hot_cache_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'H':
+			hot_hits = strtoul(optarg, NULL, 0);
+			break;
+		case 'p':
+			if (num_priorities == MAX_PRIORITIES)
+				usage();
+			priorities[num_priorities++] = optarg;
+			break;
+		case 'q':
+			queue_depth = strtoul(optarg, NULL, 0);
+			break;
+		case 'o':
+			out_queue_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'w':
+			warmup_path = optarg;
+			break;
+		case 'W':
+			warmup_size = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			trace_path = optarg;
+			break;
+		case 'T':
+			trace_size = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			ctl_path = optarg;
+			break;
+		case 'r':
+			rules_path = optarg;
+			break;
+		case 'u':
+			upgrade_path = optarg;
+			break;
+		case 'd':
+			if (num_coalesces == MAX_PRIORITIES)
+				usage();
+			coalesces[num_coalesces++] = optarg;
+			break;
+		case 'm':
+			resident = 1;
+			break;
+		case 'f':
+			resident_count_faults();
+			break;
+		case 'R':
+			retransmit_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'P':
+			max_peers = strtoul(optarg, NULL, 0);
+			break;
+		case 'S':
+			sched_policy = optarg;
+			break;
+		case 'a':
+			sched_cpus = optarg;
+			break;
+		case 'b':
+			boost_window = strtoul(optarg, NULL, 0);
+			break;
+		case 'i':
+			boost_idle = strtoul(optarg, NULL, 0);
+			break;
+		case 'l':
+			latency_probe = strtoul(optarg, NULL, 0);
+			break;
+		case 'k':
+			compact_interval = strtoul(optarg, NULL, 0);
+			break;
+		case 'L':
+			layout_path = optarg;
+			break;
+		case 'C':
+			profile = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (optind == argc)
+		usage();
+
+	if (log_init(LOG_RING_SIZE) < 0)
+		fprintf(stderr, "failed to start logging thread, logging directly\n");
+
+	/* Before anything the requests are served from is allocated */
+	if (resident)
+		resident_init(RESIDENT_STACK_SIZE);
+
+	if (rules_path && rules_load(rules_path) < 0) {
+		fprintf(stderr, "failed to load rules from %s", rules_path);
+		exit(1);
+	}
+
+	service_types_init();
+
+	if (rt_init(sched_policy, sched_cpus, boost_window, boost_idle,
+		    latency_probe) < 0)
+		usage();
+
+	for (i = 0; i < num_priorities; i++) {
+		if (parse_priority(priorities[i]) < 0)
+			usage();
+	}
+
+	for (i = 0; i < num_coalesces; i++) {
+		if (parse_coalesce(coalesces[i]) < 0)
+			usage();
+	}
+
+	if (num_coalesces) {
+		coalesce_fd = timerfd_create(CLOCK_MONOTONIC,
+					     TFD_NONBLOCK | TFD_CLOEXEC);
+		if (coalesce_fd < 0) {
+			fprintf(stderr, "failed to create coalescing timer");
+			exit(1);
+		}
+	}
+
+	signal(SIGUSR1, sigusr1_handler);
+	signal(SIGHUP, sighup_handler);
+
+	ta_set_compression(compress, hot_hits, hot_cache_size);
+
+	/* Each partition is published under its own service instance */
+	num_partitions = argc - optind;
+	partitions = calloc(num_partitions, sizeof(*partitions));
+	num_services = num_partitions * num_service_types;
+	services = calloc(num_services, sizeof(*services));
+	if (!partitions || !services) {
+		fprintf(stderr, "failed to allocate services");
+		exit(1);
+	}
+
+	for (i = 0; i < num_partitions; i++)
+		partitions[i].path = argv[optind + i];
+
+	for (i = 0; i < num_services; i++) {
+		svc = &services[i];
+		svc->type = &service_types[i % num_service_types];
+		svc->part = &partitions[i / num_service_types];
+		svc->instance = i / num_service_types;
+		svc->sock = -1;
+	}
+
+	/* Before listening, as the running instance may use the same path */
+	if (upgrade_path)
+		stopped_ns = handoff_recv(upgrade_path);
+
+	/*
+	 * The partitions are loaded from the main loop once the services are
+	 * published, requests for units not yet loaded are parked until then.
+	 */
+	for (i = 0; i < num_partitions; i++) {
+		part = &partitions[i];
+		if (!part->ta)
+			part->ta = ta_open(part->path);
+	}
+
+	if (warmup_path) {
+		ret = warmup_init(warmup_path, warmup_size, WARMUP_WINDOW);
+		if (ret < 0) {
+			fprintf(stderr, "failed to read warmup manifest %s",
+				warmup_path);
+			exit(1);
+		}
+
+		/* A short boot still leaves a manifest behind */
+		atexit(warmup_finish);
+	}
+
+	/* A recorded layout is kept up to date, unless told otherwise */
+	if (layout_path && !compact_interval)
+		compact_interval = LAYOUT_INTERVAL;
+
+	if (layout_init(layout_path, compact_interval) < 0) {
+		fprintf(stderr, "failed to read layout %s", layout_path);
+		exit(1);
+	}
+
+	for (i = 0; i < MAX_CTL_CONNS; i++)
+		ctl_conns[i] = -1;
+
+	if (ctl_path) {
+		for (i = 0; i < num_partitions; i++) {
+			ret = snapshot_init(&partitions[i]);
+			if (ret < 0) {
+				fprintf(stderr, "failed to create snapshot of %s",
+					partitions[i].path);
+				exit(1);
+			}
+		}
+
+		ctl_sock = ctl_listen(ctl_path);
+		if (ctl_sock < 0) {
+			fprintf(stderr, "failed to listen on %s", ctl_path);
+			exit(1);
+		}
+	}
+
+	if (trace_path && !trace_size)
+		trace_size = 4096;
+
+	if (trace_size) {
+		ret = trace_init(trace_size, trace_path);
+		if (ret < 0) {
+			fprintf(stderr, "failed to set up request tracing");
+			exit(1);
+		}
+	}
+
+	ret = service_init(service_types, num_service_types);
+	if (ret < 0) {
+		fprintf(stderr, "failed to allocate service buffers");
+		exit(1);
+	}
+
+	if (retransmit_size < 0)
+		retransmit_size = PEER_CACHE_RESP_SIZE;
+
+	ret = peer_init(REQUEST_POOL_SIZE, queue_depth, out_queue_size,
+			max_peers, retransmit_size);
+	if (ret < 0) {
+		fprintf(stderr, "failed to allocate request and peer pools");
+		exit(1);
+	}
+
+	for (i = 0; i < num_partitions; i++) {
+		if (ta_loaded(partitions[i].ta))
+			partition_loaded(&partitions[i]);
+	}
+
+	/* Services handed over are already published */
+	for (i = 0; i < num_services; i++) {
+		svc = &services[i];
+		if (svc->sock >= 0)
+			continue;
+
+		svc->sock = qrtr_open(0);
+		if (svc->sock < 0) {
+			fprintf(stderr, "failed to create qrtr socket");
+			exit(1);
+		}
+
+		fcntl(svc->sock, F_SETFL, fcntl(svc->sock, F_GETFL) | O_NONBLOCK);
+
+		ret = qrtr_publish(svc->sock, svc->type->id, 1, svc->instance);
+		if (ret < 0) {
+			fprintf(stderr, "failed to publish service %d:%d",
+				svc->type->id, svc->instance);
+			exit(1);
+		}
+	}
+
+	if (upgrade_path)
+		log_info("took over from %s, no receiver for %llu us", upgrade_path,
+			 (unsigned long long)(now_ns() - stopped_ns) / 1000);
+
+	/* The logging thread is already running, it keeps the default policy */
+	rt_enter();
+
+	/* Counting only the event loop, so once the other threads are running */
+	if (profile && perf_init() < 0) {
+		fprintf(stderr, "failed to open performance counters: %s\n",
+			strerror(errno));
+		exit(1);
+	}
+
+	for (;;) {
+		FD_ZERO(&rfds);
+		nfds = 0;
+
+		for (i = 0; i < num_services && !handed_off; i++) {
+			if (services[i].deadline)
+				continue;
+
+			FD_SET(services[i].sock, &rfds);
+			nfds = MAX(nfds, services[i].sock);
+		}
+
+		if (coalesce_fd >= 0) {
+			FD_SET(coalesce_fd, &rfds);
+			nfds = MAX(nfds, coalesce_fd);
+		}
+
+		if (ctl_sock >= 0) {
+			FD_SET(ctl_sock, &rfds);
+			nfds = MAX(nfds, ctl_sock);
+		}
+
+		if (rt_fd() >= 0) {
+			FD_SET(rt_fd(), &rfds);
+			nfds = MAX(nfds, rt_fd());
+		}
+
+		if (rt_probe_fd() >= 0) {
+			FD_SET(rt_probe_fd(), &rfds);
+			nfds = MAX(nfds, rt_probe_fd());
+		}
+
+		if (layout_fd() >= 0) {
+			FD_SET(layout_fd(), &rfds);
+			nfds = MAX(nfds, layout_fd());
+		}
+
+		if (warmup_fd() >= 0) {
+			FD_SET(warmup_fd(), &rfds);
+			nfds = MAX(nfds, warmup_fd());
+		}
+
+		for (i = 0; i < MAX_CTL_CONNS; i++) {
+			if (ctl_conns[i] >= 0) {
+				FD_SET(ctl_conns[i], &rfds);
+				nfds = MAX(nfds, ctl_conns[i]);
+			}
+		}
+
+		if (dump_requested) {
+			dump_requested = 0;
+			dump_stats();
+		}
+
+		if (reload_requested && !handed_off) {
+			reload_requested = 0;
+			reload_partitions();
+		}
+
+		/* Answer what was queued before the handoff, then leave */
+		if (handed_off && ((!pending && !blocked) ||
+				   now_ns() > handoff_deadline)) {
+			log_flush();
+			break;
+		}
+
+		/*
+		 * Only poll for new requests while there is queued work or a
+		 * partition still loading. QRTR flow control is per remote port
+		 * and not reflected in the socket's writability, so blocked
+		 * responses are retried on a short timer.
+		 */
+		poll_tv.tv_sec = 0;
+		poll_tv.tv_usec = pending || loading ? 0 : FLUSH_INTERVAL_US;
+
+		ret = select(nfds + 1, &rfds, NULL, NULL,
+			     pending || loading || blocked ? &poll_tv : NULL);
+		if (ret < 0 && errno == EINTR) {
+			continue;
+		} else if (ret < 0) {
+			fprintf(stderr, "select failed: %d\n", ret);
+			break;
+		}
+
+		if (rt_probe_fd() >= 0 && FD_ISSET(rt_probe_fd(), &rfds))
+			rt_probe();
+
+		wakeups++;
+		now = coalesce_fd >= 0 ? now_ns() : 0;
+		rearm = 0;
+
+		for (i = 0; i < num_services && !handed_off; i++) {
+			svc = &services[i];
+
+			if (svc->deadline) {
+				if (now < svc->deadline)
+					continue;
+
+				ret = coalesce_drain(svc, now);
+				rearm = 1;
+			} else if (!FD_ISSET(svc->sock, &rfds)) {
+				continue;
+			} else if (svc->type->coalesce_us) {
+				svc->deadline = now + svc->type->coalesce_us * 1000ull;
+				rearm = 1;
+				continue;
+			} else {
+				ret = service_recv(svc);
+			}
+
+			if (ret < 0)
+				return ret;
+		}
+
+		if (coalesce_fd >= 0 && FD_ISSET(coalesce_fd, &rfds))
+			read(coalesce_fd, &expirations, sizeof(expirations));
+
+		if (rearm)
+			coalesce_arm();
+
+		for (i = 0; i < MAX_CTL_CONNS; i++) {
+			if (ctl_conns[i] >= 0 && FD_ISSET(ctl_conns[i], &rfds))
+				ctl_handle(i);
+		}
+
+		if (ctl_sock >= 0 && FD_ISSET(ctl_sock, &rfds))
+			ctl_accept();
+
+		if (peer_schedule(serve_request))
+			last_active = now_ns();
+		pending = peer_pending();
+
+		if (rt_fd() >= 0 && FD_ISSET(rt_fd(), &rfds))
+			rt_check(last_active);
+
+		if (loading)
+			loading = load_partitions();
+
+		if (layout_fd() >= 0 && FD_ISSET(layout_fd(), &rfds))
+			layout_expired();
+
+		if (warmup_fd() >= 0 && FD_ISSET(warmup_fd(), &rfds))
+			warmup_expired();
+
+		/* Units and payloads move, so only between requests */
+		if (layout_due() && !pending && !loading && !handed_off)
+			layout_compact(partition_ta, num_partitions);
+
+		blocked = peer_flush();
 	}
 
 	return 0;
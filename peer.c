@@ -0,0 +1,654 @@
+/*
+ * Copyright (c) 2018, Bjorn Andersson <bjorn@kryo.se>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <sys/socket.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "peer.h"
+#include "resident.h"
+
+#define PEER_HASH_SIZE	64
+
+/*
+ * Incoming requests are queued per (node, port) and served in deficit round
+ * robin order, so that a single flooding client can not starve the others.
+ * Each round a peer is credited the weight of the service its next request
+ * arrived on, and every served request costs one credit.
+ */
+static struct peer *peers[PEER_HASH_SIZE];
+
+static struct peer *active_head;
+static struct peer *active_tail;
+
+static struct request *request_pool;
+static struct request *free_requests;
+static unsigned max_queue_depth;
+
+/*
+ * Peers, their response caches and output queues are preallocated for
+ * max_peers, requests of further peers are refused rather than growing them.
+ */
+static struct peer *peer_pool;
+static struct peer *free_peers;
+static unsigned long total_refused;
+
+static unsigned long total_queued;
+static unsigned long total_shed;
+
+/*
+ * Clients retransmit requests that time out, with the same transaction id and
+ * content. A retransmit of a queued request is dropped, as the original will
+ * be answered, and one of a recently answered request gets the cached copy of
+ * the response instead of running the handler again.
+ */
+static unsigned long total_duplicates;
+static unsigned long total_cache_hits;
+
+/*
+ * Responses are sent without blocking; when a peer does not accept more data
+ * they are kept in a per peer ring, bounded per peer, and flushed later.
+ */
+static size_t total_out_bytes;
+static unsigned blocked_peers;
+static unsigned long total_dropped;
+
+int peer_init(unsigned pool_size, unsigned max_depth, size_t max_out_bytes,
+	      unsigned max_peers, size_t cache_entry_size)
+{
+	struct peer *peer;
+	size_t out_size;
+	size_t stride;
+	uint8_t *bufs;
+	uint8_t *buf;
+	unsigned i;
+	unsigned j;
+
+	request_pool = resident_alloc(pool_size * sizeof(struct request));
+	if (!request_pool)
+		return -1;
+
+	for (i = 0; i < pool_size; i++) {
+		request_pool[i].next = free_requests;
+		free_requests = &request_pool[i];
+	}
+
+	/* Each peer's output ring is followed by its response cache entries */
+	out_size = (max_out_bytes + 7) & ~(size_t)7;
+	cache_entry_size = (cache_entry_size + 7) & ~(size_t)7;
+	stride = out_size + PEER_CACHE_SIZE * cache_entry_size;
+
+	peer_pool = resident_alloc(max_peers * sizeof(struct peer));
+	bufs = resident_alloc(max_peers * stride);
+	if (!peer_pool || !bufs)
+		return -1;
+
+	for (i = max_peers; i-- > 0;) {
+		peer = &peer_pool[i];
+		buf = bufs + i * stride;
+
+		ring_init(&peer->out, buf, out_size);
+		for (j = 0; j < PEER_CACHE_SIZE; j++) {
+			peer->cache[j].data = buf + out_size +
+					      j * cache_entry_size;
+			peer->cache[j].size = cache_entry_size;
+		}
+
+		peer->next = free_peers;
+		free_peers = peer;
+	}
+
+	max_queue_depth = max_depth;
+
+	return 0;
+}
+
+struct request *request_alloc(void)
+{
+	struct request *req = free_requests;
+
+	if (req) {
+		free_requests = req->next;
+		req->dispatched = 0;
+	}
+
+	return req;
+}
+
+void request_free(struct request *req)
+{
+	req->next = free_requests;
+	free_requests = req;
+}
+
+static unsigned peer_hash(unsigned node, unsigned port)
+{
+	return (node * 31 + port) % PEER_HASH_SIZE;
+}
+
+static struct peer *peer_lookup(unsigned node, unsigned port, int create)
+{
+	struct peer *peer;
+	unsigned hash = peer_hash(node, port);
+
+	for (peer = peers[hash]; peer; peer = peer->next) {
+		if (peer->node == node && peer->port == port)
+			return peer;
+	}
+
+	if (!create)
+		return NULL;
+
+	peer = free_peers;
+	if (!peer) {
+		total_refused++;
+		return NULL;
+	}
+	free_peers = peer->next;
+
+	peer->node = node;
+	peer->port = port;
+
+	peer->next = peers[hash];
+	peers[hash] = peer;
+
+	return peer;
+}
+
+static void peer_activate(struct peer *peer)
+{
+	peer->active = 1;
+	peer->deficit = 0;
+	peer->active_next = NULL;
+
+	if (active_tail)
+		active_tail->active_next = peer;
+	else
+		active_head = peer;
+	active_tail = peer;
+}
+
+static bool request_equal(struct request *a, struct request *b)
+{
+	return a->svc == b->svc && a->pkt.data_len == b->pkt.data_len &&
+	       !memcmp(a->pkt.data, b->pkt.data, a->pkt.data_len);
+}
+
+/*
+ * Returns -1 when the request should be shed rather than queued and 1 when
+ * it duplicates a queued request, in which case it's left to the caller.
+ */
+int peer_enqueue(struct request *req)
+{
+	struct request *queued;
+	struct peer *peer;
+
+	peer = peer_lookup(req->pkt.node, req->pkt.port, 1);
+	if (!peer)
+		return -1;
+
+	for (queued = peer->head; queued; queued = queued->next) {
+		if (request_equal(queued, req)) {
+			peer->duplicates++;
+			total_duplicates++;
+			return 1;
+		}
+	}
+
+	if (peer->depth >= max_queue_depth) {
+		peer->shed++;
+		total_shed++;
+		return -1;
+	}
+
+	req->next = NULL;
+	if (peer->tail)
+		peer->tail->next = req;
+	else
+		peer->head = req;
+	peer->tail = req;
+	peer->depth++;
+
+	total_queued++;
+
+	if (!peer->active)
+		peer_activate(peer);
+
+	return 0;
+}
+
+static uint64_t peer_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static uint32_t peer_request_hash(const struct qrtr_packet *pkt)
+{
+	const uint8_t *data = pkt->data;
+	uint32_t hash = 2166136261u;
+	size_t len = pkt->data_len;
+
+	while (len--) {
+		hash ^= *data++;
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+/* Returns the response previously sent for an identical request, if any */
+const void *peer_cached_response(int sock, const struct qrtr_packet *pkt,
+				 size_t *len)
+{
+	struct peer_response *resp;
+	struct peer *peer;
+	uint32_t hash;
+	int i;
+
+	peer = peer_lookup(pkt->node, pkt->port, 0);
+	if (!peer)
+		return NULL;
+
+	hash = peer_request_hash(pkt);
+
+	for (i = 0; i < PEER_CACHE_SIZE; i++) {
+		resp = &peer->cache[i];
+		if (!resp->len || resp->sock != sock || resp->hash != hash ||
+		    resp->req_len != pkt->data_len ||
+		    memcmp(resp->req, pkt->data, pkt->data_len))
+			continue;
+
+		if (peer_now_ns() - resp->sent_ns > PEER_CACHE_TTL_MS * 1000000ull) {
+			resp->len = 0;
+			continue;
+		}
+
+		peer->cache_hits++;
+		total_cache_hits++;
+
+		*len = resp->len;
+		return resp->data;
+	}
+
+	return NULL;
+}
+
+/* Remember the response to a request, replacing the oldest cached one */
+void peer_cache_response(int sock, const struct qrtr_packet *pkt,
+			 const void *data, size_t len)
+{
+	struct peer_response *resp;
+	struct peer *peer;
+
+	peer = peer_lookup(pkt->node, pkt->port, 0);
+	if (!peer)
+		return;
+
+	resp = &peer->cache[peer->cache_next];
+	peer->cache_next = (peer->cache_next + 1) % PEER_CACHE_SIZE;
+
+	/* Larger requests and responses are handled again for a retransmit */
+	if (len > resp->size || pkt->data_len > sizeof(resp->req)) {
+		resp->len = 0;
+		return;
+	}
+
+	resp->sock = sock;
+	resp->hash = peer_request_hash(pkt);
+	resp->req_len = pkt->data_len;
+	memcpy(resp->req, pkt->data, pkt->data_len);
+	resp->sent_ns = peer_now_ns();
+	resp->len = len;
+	memcpy(resp->data, data, len);
+}
+
+/* Forget all cached responses, e.g. when a partition's units changed */
+void peer_cache_clear(void)
+{
+	struct peer *peer;
+	unsigned i;
+	unsigned j;
+
+	for (i = 0; i < PEER_HASH_SIZE; i++) {
+		for (peer = peers[i]; peer; peer = peer->next) {
+			for (j = 0; j < PEER_CACHE_SIZE; j++)
+				peer->cache[j].len = 0;
+		}
+	}
+}
+
+void peer_note_shed(unsigned node, unsigned port)
+{
+	struct peer *peer;
+
+	peer = peer_lookup(node, port, 1);
+	if (peer)
+		peer->shed++;
+	total_shed++;
+}
+
+int peer_pending(void)
+{
+	return active_head != NULL;
+}
+
+/*
+ * Run one round over the active peers, returns the number of requests served.
+ */
+int peer_schedule(int (*serve)(struct request *req))
+{
+	struct peer *last = active_tail;
+	struct peer *peer;
+	struct request *req;
+	int served = 0;
+	int done;
+
+	do {
+		peer = active_head;
+		if (!peer)
+			break;
+
+		active_head = peer->active_next;
+		if (!active_head)
+			active_tail = NULL;
+
+		done = peer == last;
+
+		peer->deficit += peer->head->weight;
+		while (peer->head && peer->deficit) {
+			req = peer->head;
+			peer->head = req->next;
+			if (!peer->head)
+				peer->tail = NULL;
+			peer->depth--;
+			peer->deficit--;
+			peer->served++;
+			total_queued--;
+
+			if (!serve(req))
+				request_free(req);
+			served++;
+		}
+
+		if (peer->head) {
+			peer->active_next = NULL;
+			if (active_tail)
+				active_tail->active_next = peer;
+			else
+				active_head = peer;
+			active_tail = peer;
+		} else {
+			peer->active = 0;
+		}
+	} while (!done);
+
+	return served;
+}
+
+static void peer_drop_output(struct peer *peer)
+{
+	if (peer->out.count)
+		blocked_peers--;
+
+	ring_init(&peer->out, peer->out.data, peer->out.size);
+
+	total_out_bytes -= peer->out_bytes;
+	peer->out_bytes = 0;
+}
+
+/* Take a peer off the active list, freeing the requests it has queued */
+static void peer_deactivate(struct peer *peer)
+{
+	struct peer *prev = NULL;
+	struct request *req;
+	struct peer **pp;
+
+	for (pp = &active_head; *pp; prev = *pp, pp = &prev->active_next) {
+		if (*pp == peer) {
+			*pp = peer->active_next;
+			if (active_tail == peer)
+				active_tail = prev;
+			break;
+		}
+	}
+
+	while ((req = peer->head)) {
+		peer->head = req->next;
+		request_free(req);
+	}
+
+	total_queued -= peer->depth;
+	peer->tail = NULL;
+	peer->depth = 0;
+	peer->active = 0;
+}
+
+/* Return a peer to the pool, keeping its preallocated buffers */
+static void peer_release(struct peer *peer)
+{
+	unsigned i;
+
+	peer_drop_output(peer);
+
+	peer->head = NULL;
+	peer->tail = NULL;
+	peer->depth = 0;
+	peer->deficit = 0;
+	peer->active = 0;
+
+	for (i = 0; i < PEER_CACHE_SIZE; i++)
+		peer->cache[i].len = 0;
+	peer->cache_next = 0;
+
+	peer->served = 0;
+	peer->shed = 0;
+	peer->dropped = 0;
+	peer->duplicates = 0;
+	peer->cache_hits = 0;
+
+	peer->next = free_peers;
+	free_peers = peer;
+}
+
+void peer_remove(unsigned node, unsigned port)
+{
+	struct peer **pp;
+	struct peer *peer;
+	unsigned i;
+
+	for (i = 0; i < PEER_HASH_SIZE; i++) {
+		for (pp = &peers[i]; *pp;) {
+			peer = *pp;
+
+			if (peer->node != node || (port != PEER_ANY_PORT && peer->port != port)) {
+				pp = &peer->next;
+				continue;
+			}
+
+			/* Nobody is left to answer, drop what it still had queued */
+			if (peer->active)
+				peer_deactivate(peer);
+
+			*pp = peer->next;
+			peer_release(peer);
+		}
+	}
+}
+
+static int peer_sendto(int sock, unsigned node, unsigned port,
+		       const void *data, size_t len)
+{
+	struct sockaddr_qrtr sq = {};
+	int ret;
+
+	sq.sq_family = AF_QIPCRTR;
+	sq.sq_node = node;
+	sq.sq_port = port;
+
+	ret = sendto(sock, data, len, MSG_DONTWAIT, (struct sockaddr *)&sq,
+		     sizeof(sq));
+	if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		return 0;
+	else if (ret < 0)
+		return -1;
+
+	return 1;
+}
+
+int peer_send(int sock, unsigned node, unsigned port, const void *data,
+	      size_t len)
+{
+	struct outbuf *out;
+	struct peer *peer;
+	int ret;
+
+	/*
+	 * Peers are created as their requests are queued, a response to one
+	 * that is gone by now or never got a slot is sent without queueing.
+	 */
+	peer = peer_lookup(node, port, 0);
+	if (!peer) {
+		ret = peer_sendto(sock, node, port, data, len);
+		if (ret > 0)
+			return 0;
+
+		total_dropped++;
+		return -1;
+	}
+
+	/* Keep responses in order behind already queued ones */
+	if (!peer->out.count) {
+		ret = peer_sendto(sock, node, port, data, len);
+		if (ret != 0)
+			return ret < 0 ? ret : 0;
+	}
+
+	out = ring_push(&peer->out, sizeof(*out) + len);
+	if (!out)
+		goto drop;
+
+	out->sock = sock;
+	out->len = len;
+	memcpy(out->data, data, len);
+
+	if (peer->out.count == 1)
+		blocked_peers++;
+	peer->out_bytes += len;
+
+	total_out_bytes += len;
+
+	return 0;
+
+drop:
+	peer->dropped++;
+	total_dropped++;
+	return -1;
+}
+
+static void peer_flush_one(struct peer *peer)
+{
+	struct outbuf *out;
+	int ret;
+
+	while ((out = ring_peek(&peer->out))) {
+		ret = peer_sendto(out->sock, peer->node, peer->port, out->data,
+				  out->len);
+		if (ret == 0)
+			return;
+
+		if (ret < 0) {
+			peer->dropped++;
+			total_dropped++;
+		}
+
+		peer->out_bytes -= out->len;
+		total_out_bytes -= out->len;
+		ring_pop(&peer->out);
+	}
+
+	blocked_peers--;
+}
+
+/* Returns the number of peers still holding queued responses */
+int peer_flush(void)
+{
+	struct peer *peer;
+	unsigned i;
+
+	if (!blocked_peers)
+		return 0;
+
+	for (i = 0; i < PEER_HASH_SIZE; i++) {
+		for (peer = peers[i]; peer; peer = peer->next) {
+			if (peer->out.count)
+				peer_flush_one(peer);
+		}
+	}
+
+	return blocked_peers;
+}
+
+/* Requests and responses turned away because a preallocated limit was hit */
+unsigned long peer_limit_hits(void)
+{
+	return total_shed + total_dropped + total_refused;
+}
+
+void peer_dump_stats(FILE *fp)
+{
+	struct peer *peer;
+	unsigned i;
+
+	fprintf(fp, "queued requests: %lu\n", total_queued);
+	fprintf(fp, "shed requests: %lu\n", total_shed);
+	fprintf(fp, "duplicate requests: %lu dropped, %lu answered from cache\n",
+		total_duplicates, total_cache_hits);
+	fprintf(fp, "queued responses: %zu bytes\n", total_out_bytes);
+	fprintf(fp, "dropped responses: %lu\n", total_dropped);
+	fprintf(fp, "refused peers: %lu\n", total_refused);
+
+	for (i = 0; i < PEER_HASH_SIZE; i++) {
+		for (peer = peers[i]; peer; peer = peer->next) {
+			fprintf(fp, "peer %u:%u: depth %u served %lu shed %lu out %zu dropped %lu duplicates %lu cached %lu\n",
+				peer->node, peer->port, peer->depth,
+				peer->served, peer->shed, peer->out_bytes,
+				peer->dropped, peer->duplicates,
+				peer->cache_hits);
+		}
+	}
+}
@@ -0,0 +1,141 @@
+/*
+ * Copyright (c) 2018, Bjorn Andersson <bjorn@kryo.se>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef __PEER_H__
+#define __PEER_H__
+
+#include <stdint.h>
+#include <stdio.h>
+#include <libqrtr.h>
+
+#include "ring.h"
+
+#define REQUEST_BUF_SIZE	4096
+#define PEER_ANY_PORT		((unsigned)-1)
+/*
+ * Responses cached per peer. Their slots default to PEER_CACHE_RESP_SIZE, which
+ * holds the typical unit read and every write or error response; retransmits
+ * of larger responses, such as 64k TA228 reads, are handled again instead.
+ * The cache takes max_peers * PEER_CACHE_SIZE * the slot size of memory, all
+ * of it locked in when the service is resident.
+ */
+#define PEER_CACHE_SIZE		4
+#define PEER_CACHE_RESP_SIZE	1024
+/* larger requests are not cached, TA requests take a few dozen bytes */
+#define PEER_CACHE_REQ_SIZE	256
+/* retransmits arrive within the clients' timeout, later ones are new requests */
+#define PEER_CACHE_TTL_MS	5000
+
+struct request {
+	struct request *next;
+
+	/* index of the service the request arrived on, and its weight */
+	unsigned svc;
+	unsigned weight;
+
+	/* when first dispatched, parked requests are accounted from then */
+	uint64_t dispatched;
+
+	struct qrtr_packet pkt;
+	char buf[REQUEST_BUF_SIZE];
+};
+
+struct outbuf {
+	int sock;
+	size_t len;
+	char data[];
+};
+
+/* A response recently sent to the peer, keyed on the request it answered */
+struct peer_response {
+	int sock;
+	uint32_t hash;
+	size_t req_len;
+	uint8_t req[PEER_CACHE_REQ_SIZE];
+	uint64_t sent_ns;
+
+	void *data;
+	size_t len;
+	size_t size;
+};
+
+struct peer {
+	struct peer *next;
+	struct peer *active_next;
+
+	unsigned node;
+	unsigned port;
+
+	struct request *head;
+	struct request *tail;
+	unsigned depth;
+	unsigned deficit;
+	int active;
+
+	/* responses waiting for the peer to accept more data */
+	struct ring out;
+	size_t out_bytes;
+
+	struct peer_response cache[PEER_CACHE_SIZE];
+	unsigned cache_next;
+
+	unsigned long served;
+	unsigned long shed;
+	unsigned long dropped;
+	unsigned long duplicates;
+	unsigned long cache_hits;
+};
+
+int peer_init(unsigned pool_size, unsigned max_depth, size_t max_out_bytes,
+	      unsigned max_peers, size_t cache_entry_size);
+
+struct request *request_alloc(void);
+void request_free(struct request *req);
+
+int peer_enqueue(struct request *req);
+const void *peer_cached_response(int sock, const struct qrtr_packet *pkt,
+				 size_t *len);
+void peer_cache_response(int sock, const struct qrtr_packet *pkt,
+			 const void *data, size_t len);
+void peer_cache_clear(void);
+void peer_note_shed(unsigned node, unsigned port);
+int peer_pending(void);
+/* serve() returns non-zero to keep the request, which it then has to free */
+int peer_schedule(int (*serve)(struct request *req));
+void peer_remove(unsigned node, unsigned port);
+
+int peer_send(int sock, unsigned node, unsigned port, const void *data,
+	      size_t len);
+int peer_flush(void);
+
+unsigned long peer_limit_hits(void);
+void peer_dump_stats(FILE *fp);
+
+#endif
@@ -0,0 +1,340 @@
+/*
+ * Copyright (c) 2018, Bjorn Andersson <bjorn@kryo.se>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "perf.h"
+
+/*
+ * Hardware counters of the event loop thread, read as one group at the end
+ * of each stage of a request and accumulated per service and message. Each
+ * read is a system call, so this is a profiling mode and not meant to be left
+ * on in production. A stage during which the group was only partly scheduled
+ * on the PMU is scaled up, as perf stat does; requests with a failed read, or
+ * a stage not counted at all, are left out.
+ */
+static const struct {
+	const char *name;
+	uint64_t config;
+} perf_events[PERF_NUM_COUNTERS] = {
+	[PERF_CYCLES] = { "cycles", PERF_COUNT_HW_CPU_CYCLES },
+	[PERF_INSTRUCTIONS] = { "instructions", PERF_COUNT_HW_INSTRUCTIONS },
+	[PERF_CACHE_MISSES] = { "cache misses", PERF_COUNT_HW_CACHE_MISSES },
+	[PERF_BRANCH_MISSES] = { "branch misses", PERF_COUNT_HW_BRANCH_MISSES },
+};
+
+static const char * const perf_stage_names[PERF_NUM_STAGES] = {
+	[PERF_DECODE] = "decode",
+	[PERF_LOOKUP] = "lookup",
+	[PERF_COPY] = "copy",
+	[PERF_ENCODE] = "encode",
+	[PERF_SEND] = "send",
+};
+
+struct perf_read {
+	uint64_t nr;
+	uint64_t time_enabled;
+	uint64_t time_running;
+	uint64_t values[PERF_NUM_COUNTERS];
+};
+
+static int fds[PERF_NUM_COUNTERS];
+static int group_fd = -1;
+static bool enabled;
+static bool user_only;
+
+static struct perf_stats entries[PERF_MAX_ENTRIES];
+static unsigned num_entries;
+static unsigned long overflows;
+static unsigned long failed;
+static unsigned long scaled;
+
+/* the request being profiled */
+static unsigned cur_service;
+static unsigned cur_msg_id;
+static uint64_t cur_park_ns;
+static bool cur_failed;
+static bool cur_scaled;
+static struct perf_read cur_mark;
+static uint64_t cur[PERF_NUM_STAGES][PERF_NUM_COUNTERS];
+
+static int perf_open(uint64_t config, int group, bool exclude_kernel)
+{
+	struct perf_event_attr attr = {};
+
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.config = config;
+	attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+			   PERF_FORMAT_TOTAL_TIME_RUNNING;
+	attr.disabled = group < 0;
+	attr.exclude_kernel = exclude_kernel;
+	attr.exclude_hv = 1;
+
+	return syscall(__NR_perf_event_open, &attr, 0, -1, group,
+		       PERF_FLAG_FD_CLOEXEC);
+}
+
+/* Start counting for the calling thread, which is to be the event loop */
+int perf_init(void)
+{
+	unsigned i;
+
+	/* Sending is mostly kernel work, count it unless not permitted */
+	group_fd = perf_open(perf_events[0].config, -1, false);
+	if (group_fd < 0 && (errno == EACCES || errno == EPERM)) {
+		user_only = true;
+		group_fd = perf_open(perf_events[0].config, -1, true);
+	}
+	if (group_fd < 0)
+		return -1;
+
+	fds[0] = group_fd;
+	for (i = 1; i < PERF_NUM_COUNTERS; i++) {
+		fds[i] = perf_open(perf_events[i].config, group_fd, user_only);
+		if (fds[i] < 0)
+			goto err_close;
+	}
+
+	if (ioctl(group_fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP) < 0)
+		goto err_close;
+
+	enabled = true;
+
+	return 0;
+
+err_close:
+	while (i--)
+		close(fds[i]);
+	group_fd = -1;
+
+	return -1;
+}
+
+bool perf_enabled(void)
+{
+	return enabled;
+}
+
+static int perf_read_counters(struct perf_read *buf)
+{
+	if (read(group_fd, buf, sizeof(*buf)) != sizeof(*buf) ||
+	    buf->nr != PERF_NUM_COUNTERS)
+		return -1;
+
+	return 0;
+}
+
+/* Start profiling a request, which waited parked_ns for its unit if parked */
+void perf_begin(const struct qrtr_packet *pkt, unsigned service,
+		uint64_t parked_ns)
+{
+	const struct qmi_header *hdr = pkt->data;
+
+	if (!enabled)
+		return;
+
+	cur_service = service;
+	cur_msg_id = pkt->data_len >= sizeof(*hdr) ? hdr->msg_id : 0;
+	cur_park_ns = parked_ns;
+	cur_scaled = false;
+	memset(cur, 0, sizeof(cur));
+
+	cur_failed = perf_read_counters(&cur_mark) < 0;
+}
+
+void perf_mark(int stage)
+{
+	struct perf_read now;
+	uint64_t time_enabled;
+	uint64_t time_running;
+	uint64_t delta;
+	unsigned i;
+
+	if (!enabled || cur_failed)
+		return;
+
+	if (perf_read_counters(&now) < 0) {
+		cur_failed = true;
+		return;
+	}
+
+	time_enabled = now.time_enabled - cur_mark.time_enabled;
+	time_running = now.time_running - cur_mark.time_running;
+
+	/* Not counted at all during this stage, nothing to scale */
+	if (!time_running && time_enabled) {
+		cur_failed = true;
+		return;
+	}
+
+	for (i = 0; i < PERF_NUM_COUNTERS; i++) {
+		delta = now.values[i] - cur_mark.values[i];
+		if (time_running < time_enabled)
+			delta = (unsigned __int128)delta * time_enabled /
+				time_running;
+
+		cur[stage][i] += delta;
+	}
+
+	if (time_running < time_enabled)
+		cur_scaled = true;
+
+	cur_mark = now;
+}
+
+static struct perf_stats *perf_entry(void)
+{
+	unsigned i;
+
+	for (i = 0; i < num_entries; i++) {
+		if (entries[i].service == cur_service &&
+		    entries[i].msg_id == cur_msg_id)
+			return &entries[i];
+	}
+
+	if (num_entries == PERF_MAX_ENTRIES)
+		return NULL;
+
+	entries[num_entries].service = cur_service;
+	entries[num_entries].msg_id = cur_msg_id;
+
+	return &entries[num_entries++];
+}
+
+static struct perf_stats *perf_account(void)
+{
+	struct perf_stats *entry;
+	unsigned stage;
+	unsigned i;
+
+	if (cur_failed) {
+		failed++;
+		return NULL;
+	}
+
+	entry = perf_entry();
+	if (!entry) {
+		overflows++;
+		return NULL;
+	}
+
+	for (stage = 0; stage < PERF_NUM_STAGES; stage++) {
+		for (i = 0; i < PERF_NUM_COUNTERS; i++)
+			entry->counters[stage][i] += cur[stage][i];
+	}
+
+	if (cur_scaled)
+		scaled++;
+
+	return entry;
+}
+
+/* Account the work done on a request before it got parked */
+void perf_park(void)
+{
+	struct perf_stats *entry;
+
+	if (!enabled)
+		return;
+
+	entry = perf_account();
+	if (entry)
+		entry->parked++;
+}
+
+/* Account the request, along with the time it spent parked */
+void perf_end(void)
+{
+	struct perf_stats *entry;
+
+	if (!enabled)
+		return;
+
+	entry = perf_account();
+	if (!entry)
+		return;
+
+	entry->samples++;
+	entry->park_ns += cur_park_ns;
+}
+
+unsigned perf_get_stats(struct perf_stats *stats, unsigned max)
+{
+	unsigned n = num_entries < max ? num_entries : max;
+
+	memcpy(stats, entries, n * sizeof(*stats));
+
+	return n;
+}
+
+void perf_dump_stats(FILE *fp)
+{
+	struct perf_stats *entry;
+	unsigned stage;
+	unsigned i;
+	unsigned j;
+
+	if (!enabled)
+		return;
+
+	fprintf(fp, "perf counters: %u messages (%lu requests untracked, %lu failed reads, %lu scaled)%s\n",
+		num_entries, overflows, failed, scaled,
+		user_only ? ", user space only" : "");
+
+	for (i = 0; i < num_entries; i++) {
+		entry = &entries[i];
+		if (!entry->samples)
+			continue;
+
+		fprintf(fp, "perf %u:%u: %llu requests, %llu parked (%llu us total), per request:\n",
+			entry->service, entry->msg_id,
+			(unsigned long long)entry->samples,
+			(unsigned long long)entry->parked,
+			(unsigned long long)entry->park_ns / 1000);
+
+		for (stage = 0; stage < PERF_NUM_STAGES; stage++) {
+			fprintf(fp, "  %-6s", perf_stage_names[stage]);
+			for (j = 0; j < PERF_NUM_COUNTERS; j++)
+				fprintf(fp, "%s %llu %s", j ? "," : "",
+					(unsigned long long)(entry->counters[stage][j] /
+							     entry->samples),
+					perf_events[j].name);
+			fprintf(fp, "\n");
+		}
+	}
+}
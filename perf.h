@@ -0,0 +1,85 @@
+/*
+ * Copyright (c) 2018, Bjorn Andersson <bjorn@kryo.se>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef __PERF_H__
+#define __PERF_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <libqrtr.h>
+
+#define PERF_MAX_ENTRIES	32
+
+/* Handler work not marked as the payload copy is accounted to the lookup */
+enum {
+	PERF_DECODE,
+	PERF_LOOKUP,
+	PERF_COPY,
+	PERF_ENCODE,
+	PERF_SEND,
+	PERF_NUM_STAGES,
+};
+
+enum {
+	PERF_CYCLES,
+	PERF_INSTRUCTIONS,
+	PERF_CACHE_MISSES,
+	PERF_BRANCH_MISSES,
+	PERF_NUM_COUNTERS,
+};
+
+/*
+ * Counters accumulated over all requests of one message of a service. The
+ * attempts of requests that were parked count towards their stages, and the
+ * time they spent parked is kept apart.
+ */
+struct perf_stats {
+	unsigned service;
+	unsigned msg_id;
+	uint64_t samples;
+	uint64_t parked;
+	uint64_t park_ns;
+	uint64_t counters[PERF_NUM_STAGES][PERF_NUM_COUNTERS];
+};
+
+int perf_init(void);
+bool perf_enabled(void);
+
+void perf_begin(const struct qrtr_packet *pkt, unsigned service,
+		uint64_t parked_ns);
+void perf_mark(int stage);
+void perf_park(void);
+void perf_end(void);
+
+unsigned perf_get_stats(struct perf_stats *stats, unsigned max);
+void perf_dump_stats(FILE *fp);
+
+#endif
@@ -0,0 +1,86 @@
+/*
+ * Copyright (c) 2018, Bjorn Andersson <bjorn@kryo.se>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdint.h>
+#include <libqrtr.h>
+
+#include "qmi_size.h"
+
+#define MAX(x, y) ((x) > (y) ? (x) : (y))
+
+#define QMI_HEADER_SIZE		sizeof(struct qmi_header)
+#define QMI_TLV_HEADER_SIZE	3
+
+size_t qmi_struct_size(struct qmi_elem_info *ei)
+{
+	size_t size = 0;
+
+	for (; ei->data_type != QMI_EOTI; ei++)
+		size = MAX(size, ei->offset + ei->elem_len * ei->elem_size);
+
+	return (size + 7) & ~7;
+}
+
+static size_t qmi_elem_size(struct qmi_elem_info *ei, int nested)
+{
+	unsigned prev_tlv = -1;
+	size_t size = 0;
+
+	for (; ei->data_type != QMI_EOTI; ei++) {
+		/* The length and the data of an array share one TLV */
+		if (!nested && ei->data_type != QMI_OPT_FLAG &&
+		    ei->tlv_type != prev_tlv) {
+			size += QMI_TLV_HEADER_SIZE;
+			prev_tlv = ei->tlv_type;
+		}
+
+		switch (ei->data_type) {
+		case QMI_OPT_FLAG:
+			break;
+		case QMI_STRUCT:
+			size += ei->elem_len * qmi_elem_size(ei->ei_array, 1);
+			break;
+		case QMI_STRING:
+			size += ei->elem_len * ei->elem_size + sizeof(uint16_t);
+			break;
+		default:
+			size += ei->elem_len * ei->elem_size;
+			break;
+		}
+	}
+
+	return size;
+}
+
+/* Upper bound of the encoded size of a message, including the QMI header */
+size_t qmi_encoded_size(struct qmi_elem_info *ei)
+{
+	return QMI_HEADER_SIZE + qmi_elem_size(ei, 0);
+}
@@ -0,0 +1,232 @@
+/*
+ * Copyright (c) 2018, Bjorn Andersson <bjorn@kryo.se>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#define _GNU_SOURCE
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <alloca.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "resident.h"
+
+#define MAX(x, y) ((x) > (y) ? (x) : (y))
+
+#define HUGE_PAGE_SIZE	(2 * 1024 * 1024)
+
+static bool enabled;
+static size_t page_size;
+
+static size_t resident_bytes;
+static unsigned hugetlb_maps;
+static unsigned thp_maps;
+static unsigned lock_failures;
+
+/* page faults taken while serving requests, see resident_fault_begin() */
+static bool count_faults;
+static struct rusage fault_start;
+static unsigned long fault_requests;
+static unsigned long faulted_requests;
+static unsigned long minor_faults;
+static unsigned long major_faults;
+static long max_faults;
+
+static size_t resident_size(size_t size)
+{
+	if (size >= HUGE_PAGE_SIZE)
+		return (size + HUGE_PAGE_SIZE - 1) & ~(size_t)(HUGE_PAGE_SIZE - 1);
+
+	return (size + page_size - 1) & ~(page_size - 1);
+}
+
+/* Fault in and lock a range, or at least fault it in if locking is denied */
+static void resident_populate(void *ptr, size_t size)
+{
+	volatile uint8_t *p = ptr;
+	size_t i;
+
+	if (!mlock(ptr, size))
+		return;
+
+	if (!lock_failures++)
+		log_warn("failed to lock resident memory, check RLIMIT_MEMLOCK");
+
+	for (i = 0; i < size; i += page_size)
+		p[i] = 0;
+}
+
+static void __attribute__((noinline)) resident_stack(size_t size)
+{
+	uint8_t *stack = alloca(size);
+
+	memset(stack, 0, size);
+	resident_populate(stack, size);
+}
+
+/*
+ * Enable the residency mode, in which the unit store and the buffers used
+ * while serving are allocated from prefaulted, locked and where possible
+ * hugepage backed mappings. The top stack_size bytes of the stack are
+ * prefaulted and locked as well, for the handlers to run on.
+ */
+void resident_init(size_t stack_size)
+{
+	page_size = sysconf(_SC_PAGESIZE);
+	enabled = true;
+
+	if (stack_size)
+		resident_stack(resident_size(stack_size));
+}
+
+bool resident_enabled(void)
+{
+	return enabled;
+}
+
+/*
+ * Allocate zeroed memory, in the residency mode as a mapping of its own that
+ * stays resident until passed to resident_free(). Allocations of a huge page
+ * or more come from the hugetlb pool if one is reserved, or are aligned for
+ * transparent huge pages otherwise.
+ */
+void *resident_alloc(size_t size)
+{
+	uintptr_t aligned;
+	uint8_t *map;
+
+	if (!enabled)
+		return calloc(1, size);
+
+	size = resident_size(size);
+
+	if (size < HUGE_PAGE_SIZE) {
+		map = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (map == MAP_FAILED)
+			return NULL;
+
+		goto populate;
+	}
+
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (map != MAP_FAILED) {
+		hugetlb_maps++;
+		goto populate;
+	}
+
+	/* Over-allocate to trim the mapping to huge page alignment */
+	map = mmap(NULL, size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (map == MAP_FAILED)
+		return NULL;
+
+	aligned = ((uintptr_t)map + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1);
+	if (aligned != (uintptr_t)map)
+		munmap(map, aligned - (uintptr_t)map);
+	munmap((void *)(aligned + size), (uintptr_t)map + HUGE_PAGE_SIZE - aligned);
+	map = (void *)aligned;
+
+	if (!madvise(map, size, MADV_HUGEPAGE))
+		thp_maps++;
+
+populate:
+	resident_populate(map, size);
+	resident_bytes += size;
+
+	return map;
+}
+
+void resident_free(void *ptr, size_t size)
+{
+	if (!enabled) {
+		free(ptr);
+		return;
+	}
+
+	if (!ptr)
+		return;
+
+	size = resident_size(size);
+	munmap(ptr, size);
+	resident_bytes -= size;
+}
+
+/* Account the page faults taken by each request, see resident_dump_stats() */
+void resident_count_faults(void)
+{
+	count_faults = true;
+}
+
+void resident_fault_begin(void)
+{
+	if (count_faults)
+		getrusage(RUSAGE_THREAD, &fault_start);
+}
+
+void resident_fault_end(void)
+{
+	struct rusage now;
+	long minor;
+	long major;
+
+	if (!count_faults)
+		return;
+
+	getrusage(RUSAGE_THREAD, &now);
+
+	minor = now.ru_minflt - fault_start.ru_minflt;
+	major = now.ru_majflt - fault_start.ru_majflt;
+
+	fault_requests++;
+	if (minor || major)
+		faulted_requests++;
+
+	minor_faults += minor;
+	major_faults += major;
+	max_faults = MAX(max_faults, minor + major);
+}
+
+void resident_dump_stats(FILE *fp)
+{
+	if (enabled)
+		fprintf(fp, "resident: %zu bytes (%u hugetlb, %u thp mappings, %u lock failures)\n",
+			resident_bytes, hugetlb_maps, thp_maps, lock_failures);
+
+	if (count_faults)
+		fprintf(fp, "page faults: %lu of %lu requests faulted (%lu minor, %lu major, max %ld)\n",
+			faulted_requests, fault_requests, minor_faults,
+			major_faults, max_faults);
+}
@@ -0,0 +1,113 @@
+/*
+ * Copyright (c) 2018, Bjorn Andersson <bjorn@kryo.se>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdint.h>
+
+#include "ring.h"
+
+struct ring_record {
+	size_t size;
+	uint8_t data[];
+};
+
+void ring_init(struct ring *ring, void *data, size_t size)
+{
+	ring->data = data;
+	ring->size = size;
+	ring->head = 0;
+	ring->tail = 0;
+	ring->end = 0;
+	ring->wrapped = false;
+	ring->count = 0;
+}
+
+/* Whether a record of len bytes fits at all, once all others are popped */
+bool ring_fits(const struct ring *ring, size_t len)
+{
+	return len <= ring->size &&
+	       ((sizeof(struct ring_record) + len + 7) & ~(size_t)7) <= ring->size;
+}
+
+/* Returns room for a record of len bytes, or NULL until records are popped */
+void *ring_push(struct ring *ring, size_t len)
+{
+	struct ring_record *rec;
+	size_t size;
+
+	size = (sizeof(*rec) + len + 7) & ~(size_t)7;
+
+	if (!ring->wrapped) {
+		if (ring->tail + size > ring->size) {
+			if (size > ring->head)
+				return NULL;
+
+			ring->end = ring->tail;
+			ring->tail = 0;
+			ring->wrapped = true;
+		}
+	} else if (ring->tail + size > ring->head) {
+		return NULL;
+	}
+
+	rec = ring->data + ring->tail;
+	rec->size = size;
+
+	ring->tail += size;
+	ring->count++;
+
+	return rec->data;
+}
+
+/* Returns the oldest record, or NULL if the ring is empty */
+void *ring_peek(struct ring *ring)
+{
+	struct ring_record *rec = ring->data + ring->head;
+
+	return ring->count ? rec->data : NULL;
+}
+
+void ring_pop(struct ring *ring)
+{
+	struct ring_record *rec = ring->data + ring->head;
+
+	ring->head += rec->size;
+	ring->count--;
+
+	if (ring->wrapped && ring->head == ring->end) {
+		ring->head = 0;
+		ring->wrapped = false;
+	}
+
+	if (!ring->count) {
+		ring->head = 0;
+		ring->tail = 0;
+		ring->wrapped = false;
+	}
+}
@@ -0,0 +1,449 @@
+/*
+ * Copyright (c) 2018, Bjorn Andersson <bjorn@kryo.se>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#define _GNU_SOURCE
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <errno.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "rt.h"
+
+#define MIN(x, y) ((x) < (y) ? (x) : (y))
+
+/*
+ * The event loop may run under a real-time policy, or at a raised priority,
+ * and on a chosen set of CPUs while the modem boots: for a fixed window after
+ * start or until requests stop arriving for a while. Everything else, like
+ * the logging and export threads, keeps the default policy.
+ *
+ * The jitter this removes is measured by a probe timer, whose expirations
+ * are handled by the event loop; the lateness of each is its wakeup latency,
+ * which includes the time the loop is busy. Samples taken while boosted and
+ * after are kept apart so that they can be compared.
+ */
+
+enum {
+	RT_BOOSTED,
+	RT_NORMAL,
+	RT_NUM_PHASES,
+};
+
+static const char *phase_names[] = {
+	[RT_BOOSTED] = "boosted",
+	[RT_NORMAL] = "normal",
+};
+
+static const unsigned bucket_limits_us[] = { 10, 50, 100, 500, 1000, 5000 };
+
+#define RT_BUCKETS	(sizeof(bucket_limits_us) / sizeof(bucket_limits_us[0]) + 1)
+
+struct rt_latency {
+	unsigned long samples;
+	uint64_t total_ns;
+	uint64_t max_ns;
+	unsigned long buckets[RT_BUCKETS];
+
+	/* involuntary context switches of the event loop */
+	long preempted;
+};
+
+static const char *policy_spec;
+static const char *cpus_spec;
+static int policy = -1;
+static int priority;
+static cpu_set_t cpus;
+static bool cpus_set;
+
+static uint64_t window_ns;
+static uint64_t idle_ns;
+static int timer_fd = -1;
+
+static bool boosted;
+static uint64_t boost_start;
+static uint64_t boost_ns;
+static const char *boost_end;
+
+/* Restored when leaving the boosted phase */
+static int saved_policy;
+static struct sched_param saved_param;
+static int saved_nice;
+static cpu_set_t saved_cpus;
+
+static int probe_fd = -1;
+static uint64_t probe_interval;
+static uint64_t probe_next;
+
+static struct rt_latency latency[RT_NUM_PHASES];
+static long phase_nivcsw;
+
+static uint64_t rt_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int rt_arm(int fd, uint64_t when)
+{
+	struct itimerspec its = {};
+
+	its.it_value.tv_sec = when / 1000000000ull;
+	its.it_value.tv_nsec = when % 1000000000ull;
+
+	return timerfd_settime(fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+static long rt_nivcsw(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_THREAD, &ru);
+
+	return ru.ru_nivcsw;
+}
+
+static int rt_parse_policy(const char *arg)
+{
+	char *end;
+	long val;
+
+	if (!strncmp(arg, "fifo:", 5))
+		policy = SCHED_FIFO;
+	else if (!strncmp(arg, "rr:", 3))
+		policy = SCHED_RR;
+	else if (!strncmp(arg, "nice:", 5))
+		policy = SCHED_OTHER;
+	else
+		return -1;
+
+	val = strtol(strchr(arg, ':') + 1, &end, 0);
+	if (*end)
+		return -1;
+
+	if (policy == SCHED_OTHER) {
+		if (val < -20 || val > 19)
+			return -1;
+	} else if (val < sched_get_priority_min(policy) ||
+		   val > sched_get_priority_max(policy)) {
+		return -1;
+	}
+
+	priority = val;
+
+	return 0;
+}
+
+/* Parse a list of CPUs and CPU ranges, like "0,2-3" */
+static int rt_parse_cpus(const char *arg)
+{
+	unsigned long first;
+	unsigned long last;
+	char *end;
+
+	CPU_ZERO(&cpus);
+
+	for (;;) {
+		first = strtoul(arg, &end, 10);
+		if (end == arg)
+			return -1;
+
+		last = first;
+		if (*end == '-') {
+			arg = end + 1;
+			last = strtoul(arg, &end, 10);
+			if (end == arg || last < first)
+				return -1;
+		}
+
+		if (last >= CPU_SETSIZE)
+			return -1;
+
+		for (; first <= last; first++)
+			CPU_SET(first, &cpus);
+
+		if (!*end)
+			break;
+		if (*end != ',')
+			return -1;
+		arg = end + 1;
+	}
+
+	cpus_set = true;
+
+	return 0;
+}
+
+/*
+ * Configure the boosted phase: policy is "fifo:PRIO", "rr:PRIO" or "nice:N"
+ * and cpus a CPU list, either may be NULL. The phase ends window_ms after it
+ * is entered or once no request arrived for idle_ms, if either is non-zero.
+ * A non-zero probe_us samples the event loop's wakeup latency that often.
+ */
+int rt_init(const char *policy_arg, const char *cpus_arg, unsigned window_ms,
+	    unsigned idle_ms, unsigned probe_us)
+{
+	if (policy_arg && rt_parse_policy(policy_arg) < 0)
+		return -1;
+
+	if (cpus_arg && rt_parse_cpus(cpus_arg) < 0)
+		return -1;
+
+	policy_spec = policy_arg;
+	cpus_spec = cpus_arg;
+	window_ns = window_ms * 1000000ull;
+	idle_ns = idle_ms * 1000000ull;
+
+	if ((policy_arg || cpus_arg) && (window_ms || idle_ms)) {
+		timer_fd = timerfd_create(CLOCK_MONOTONIC,
+					  TFD_NONBLOCK | TFD_CLOEXEC);
+		if (timer_fd < 0)
+			return -1;
+	}
+
+	if (probe_us) {
+		probe_interval = probe_us * 1000ull;
+		probe_fd = timerfd_create(CLOCK_MONOTONIC,
+					  TFD_NONBLOCK | TFD_CLOEXEC);
+		if (probe_fd < 0)
+			return -1;
+
+		probe_next = rt_now() + probe_interval;
+		rt_arm(probe_fd, probe_next);
+	}
+
+	return 0;
+}
+
+/* Switch the calling thread, the event loop, into the boosted phase */
+void rt_enter(void)
+{
+	struct sched_param param = {};
+	pid_t tid = syscall(SYS_gettid);
+	int ret;
+
+	if (policy < 0 && !cpus_set)
+		return;
+
+	saved_policy = sched_getscheduler(0);
+	sched_getparam(0, &saved_param);
+	saved_nice = getpriority(PRIO_PROCESS, tid);
+	sched_getaffinity(0, sizeof(saved_cpus), &saved_cpus);
+
+	if (policy == SCHED_OTHER) {
+		ret = setpriority(PRIO_PROCESS, tid, priority);
+		if (ret < 0)
+			log_warn("failed to raise priority: %s", strerror(errno));
+	} else if (policy >= 0) {
+		param.sched_priority = priority;
+		ret = sched_setscheduler(0, policy, &param);
+		if (ret < 0)
+			log_warn("failed to set scheduling policy: %s",
+				 strerror(errno));
+	}
+
+	if (cpus_set && sched_setaffinity(0, sizeof(cpus), &cpus) < 0)
+		log_warn("failed to set CPU affinity: %s", strerror(errno));
+
+	boosted = true;
+	boost_start = rt_now();
+	phase_nivcsw = rt_nivcsw();
+
+	if (timer_fd >= 0)
+		rt_check(boost_start);
+}
+
+static void rt_leave(const char *reason)
+{
+	long nivcsw = rt_nivcsw();
+
+	if (policy == SCHED_OTHER)
+		setpriority(PRIO_PROCESS, syscall(SYS_gettid), saved_nice);
+	else if (policy >= 0)
+		sched_setscheduler(0, saved_policy, &saved_param);
+
+	if (cpus_set)
+		sched_setaffinity(0, sizeof(saved_cpus), &saved_cpus);
+
+	latency[RT_BOOSTED].preempted += nivcsw - phase_nivcsw;
+	phase_nivcsw = nivcsw;
+
+	boosted = false;
+	boost_ns = rt_now() - boost_start;
+	boost_end = reason;
+
+	log_info("left boosted scheduling after %llu ms (%s)",
+		 (unsigned long long)boost_ns / 1000000, reason);
+}
+
+int rt_fd(void)
+{
+	return boosted ? timer_fd : -1;
+}
+
+/*
+ * Leave the boosted phase once its window is over or the service has been
+ * idle since last_active for long enough, otherwise rearm the timer for
+ * whichever comes first.
+ */
+void rt_check(uint64_t last_active)
+{
+	uint64_t expirations;
+	uint64_t deadline = UINT64_MAX;
+	uint64_t now = rt_now();
+
+	if (!boosted || timer_fd < 0)
+		return;
+
+	read(timer_fd, &expirations, sizeof(expirations));
+
+	if (window_ns) {
+		if (now >= boost_start + window_ns) {
+			rt_leave("window");
+			return;
+		}
+
+		deadline = boost_start + window_ns;
+	}
+
+	if (idle_ns) {
+		if (last_active < boost_start)
+			last_active = boost_start;
+
+		if (now >= last_active + idle_ns) {
+			rt_leave("idle");
+			return;
+		}
+
+		deadline = MIN(deadline, last_active + idle_ns);
+	}
+
+	rt_arm(timer_fd, deadline);
+}
+
+int rt_probe_fd(void)
+{
+	return probe_fd;
+}
+
+void rt_probe(void)
+{
+	struct rt_latency *lat = &latency[boosted ? RT_BOOSTED : RT_NORMAL];
+	uint64_t expirations;
+	uint64_t late;
+	uint64_t now = rt_now();
+	unsigned i;
+
+	if (read(probe_fd, &expirations, sizeof(expirations)) < 0)
+		return;
+
+	late = now - probe_next;
+
+	lat->samples++;
+	lat->total_ns += late;
+	if (late > lat->max_ns)
+		lat->max_ns = late;
+
+	for (i = 0; i < RT_BUCKETS - 1; i++) {
+		if (late < bucket_limits_us[i] * 1000ull)
+			break;
+	}
+	lat->buckets[i]++;
+
+	probe_next += probe_interval;
+	if (probe_next <= now)
+		probe_next = now + probe_interval;
+
+	rt_arm(probe_fd, probe_next);
+}
+
+void rt_dump_stats(FILE *fp)
+{
+	struct rt_latency *lat;
+	long nivcsw;
+	unsigned i;
+	int phase;
+
+	if (policy < 0 && !cpus_set && probe_fd < 0)
+		return;
+
+	if (policy >= 0 || cpus_set) {
+		fprintf(fp, "scheduling: %s on cpus %s, ",
+			policy_spec ? policy_spec : "default",
+			cpus_spec ? cpus_spec : "all");
+		if (boosted)
+			fprintf(fp, "boosted for %llu ms\n",
+				(unsigned long long)(rt_now() - boost_start) / 1000000);
+		else
+			fprintf(fp, "boosted for %llu ms (left on %s)\n",
+				(unsigned long long)boost_ns / 1000000,
+				boost_end);
+	}
+
+	nivcsw = rt_nivcsw();
+
+	for (phase = 0; phase < RT_NUM_PHASES; phase++) {
+		lat = &latency[phase];
+
+		/* The current phase's switches are only added when it ends */
+		if (phase == (boosted ? RT_BOOSTED : RT_NORMAL))
+			lat->preempted += nivcsw - phase_nivcsw;
+
+		if (!lat->samples && !lat->preempted)
+			continue;
+
+		fprintf(fp, "%s wakeup latency: %lu samples, avg %llu us, max %llu us, %ld preemptions\n",
+			phase_names[phase], lat->samples,
+			lat->samples ? (unsigned long long)lat->total_ns / lat->samples / 1000 : 0,
+			(unsigned long long)lat->max_ns / 1000, lat->preempted);
+
+		if (!lat->samples)
+			continue;
+
+		fprintf(fp, "  ");
+		for (i = 0; i < RT_BUCKETS - 1; i++)
+			fprintf(fp, "<%uus: %lu ", bucket_limits_us[i],
+				lat->buckets[i]);
+		fprintf(fp, ">=%uus: %lu\n", bucket_limits_us[RT_BUCKETS - 2],
+			lat->buckets[RT_BUCKETS - 1]);
+	}
+
+	phase_nivcsw = nivcsw;
+}
@@ -0,0 +1,344 @@
+/*
+ * Copyright (c) 2018, Bjorn Andersson <bjorn@kryo.se>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rules.h"
+
+#define RULES_HASH_SIZE		64
+#define RULES_LINE_MAX		1024
+
+/*
+ * Stub services answer from a rules file instead of code. Each line holds
+ * one rule:
+ *
+ *   <service> <msg id> [<tlv>:<hex>]... = <result> [<tlv>:<hex>]...
+ *
+ * The TLVs before '=' must be present in the request with exactly the given
+ * value, those after it are added to the response following the result TLV.
+ * The first matching rule, in file order, is used. '#' starts a comment.
+ *
+ *   229 1 = 0 16:0100
+ */
+static struct rule *rules[RULES_HASH_SIZE];
+
+static unsigned rules_hash(unsigned service, unsigned msg_id)
+{
+	return (service * 31 + msg_id) % RULES_HASH_SIZE;
+}
+
+static int rules_parse_tlv(char *tok, uint8_t *type, uint8_t *value,
+			   uint16_t *len)
+{
+	unsigned long t;
+	unsigned byte;
+	char *hex;
+	size_t n;
+
+	t = strtoul(tok, &hex, 0);
+	if (*hex != ':' || t > 255)
+		return -1;
+	hex++;
+
+	n = strlen(hex);
+	if (n % 2 || n / 2 > RULES_MAX_TLV)
+		return -1;
+
+	for (*len = 0; *hex; hex += 2) {
+		if (!isxdigit(hex[0]) || !isxdigit(hex[1]) ||
+		    sscanf(hex, "%2x", &byte) != 1)
+			return -1;
+		value[(*len)++] = byte;
+	}
+
+	*type = t;
+	return 0;
+}
+
+static uint8_t *rules_put_tlv(uint8_t *ptr, uint8_t type, const void *value,
+			      uint16_t len)
+{
+	*ptr++ = type;
+	*ptr++ = len & 0xff;
+	*ptr++ = len >> 8;
+	memcpy(ptr, value, len);
+
+	return ptr + len;
+}
+
+/* Encode the response of a rule, given the TLVs following the result */
+static int rules_encode(struct rule *rule, char *tok, char **save)
+{
+	uint8_t value[RULES_MAX_TLV];
+	struct qmi_header *hdr;
+	uint8_t result[4];
+	uint8_t *buf;
+	uint8_t *tmp;
+	uint16_t len;
+	uint8_t type;
+	size_t size;
+	size_t off;
+
+	size = sizeof(*hdr) + 3 + sizeof(result);
+	buf = malloc(size);
+	if (!buf)
+		return -1;
+
+	result[0] = rule->result;
+	result[1] = rule->result >> 8;
+	result[2] = rule->result >> 16;
+	result[3] = rule->result >> 24;
+
+	rules_put_tlv(buf + sizeof(*hdr), 1, result, sizeof(result));
+
+	for (; tok; tok = strtok_r(NULL, " \t\n", save)) {
+		if (rules_parse_tlv(tok, &type, value, &len) < 0)
+			goto err;
+
+		off = size;
+		size += 3 + len;
+
+		tmp = realloc(buf, size);
+		if (!tmp)
+			goto err;
+		buf = tmp;
+
+		rules_put_tlv(buf + off, type, value, len);
+	}
+
+	hdr = (struct qmi_header *)buf;
+	hdr->type = QMI_RESPONSE;
+	hdr->txn_id = 0;
+	hdr->msg_id = rule->msg_id;
+	hdr->msg_len = size - sizeof(*hdr);
+
+	rule->resp = buf;
+	rule->resp_len = size;
+
+	return 0;
+
+err:
+	free(buf);
+	return -1;
+}
+
+static int rules_parse(struct rule *rule, char *line)
+{
+	struct rule_match *match;
+	char *save;
+	char *end;
+	char *tok;
+
+	tok = strtok_r(line, " \t\n", &save);
+	if (!tok)
+		return 0;
+	rule->service = strtoul(tok, &end, 0);
+	if (*end)
+		return -1;
+
+	tok = strtok_r(NULL, " \t\n", &save);
+	if (!tok)
+		return -1;
+	rule->msg_id = strtoul(tok, &end, 0);
+	if (*end)
+		return -1;
+
+	while ((tok = strtok_r(NULL, " \t\n", &save)) && strcmp(tok, "=")) {
+		match = realloc(rule->matches,
+				(rule->num_matches + 1) * sizeof(*match));
+		if (!match)
+			return -1;
+		rule->matches = match;
+
+		match = &rule->matches[rule->num_matches++];
+		if (rules_parse_tlv(tok, &match->type, match->value,
+				    &match->len) < 0)
+			return -1;
+	}
+
+	tok = strtok_r(NULL, " \t\n", &save);
+	if (!tok)
+		return -1;
+	rule->result = strtoul(tok, &end, 0);
+	if (*end)
+		return -1;
+
+	if (rules_encode(rule, strtok_r(NULL, " \t\n", &save), &save) < 0)
+		return -1;
+
+	return 1;
+}
+
+int rules_load(const char *path)
+{
+	char line[RULES_LINE_MAX];
+	struct rule **tail;
+	struct rule *rule;
+	unsigned lineno = 0;
+	char *comment;
+	unsigned hash;
+	FILE *fp;
+	int ret;
+
+	fp = fopen(path, "r");
+	if (!fp)
+		return -1;
+
+	while (fgets(line, sizeof(line), fp)) {
+		lineno++;
+
+		comment = strchr(line, '#');
+		if (comment)
+			*comment = '\0';
+
+		rule = calloc(1, sizeof(*rule));
+		if (!rule)
+			goto err;
+
+		rule->line = lineno;
+
+		ret = rules_parse(rule, line);
+		if (ret <= 0) {
+			free(rule->matches);
+			free(rule);
+			if (ret < 0) {
+				fprintf(stderr, "%s:%u: invalid rule\n", path,
+					lineno);
+				goto err;
+			}
+			continue;
+		}
+
+		/* Keep file order, the first matching rule wins */
+		hash = rules_hash(rule->service, rule->msg_id);
+		for (tail = &rules[hash]; *tail; tail = &(*tail)->next)
+			;
+		*tail = rule;
+	}
+
+	fclose(fp);
+	return 0;
+
+err:
+	fclose(fp);
+	return -1;
+}
+
+static int rules_match_one(struct rule *rule, const uint8_t *tlv, size_t len)
+{
+	const struct rule_match *match;
+	const uint8_t *ptr;
+	uint16_t tlv_len = 0;
+	unsigned i;
+
+	for (i = 0; i < rule->num_matches; i++) {
+		match = &rule->matches[i];
+
+		for (ptr = tlv; ptr + 3 <= tlv + len; ptr += 3 + tlv_len) {
+			tlv_len = ptr[1] | ptr[2] << 8;
+			if (ptr[0] == match->type)
+				break;
+		}
+
+		if (ptr + 3 > tlv + len || tlv_len != match->len ||
+		    ptr + 3 + tlv_len > tlv + len ||
+		    memcmp(ptr + 3, match->value, tlv_len))
+			return 0;
+	}
+
+	return 1;
+}
+
+/* Returns the first rule matching the request, or NULL */
+struct rule *rules_match(unsigned service, const struct qrtr_packet *pkt)
+{
+	const struct qmi_header *hdr = pkt->data;
+	struct rule *rule;
+	size_t len;
+
+	if (pkt->data_len < sizeof(*hdr))
+		return NULL;
+
+	len = pkt->data_len - sizeof(*hdr);
+	if (hdr->msg_len < len)
+		len = hdr->msg_len;
+
+	for (rule = rules[rules_hash(service, hdr->msg_id)]; rule; rule = rule->next) {
+		if (rule->service != service || rule->msg_id != hdr->msg_id)
+			continue;
+
+		if (rules_match_one(rule, (const uint8_t *)(hdr + 1), len)) {
+			rule->hits++;
+			return rule;
+		}
+	}
+
+	return NULL;
+}
+
+/* Fills in the distinct services having rules, returns their number */
+unsigned rules_services(unsigned *ids, unsigned max)
+{
+	struct rule *rule;
+	unsigned count = 0;
+	unsigned i;
+	unsigned j;
+
+	for (i = 0; i < RULES_HASH_SIZE; i++) {
+		for (rule = rules[i]; rule; rule = rule->next) {
+			for (j = 0; j < count; j++) {
+				if (ids[j] == rule->service)
+					break;
+			}
+
+			if (j == count && count < max)
+				ids[count++] = rule->service;
+		}
+	}
+
+	return count;
+}
+
+void rules_dump_stats(FILE *fp)
+{
+	struct rule *rule;
+	unsigned i;
+
+	for (i = 0; i < RULES_HASH_SIZE; i++) {
+		for (rule = rules[i]; rule; rule = rule->next) {
+			fprintf(fp, "rule %u (service %u message %u): %lu hits\n",
+				rule->line, rule->service, rule->msg_id,
+				rule->hits);
+		}
+	}
+}
@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) 2018, Bjorn Andersson <bjorn@kryo.se>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef __RULES_H__
+#define __RULES_H__
+
+#include <stdint.h>
+#include <stdio.h>
+#include <libqrtr.h>
+
+#define RULES_MAX_TLV		256
+
+struct rule_match {
+	uint8_t type;
+	uint16_t len;
+	uint8_t value[RULES_MAX_TLV];
+};
+
+struct rule {
+	struct rule *next;
+
+	unsigned service;
+	unsigned msg_id;
+	unsigned line;
+
+	struct rule_match *matches;
+	unsigned num_matches;
+
+	/* response encoded at load time, with a zero transaction id */
+	uint32_t result;
+	void *resp;
+	size_t resp_len;
+
+	unsigned long hits;
+};
+
+int rules_load(const char *path);
+struct rule *rules_match(unsigned service, const struct qrtr_packet *pkt);
+unsigned rules_services(unsigned *ids, unsigned max);
+
+void rules_dump_stats(FILE *fp);
+
+#endif
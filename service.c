@@ -0,0 +1,268 @@
+/*
+ * Copyright (c) 2018, Bjorn Andersson <bjorn@kryo.se>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libqrtr.h>
+
+#include "log.h"
+#include "peer.h"
+#include "perf.h"
+#include "qmi_size.h"
+#include "resident.h"
+#include "rules.h"
+#include "service.h"
+#include "trace.h"
+
+#define MAX(x, y) ((x) > (y) ? (x) : (y))
+
+/* Clients only know success (0) and failure (1), so busy is a failure */
+#define RESULT_BUSY		1
+
+/*
+ * Buffers shared by all requests handled on one thread, allocated once for
+ * the largest message of all registered services.
+ */
+struct service_worker {
+	void *req;
+	void *resp;
+
+	struct qrtr_packet resp_pkt;
+	void *resp_buf;
+	size_t resp_buf_size;
+};
+
+static struct service_worker worker;
+
+/*
+ * Clear all fields of a message except the contents of variable length
+ * arrays, which are bounded by their (cleared) length field. This keeps the
+ * cost of preparing a read response independent of its 64k data array.
+ */
+static void qmi_clear(void *c_struct, struct qmi_elem_info *ei)
+{
+	for (; ei->data_type != QMI_EOTI; ei++) {
+		if (ei->array_type == VAR_LEN_ARRAY)
+			continue;
+
+		memset((char *)c_struct + ei->offset, 0,
+		       ei->elem_len * ei->elem_size);
+	}
+}
+
+int service_init(struct service_type *types, unsigned count)
+{
+	const struct qmi_handler *handler;
+	size_t resp_size = 0;
+	size_t req_size = 0;
+	size_t buf_size = 0;
+	unsigned i;
+
+	for (i = 0; i < count; i++) {
+		for (handler = types[i].handlers; handler->handle; handler++) {
+			req_size = MAX(req_size, qmi_struct_size(handler->req_ei));
+			resp_size = MAX(resp_size, qmi_struct_size(handler->resp_ei));
+			buf_size = MAX(buf_size, qmi_encoded_size(handler->resp_ei));
+		}
+	}
+
+	worker.req = resident_alloc(MAX(req_size, 1));
+	worker.resp = resident_alloc(MAX(resp_size, sizeof(uint32_t)));
+	worker.resp_buf = resident_alloc(buf_size);
+	worker.resp_buf_size = buf_size;
+	if (!worker.req || !worker.resp || !worker.resp_buf)
+		return -1;
+
+	return 0;
+}
+
+static const struct qmi_handler *service_lookup(struct service_type *type,
+						unsigned msg_id)
+{
+	const struct qmi_handler *handler;
+
+	for (handler = type->handlers; handler->handle; handler++) {
+		if (handler->msg_id == msg_id)
+			return handler;
+	}
+
+	return NULL;
+}
+
+int service_dispatch(struct service *svc, struct qrtr_packet *pkt)
+{
+	const struct qmi_handler *handler;
+	const struct qmi_header *hdr;
+	struct rule *rule;
+	unsigned int msg_id;
+	unsigned int txn;
+	uint32_t *result;
+	int ret;
+
+	if (pkt->type != QRTR_TYPE_DATA)
+		return 0;
+
+	ret = qmi_decode_header(pkt, &msg_id);
+	if (ret < 0)
+		return ret;
+
+	hdr = pkt->data;
+	txn = hdr->txn_id;
+
+	/* Rules take precedence, answering with their precompiled response */
+	rule = rules_match(svc->type->id, pkt);
+	if (rule) {
+		trace_mark(TRACE_DECODE);
+		perf_mark(PERF_DECODE);
+		trace_result(rule->result);
+		return service_send_prepared(svc, pkt, txn, rule->resp,
+					     rule->resp_len);
+	}
+
+	handler = service_lookup(svc->type, msg_id);
+	if (!handler) {
+		log_warn("Unhandled %s message: %d", svc->type->name, msg_id);
+		return 0;
+	}
+
+	qmi_clear(worker.req, handler->req_ei);
+	qmi_clear(worker.resp, handler->resp_ei);
+	result = worker.resp;
+
+	ret = qmi_decode_message(worker.req, &txn, pkt, QMI_REQUEST, msg_id,
+				 handler->req_ei);
+	trace_mark(TRACE_DECODE);
+	perf_mark(PERF_DECODE);
+	if (ret < 0) {
+		log_warn("[%s] failed to decode %s request", svc->type->name,
+			 handler->name);
+		*result = 1;
+	} else {
+		ret = handler->handle(svc, pkt, txn, worker.req, worker.resp);
+		if (ret == SERVICE_RESPONDED)
+			return 0;
+		else if (ret == SERVICE_PARKED)
+			return ret;
+	}
+
+	trace_result(*result);
+	trace_mark(TRACE_HANDLE);
+	perf_mark(PERF_LOOKUP);
+
+	worker.resp_pkt.data = worker.resp_buf;
+	worker.resp_pkt.data_len = worker.resp_buf_size;
+
+	ret = qmi_encode_message(&worker.resp_pkt, QMI_RESPONSE, msg_id, txn,
+				 worker.resp, handler->resp_ei);
+	if (ret < 0) {
+		log_err("[%s] failed to encode %s response", svc->type->name,
+			handler->name);
+		return ret;
+	}
+
+	trace_mark(TRACE_ENCODE);
+	perf_mark(PERF_ENCODE);
+
+	peer_cache_response(svc->sock, pkt, worker.resp_pkt.data,
+			    worker.resp_pkt.data_len);
+
+	ret = peer_send(svc->sock, pkt->node, pkt->port, worker.resp_pkt.data,
+			worker.resp_pkt.data_len);
+	trace_mark(TRACE_SEND);
+	perf_mark(PERF_SEND);
+	if (ret < 0)
+		log_err("[%s] failed to send %s response", svc->type->name,
+			handler->name);
+
+	return ret;
+}
+
+/* Send a response encoded ahead of time, patching in the transaction id */
+int service_send_prepared(struct service *svc, struct qrtr_packet *pkt,
+			  unsigned int txn, void *buf, size_t len)
+{
+	struct qmi_header *hdr = buf;
+	int ret;
+
+	hdr->txn_id = txn;
+	trace_mark(TRACE_HANDLE);
+	perf_mark(PERF_LOOKUP);
+
+	peer_cache_response(svc->sock, pkt, buf, len);
+
+	ret = peer_send(svc->sock, pkt->node, pkt->port, buf, len);
+	trace_mark(TRACE_SEND);
+	perf_mark(PERF_SEND);
+	if (ret < 0)
+		log_err("failed to send prepared response");
+
+	return ret;
+}
+
+struct busy_resp {
+	uint32_t result;
+};
+
+static struct qmi_elem_info busy_resp_ei[] = {
+	{
+		.data_type = QMI_UNSIGNED_4_BYTE,
+		.elem_len = 1,
+		.elem_size = sizeof(uint32_t),
+		.tlv_type = 1,
+		.offset = offsetof(struct busy_resp, result),
+	},
+	{}
+};
+
+/* Answer a request right away, without queueing it */
+void service_send_busy(struct service *svc, struct qrtr_packet *pkt)
+{
+	DEFINE_QRTR_PACKET(resp_buf, 32);
+	struct busy_resp resp = { .result = RESULT_BUSY };
+	const struct qmi_header *hdr = pkt->data;
+	int ret;
+
+	if (pkt->data_len < sizeof(*hdr))
+		return;
+
+	ret = qmi_encode_message(&resp_buf, QMI_RESPONSE, hdr->msg_id,
+				 hdr->txn_id, &resp, busy_resp_ei);
+	if (ret < 0) {
+		log_err("failed to encode busy response");
+		return;
+	}
+
+	ret = peer_send(svc->sock, pkt->node, pkt->port, resp_buf.data,
+			resp_buf.data_len);
+	if (ret < 0)
+		log_err("failed to send busy response");
+}
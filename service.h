@@ -0,0 +1,96 @@
+/*
+ * Copyright (c) 2018, Bjorn Andersson <bjorn@kryo.se>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef __SERVICE_H__
+#define __SERVICE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <libqrtr.h>
+
+/* Returned by a handler that has already sent its response */
+#define SERVICE_RESPONDED	1
+/* Returned by a handler that can't answer yet, the request has to be retried */
+#define SERVICE_PARKED		2
+
+struct partition;
+struct service;
+
+/*
+ * One request message of a service. The framework decodes the request into
+ * a buffer sized from req_ei, hands it to the handler together with a cleared
+ * response and encodes the response using resp_ei. Every response starts with
+ * its uint32_t result, which the framework fills in on decode failures.
+ */
+struct qmi_handler {
+	unsigned msg_id;
+	const char *name;
+
+	struct qmi_elem_info *req_ei;
+	struct qmi_elem_info *resp_ei;
+
+	int (*handle)(struct service *svc, struct qrtr_packet *pkt,
+		      unsigned int txn, const void *req, void *resp);
+};
+
+struct service_type {
+	unsigned id;
+	const char *name;
+
+	/* terminated by an empty entry */
+	const struct qmi_handler *handlers;
+
+	unsigned weight;
+	unsigned coalesce_us;
+};
+
+/* A service type published for one partition, under the partition's instance */
+struct service {
+	struct service_type *type;
+	struct partition *part;
+	unsigned instance;
+
+	int sock;
+
+	/* set while a coalesced wakeup is pending, see coalesce_arm() */
+	uint64_t deadline;
+	unsigned long batches;
+	unsigned long batched;
+	uint64_t delay_ns;
+};
+
+int service_init(struct service_type *types, unsigned count);
+int service_dispatch(struct service *svc, struct qrtr_packet *pkt);
+
+int service_send_prepared(struct service *svc, struct qrtr_packet *pkt,
+			  unsigned int txn, void *buf, size_t len);
+void service_send_busy(struct service *svc, struct qrtr_packet *pkt);
+
+#endif
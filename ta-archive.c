@@ -0,0 +1,110 @@
+/*
+ * Copyright (c) 2018, Bjorn Andersson <bjorn@kryo.se>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ta_snap.h"
+
+/*
+ * Exports all units of a partition from a running ta-service to stdout, or
+ * replaces them with an archive read from a file, e.g.:
+ *
+ *   ta-archive -s /run/ta-service export > backup.ta
+ *   ta-archive -s /run/ta-service import backup.ta
+ *
+ * It also fetches the service's in-memory trace ring, for ta-replay:
+ *
+ *   ta-archive -s /run/ta-service trace > recent.trace
+ */
+
+extern char *__progname;
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"%s -s <socket> [-i instance] export\n"
+		"%s -s <socket> [-i instance] import <archive>\n"
+		"%s -s <socket> trace\n",
+		__progname, __progname, __progname);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	const char *path = NULL;
+	unsigned instance = 0;
+	int opt;
+	int ret;
+	int fd;
+
+	while ((opt = getopt(argc, argv, "s:i:")) != -1) {
+		switch (opt) {
+		case 's':
+			path = optarg;
+			break;
+		case 'i':
+			instance = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (!path || optind == argc)
+		usage();
+
+	if (!strcmp(argv[optind], "export")) {
+		ret = ta_snap_export(path, instance, STDOUT_FILENO);
+	} else if (!strcmp(argv[optind], "import") && optind + 1 < argc) {
+		fd = open(argv[optind + 1], O_RDONLY | O_CLOEXEC);
+		if (fd < 0) {
+			fprintf(stderr, "failed to open %s\n", argv[optind + 1]);
+			return 1;
+		}
+
+		ret = ta_snap_import(path, instance, fd);
+		close(fd);
+	} else if (!strcmp(argv[optind], "trace")) {
+		ret = ta_snap_trace(path, STDOUT_FILENO);
+	} else {
+		usage();
+	}
+
+	if (ret < 0) {
+		fprintf(stderr, "%s failed: %s\n", argv[optind], strerror(-ret));
+		return 1;
+	}
+
+	return 0;
+}
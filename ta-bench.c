@@ -0,0 +1,454 @@
+/*
+ * Copyright (c) 2018, Bjorn Andersson <bjorn@kryo.se>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ta_client.h"
+#include "ta_snap.h"
+
+/*
+ * Reads all units of a partition through the pipelined client, a number of
+ * rounds, and reports the throughput and latency distribution of the reads.
+ * Given the service's control socket, it also fails if the service allocated
+ * memory or hit one of its limits while serving the reads, and reports the
+ * hardware counters of each stage of the requests if the service counts them.
+ * The service only counts the allocations of its own code, not those made
+ * inside libc or libqrtr, so a pass does not prove that none were made.
+ */
+
+#define MAX_PERF_ENTRIES	32
+
+extern char *__progname;
+
+static const char * const stage_names[TA_SNAP_PERF_STAGES] = {
+	"decode", "lookup", "copy", "encode", "send",
+};
+
+static const char * const counter_names[TA_SNAP_PERF_COUNTERS] = {
+	"cycles", "instructions", "cache_misses", "branch_misses",
+};
+
+static unsigned *units;
+static unsigned num_units;
+
+static uint64_t *sent_at;
+static uint32_t *latencies;
+static unsigned long num_latencies;
+static unsigned long errors;
+static unsigned long long bytes;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void unit_found(void *cookie, int result, unsigned unit,
+		       const void *data, size_t len)
+{
+	unsigned *grown;
+
+	if (result)
+		return;
+
+	if (!(num_units & (num_units - 1))) {
+		grown = realloc(units, (num_units ? num_units * 2 : 1) * sizeof(*units));
+		if (!grown) {
+			fprintf(stderr, "failed to allocate unit list\n");
+			exit(1);
+		}
+		units = grown;
+	}
+
+	units[num_units++] = unit;
+}
+
+static void read_done(void *cookie, int result, unsigned unit,
+		      const void *data, size_t len)
+{
+	uint64_t *sent = cookie;
+
+	latencies[num_latencies++] = (now_ns() - *sent) / 1000;
+
+	if (result)
+		errors++;
+	else
+		bytes += len;
+}
+
+static void run_pipelined(struct ta_client *client)
+{
+	unsigned i;
+	int ret;
+
+	for (i = 0; i < num_units;) {
+		sent_at[i] = now_ns();
+
+		ret = ta_client_read(client, units[i], read_done, &sent_at[i]);
+		if (ret == -EAGAIN) {
+			ta_client_wait(client, -1);
+			continue;
+		} else if (ret < 0) {
+			errors++;
+		}
+
+		i++;
+	}
+
+	while (ta_client_inflight(client))
+		ta_client_wait(client, -1);
+}
+
+static void run_blocking(struct ta_client *client)
+{
+	static uint8_t buf[65536];
+	size_t len;
+	unsigned i;
+	int ret;
+
+	for (i = 0; i < num_units; i++) {
+		sent_at[i] = now_ns();
+
+		len = sizeof(buf);
+		ret = ta_client_read_sync(client, units[i], buf, &len);
+
+		latencies[num_latencies++] = (now_ns() - sent_at[i]) / 1000;
+		if (ret)
+			errors++;
+		else
+			bytes += len;
+	}
+}
+
+static int latency_cmp(const void *a, const void *b)
+{
+	uint32_t la = *(const uint32_t *)a;
+	uint32_t lb = *(const uint32_t *)b;
+
+	return la < lb ? -1 : la > lb;
+}
+
+/* Turn the after counters into the cost per request of the benchmark's requests */
+static unsigned perf_delta(struct ta_snap_perf *after, unsigned num_after,
+			   struct ta_snap_perf *before, unsigned num_before)
+{
+	struct ta_snap_perf *prev;
+	unsigned stage;
+	unsigned n = 0;
+	unsigned i;
+	unsigned j;
+	unsigned k;
+
+	for (i = 0; i < num_after; i++) {
+		prev = NULL;
+		for (j = 0; j < num_before; j++) {
+			if (before[j].service == after[i].service &&
+			    before[j].msg_id == after[i].msg_id)
+				prev = &before[j];
+		}
+
+		if (prev) {
+			after[i].samples -= prev->samples;
+			after[i].parked -= prev->parked;
+			after[i].park_ns -= prev->park_ns;
+			for (stage = 0; stage < TA_SNAP_PERF_STAGES; stage++) {
+				for (k = 0; k < TA_SNAP_PERF_COUNTERS; k++)
+					after[i].counters[stage][k] -= prev->counters[stage][k];
+			}
+		}
+
+		if (!after[i].samples)
+			continue;
+
+		for (stage = 0; stage < TA_SNAP_PERF_STAGES; stage++) {
+			for (k = 0; k < TA_SNAP_PERF_COUNTERS; k++)
+				after[i].counters[stage][k] /= after[i].samples;
+		}
+
+		after[n++] = after[i];
+	}
+
+	return n;
+}
+
+static void print_perf(struct ta_snap_perf *perf, unsigned count)
+{
+	unsigned stage;
+	unsigned i;
+
+	for (i = 0; i < count; i++) {
+		printf("perf %u:%u: %llu requests, %llu parked (%llu us total), per request:\n",
+		       perf[i].service, perf[i].msg_id,
+		       (unsigned long long)perf[i].samples,
+		       (unsigned long long)perf[i].parked,
+		       (unsigned long long)perf[i].park_ns / 1000);
+
+		for (stage = 0; stage < TA_SNAP_PERF_STAGES; stage++)
+			printf("  %-6s %llu cycles, %llu instructions, %llu cache misses, %llu branch misses\n",
+			       stage_names[stage],
+			       (unsigned long long)perf[i].counters[stage][0],
+			       (unsigned long long)perf[i].counters[stage][1],
+			       (unsigned long long)perf[i].counters[stage][2],
+			       (unsigned long long)perf[i].counters[stage][3]);
+	}
+}
+
+static void print_perf_json(struct ta_snap_perf *perf, unsigned count)
+{
+	unsigned stage;
+	unsigned i;
+	unsigned j;
+
+	printf(",\n  \"perf\": [");
+
+	for (i = 0; i < count; i++) {
+		printf("%s\n    { \"service\": %u, \"msg_id\": %u, \"requests\": %llu, \"parked\": %llu, \"park_us\": %llu,",
+		       i ? "," : "", perf[i].service, perf[i].msg_id,
+		       (unsigned long long)perf[i].samples,
+		       (unsigned long long)perf[i].parked,
+		       (unsigned long long)perf[i].park_ns / 1000);
+
+		for (stage = 0; stage < TA_SNAP_PERF_STAGES; stage++) {
+			printf("%s\n      \"%s\": {", stage ? "," : "",
+			       stage_names[stage]);
+			for (j = 0; j < TA_SNAP_PERF_COUNTERS; j++)
+				printf("%s \"%s\": %llu", j ? "," : "",
+				       counter_names[j],
+				       (unsigned long long)perf[i].counters[stage][j]);
+			printf(" }");
+		}
+
+		printf(" }");
+	}
+
+	printf("\n  ]");
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"%s [-i instance] [-w window] [-n rounds] [-b] [-j] [-s socket]\n"
+		"  -i instance  partition to read (default 0)\n"
+		"  -w window    transactions kept in flight (default 16)\n"
+		"  -n rounds    times all units are read (default 10)\n"
+		"  -b           use the blocking calls, one request at a time\n"
+		"  -j           print the results as JSON\n"
+		"  -s socket    check the service's allocations through its control socket,\n"
+		"               those made inside libc and libqrtr are not counted\n",
+		__progname);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct ta_snap_stats before;
+	struct ta_snap_stats after;
+	struct ta_snap_perf perf_before[MAX_PERF_ENTRIES];
+	struct ta_snap_perf perf_after[MAX_PERF_ENTRIES];
+	int num_perf_before = 0;
+	int num_perf = -1;
+	uint64_t enumerated;
+	int json = 0;
+	const char *ctl_path = NULL;
+	struct ta_client *client;
+	unsigned instance = 0;
+	unsigned window = 16;
+	unsigned rounds = 10;
+	int blocking = 0;
+	uint64_t elapsed;
+	uint64_t start;
+	unsigned i;
+	int ret;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "i:w:n:bjs:")) != -1) {
+		switch (opt) {
+		case 'i':
+			instance = strtoul(optarg, NULL, 0);
+			break;
+		case 'w':
+			window = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			rounds = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			blocking = 1;
+			break;
+		case 'j':
+			json = 1;
+			break;
+		case 's':
+			ctl_path = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (optind != argc || !rounds)
+		usage();
+
+	client = ta_client_open(instance, window);
+	if (!client) {
+		fprintf(stderr, "failed to connect to TA services of instance %u\n",
+			instance);
+		exit(1);
+	}
+
+	start = now_ns();
+	ret = ta_client_read_all(client, unit_found, NULL);
+	if (ret < 0) {
+		fprintf(stderr, "failed to enumerate units: %s\n", strerror(-ret));
+		exit(1);
+	}
+
+	enumerated = now_ns() - start;
+	if (!json)
+		printf("read all: %u units in %llu us\n", num_units,
+		       (unsigned long long)enumerated / 1000);
+
+	if (!num_units) {
+		if (json)
+			printf("{ \"units\": 0 }\n");
+		return 0;
+	}
+
+	sent_at = calloc(num_units, sizeof(*sent_at));
+	latencies = calloc((size_t)num_units * rounds, sizeof(*latencies));
+	if (!sent_at || !latencies) {
+		fprintf(stderr, "failed to allocate latency buffers\n");
+		exit(1);
+	}
+
+	if (ctl_path && ta_snap_stats(ctl_path, &before) < 0) {
+		fprintf(stderr, "failed to query service stats on %s\n", ctl_path);
+		exit(1);
+	}
+
+	/* The counters are only reported if the service runs with them */
+	if (ctl_path)
+		num_perf_before = ta_snap_perf(ctl_path, perf_before,
+					       MAX_PERF_ENTRIES);
+
+	start = now_ns();
+	for (i = 0; i < rounds; i++) {
+		if (blocking)
+			run_blocking(client);
+		else
+			run_pipelined(client);
+	}
+	elapsed = now_ns() - start;
+
+	qsort(latencies, num_latencies, sizeof(*latencies), latency_cmp);
+
+	ta_client_close(client);
+
+	if (ctl_path && ta_snap_stats(ctl_path, &after) < 0) {
+		fprintf(stderr, "failed to query service stats on %s\n", ctl_path);
+		exit(1);
+	}
+
+	if (ctl_path && num_perf_before >= 0) {
+		num_perf = ta_snap_perf(ctl_path, perf_after, MAX_PERF_ENTRIES);
+		if (num_perf >= 0)
+			num_perf = perf_delta(perf_after, num_perf, perf_before,
+					      num_perf_before);
+	}
+
+	if (json) {
+		printf("{\n  \"instance\": %u,\n  \"units\": %u,\n"
+		       "  \"enumerate_us\": %llu,\n",
+		       instance, num_units,
+		       (unsigned long long)enumerated / 1000);
+		printf("  \"rounds\": %u,\n  \"window\": %u,\n"
+		       "  \"reads\": %lu,\n  \"failed\": %lu,\n"
+		       "  \"elapsed_us\": %llu,\n",
+		       rounds, blocking ? 1 : window, num_latencies, errors,
+		       (unsigned long long)elapsed / 1000);
+		printf("  \"reads_per_s\": %llu,\n  \"kib_per_s\": %llu,\n",
+		       (unsigned long long)(num_latencies * 1000000000ull / elapsed),
+		       (unsigned long long)(bytes * 1000000000ull / elapsed / 1024));
+		printf("  \"latency_us\": { \"p50\": %u, \"p99\": %u, \"max\": %u }",
+		       latencies[num_latencies / 2],
+		       latencies[num_latencies * 99 / 100],
+		       latencies[num_latencies - 1]);
+
+		if (ctl_path)
+			printf(",\n  \"service\": { \"requests\": %llu, \"allocs\": %llu, \"limit_hits\": %llu }",
+			       (unsigned long long)(after.requests - before.requests),
+			       (unsigned long long)(after.allocs - before.allocs),
+			       (unsigned long long)(after.limit_hits - before.limit_hits));
+
+		if (num_perf >= 0)
+			print_perf_json(perf_after, num_perf);
+
+		printf("\n}\n");
+	} else {
+		printf("reads: %lu (%lu failed) in %llu ms, window %u\n",
+		       num_latencies, errors, (unsigned long long)elapsed / 1000000,
+		       blocking ? 1 : window);
+		printf("throughput: %llu reads/s, %llu KiB/s\n",
+		       (unsigned long long)(num_latencies * 1000000000ull / elapsed),
+		       (unsigned long long)(bytes * 1000000000ull / elapsed / 1024));
+		printf("latency: p50 %u us, p99 %u us, max %u us\n",
+		       latencies[num_latencies / 2],
+		       latencies[num_latencies * 99 / 100],
+		       latencies[num_latencies - 1]);
+
+		if (ctl_path)
+			printf("service: %llu requests, %llu allocations (libc and libqrtr not counted), %llu limit hits\n",
+			       (unsigned long long)(after.requests - before.requests),
+			       (unsigned long long)(after.allocs - before.allocs),
+			       (unsigned long long)(after.limit_hits - before.limit_hits));
+
+		if (num_perf >= 0)
+			print_perf(perf_after, num_perf);
+	}
+
+	if (!ctl_path)
+		return 0;
+
+	if (after.allocs != before.allocs || after.limit_hits != before.limit_hits) {
+		fprintf(stderr, "service allocated or hit a limit while serving\n");
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,405 @@
+/*
+ * Copyright (c) 2018, Bjorn Andersson <bjorn@kryo.se>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <libqrtr.h>
+
+#include "qmi_ta227.h"
+#include "qmi_ta228.h"
+#include "qmi_svc229.h"
+#include "trace.h"
+
+#define MAX_SERVERS		16
+#define LOOKUP_TIMEOUT_MS	1000
+#define DRAIN_TIMEOUT_MS	1000
+
+/*
+ * Replays the requests of a trace captured by ta-service --trace against a
+ * running service, at the original pace or sped up. Requests are sent as
+ * recorded; those too long to be recorded in full are rebuilt from the traced
+ * unit, with any other fields left zero.
+ */
+
+extern char *__progname;
+
+struct server {
+	unsigned service;
+	unsigned instance;
+	unsigned node;
+	unsigned port;
+	bool found;
+};
+
+static struct server servers[MAX_SERVERS];
+static unsigned num_servers;
+static unsigned num_found;
+
+static uint64_t sent_at[65536];
+static unsigned long sent;
+static unsigned long skipped;
+static unsigned long received;
+static uint64_t total_latency;
+static uint64_t max_latency;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static struct server *server_slot(unsigned service, unsigned instance)
+{
+	unsigned i;
+
+	for (i = 0; i < num_servers; i++) {
+		if (servers[i].service == service &&
+		    servers[i].instance == instance)
+			return &servers[i];
+	}
+
+	return NULL;
+}
+
+static struct server *find_server(unsigned service, unsigned instance)
+{
+	struct server *server;
+
+	server = server_slot(service, instance);
+	if (!server || !server->found)
+		return NULL;
+
+	return server;
+}
+
+/*
+ * The name service matches lookups on the exact instance, so look up every
+ * service and instance the trace addresses, then rewind it to the records.
+ */
+static int lookup_servers(int sock, FILE *fp)
+{
+	struct trace_record rec;
+	struct sockaddr_qrtr sq;
+	struct qrtr_packet pkt;
+	struct server *server;
+	struct timeval tv;
+	char buf[4096];
+	socklen_t sl;
+	fd_set rfds;
+	int pending = 0;
+	long start;
+	int ret;
+
+	start = ftell(fp);
+
+	while (fread(&rec, sizeof(rec), 1, fp) == 1) {
+		if (server_slot(rec.service, rec.instance) ||
+		    num_servers == MAX_SERVERS)
+			continue;
+
+		ret = qrtr_new_lookup(sock, rec.service, 1, rec.instance);
+		if (ret < 0)
+			return ret;
+
+		servers[num_servers].service = rec.service;
+		servers[num_servers].instance = rec.instance;
+		num_servers++;
+		pending++;
+	}
+
+	if (fseek(fp, start, SEEK_SET) < 0)
+		return -1;
+
+	while (pending) {
+		FD_ZERO(&rfds);
+		FD_SET(sock, &rfds);
+
+		tv.tv_sec = 0;
+		tv.tv_usec = LOOKUP_TIMEOUT_MS * 1000;
+
+		ret = select(sock + 1, &rfds, NULL, NULL, &tv);
+		if (ret <= 0)
+			break;
+
+		sl = sizeof(sq);
+		ret = recvfrom(sock, buf, sizeof(buf), 0, (void *)&sq, &sl);
+		if (ret < 0)
+			return ret;
+
+		ret = qrtr_decode(&pkt, buf, ret, &sq);
+		if (ret < 0 || pkt.type != QRTR_TYPE_NEW_SERVER)
+			continue;
+
+		/* An empty notification terminates each lookup */
+		if (!pkt.service && !pkt.node && !pkt.port) {
+			pending--;
+			continue;
+		}
+
+		server = server_slot(pkt.service, pkt.instance);
+		if (!server || server->found)
+			continue;
+
+		server->node = pkt.node;
+		server->port = pkt.port;
+		server->found = true;
+		num_found++;
+	}
+
+	return 0;
+}
+
+static int encode_request(struct qrtr_packet *pkt,
+			  const struct trace_record *rec, unsigned txn)
+{
+	struct ta227_open_req open_req = {};
+	struct ta227_close_req close_req = {};
+	struct ta227_read_req ta227_read_req = { .unit = rec->unit };
+	struct ta227_iterate_req iterate_req = {};
+	struct ta228_get_size_req get_size_req = { .unit = rec->unit };
+	struct ta228_read_req ta228_read_req = { .unit = rec->unit };
+	struct svc229_req svc229_req = {};
+	struct qmi_header *hdr = pkt->data;
+
+	/* Resend the request as recorded, unless it was cut short */
+	if (rec->req_len >= sizeof(*hdr) && rec->req_len <= sizeof(rec->req) &&
+	    rec->req_len <= pkt->data_len) {
+		memcpy(pkt->data, rec->req, rec->req_len);
+		pkt->data_len = rec->req_len;
+		hdr->txn_id = txn;
+
+		return 0;
+	}
+
+	switch (rec->service << 16 | rec->msg_id) {
+	case 227 << 16 | TA227_OPEN:
+		return qmi_encode_message(pkt, QMI_REQUEST, TA227_OPEN, txn,
+					  &open_req, ta227_open_req_ei);
+	case 227 << 16 | TA227_CLOSE:
+		return qmi_encode_message(pkt, QMI_REQUEST, TA227_CLOSE, txn,
+					  &close_req, ta227_close_req_ei);
+	case 227 << 16 | TA227_READ:
+		return qmi_encode_message(pkt, QMI_REQUEST, TA227_READ, txn,
+					  &ta227_read_req, ta227_read_req_ei);
+	case 227 << 16 | TA227_ITERATE:
+		return qmi_encode_message(pkt, QMI_REQUEST, TA227_ITERATE, txn,
+					  &iterate_req, ta227_iterate_req_ei);
+	case 228 << 16 | TA228_GET_SIZE:
+		return qmi_encode_message(pkt, QMI_REQUEST, TA228_GET_SIZE, txn,
+					  &get_size_req, ta228_get_size_req_ei);
+	case 228 << 16 | TA228_READ:
+		return qmi_encode_message(pkt, QMI_REQUEST, TA228_READ, txn,
+					  &ta228_read_req, ta228_read_req_ei);
+	case 229 << 16 | SVC229_MSG1:
+		return qmi_encode_message(pkt, QMI_REQUEST, SVC229_MSG1, txn,
+					  &svc229_req, svc229_req_ei);
+	}
+
+	return -1;
+}
+
+static void drain_responses(int sock)
+{
+	const struct qmi_header *hdr;
+	uint64_t latency;
+	char buf[8192];
+	int ret;
+
+	for (;;) {
+		ret = recv(sock, buf, sizeof(buf), MSG_DONTWAIT);
+		if (ret < (int)sizeof(*hdr))
+			return;
+
+		hdr = (const struct qmi_header *)buf;
+		if (!sent_at[hdr->txn_id])
+			continue;
+
+		latency = now_ns() - sent_at[hdr->txn_id];
+		sent_at[hdr->txn_id] = 0;
+
+		total_latency += latency;
+		if (latency > max_latency)
+			max_latency = latency;
+		received++;
+	}
+}
+
+static void wait_until(uint64_t deadline, int sock)
+{
+	struct timeval tv;
+	fd_set rfds;
+	uint64_t now;
+
+	for (;;) {
+		drain_responses(sock);
+
+		now = now_ns();
+		if (now >= deadline)
+			return;
+
+		FD_ZERO(&rfds);
+		FD_SET(sock, &rfds);
+
+		tv.tv_sec = (deadline - now) / 1000000000ull;
+		tv.tv_usec = (deadline - now) % 1000000000ull / 1000;
+
+		select(sock + 1, &rfds, NULL, NULL, &tv);
+	}
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"%s [-s speed] <trace>\n"
+		"  -s speed  replay speed factor, 0 for as fast as possible (default 1)\n",
+		__progname);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct qrtr_packet req_buf;
+	struct trace_header hdr;
+	char req_data[256];
+	struct trace_record rec;
+	struct server *server;
+	uint64_t first = 0;
+	uint64_t start;
+	double speed = 1;
+	unsigned txn = 0;
+	FILE *fp;
+	int sock;
+	int ret;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "s:")) != -1) {
+		switch (opt) {
+		case 's':
+			speed = strtod(optarg, NULL);
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (optind != argc - 1)
+		usage();
+
+	fp = fopen(argv[optind], "r");
+	if (!fp) {
+		fprintf(stderr, "failed to open %s\n", argv[optind]);
+		exit(1);
+	}
+
+	if (fread(&hdr, sizeof(hdr), 1, fp) != 1 || hdr.magic != TRACE_MAGIC ||
+	    hdr.version != TRACE_VERSION ||
+	    hdr.record_size != sizeof(struct trace_record)) {
+		fprintf(stderr, "%s is not a ta-service trace\n", argv[optind]);
+		exit(1);
+	}
+
+	sock = qrtr_open(0);
+	if (sock < 0) {
+		fprintf(stderr, "failed to create qrtr socket\n");
+		exit(1);
+	}
+
+	ret = lookup_servers(sock, fp);
+	if (ret < 0 || !num_found) {
+		fprintf(stderr, "failed to find TA services\n");
+		exit(1);
+	}
+
+	start = now_ns();
+
+	while (fread(&rec, sizeof(rec), 1, fp) == 1) {
+		server = find_server(rec.service, rec.instance);
+		if (!server) {
+			skipped++;
+			continue;
+		}
+
+		if (!first)
+			first = rec.timestamp;
+
+		if (speed > 0)
+			wait_until(start + (rec.timestamp - first) / speed, sock);
+
+		txn = (txn + 1) & 0xffff;
+		if (!txn)
+			txn = 1;
+
+		req_buf.data = req_data;
+		req_buf.data_len = sizeof(req_data);
+		ret = encode_request(&req_buf, &rec, txn);
+		if (ret < 0)
+			continue;
+
+		sent_at[txn] = now_ns();
+
+		ret = qrtr_sendto(sock, server->node, server->port,
+				  req_buf.data, req_buf.data_len);
+		if (ret < 0) {
+			sent_at[txn] = 0;
+			continue;
+		}
+
+		sent++;
+		drain_responses(sock);
+	}
+
+	wait_until(now_ns() + DRAIN_TIMEOUT_MS * 1000000ull, sock);
+
+	printf("sent %lu requests in %llu ms, %lu responses\n", sent,
+	       (unsigned long long)(now_ns() - start) / 1000000, received);
+	if (skipped)
+		printf("skipped %lu requests to services that were not found\n",
+		       skipped);
+	if (received)
+		printf("latency avg %llu us, max %llu us\n",
+		       (unsigned long long)(total_latency / received / 1000),
+		       (unsigned long long)(max_latency / 1000));
+
+	fclose(fp);
+	close(sock);
+
+	return 0;
+}
@@ -28,23 +28,96 @@
  * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
  * POSSIBILITY OF SUCH DAMAGE.
  */
+#define _GNU_SOURCE
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "lz.h"
+#include "resident.h"
+#include "ring.h"
+#include "snapshot.h"
+#include "ta.h"
+
 #define TA_MAGIC	0x3bf8e9c1
 #define TA_BLOCK_SIZE	0x20000
 
+#define TA_BLOB_HASH_SIZE	256
+
+#define TA_CHUNK_SIZE	(2 * 1024 * 1024)
+
 typedef uint32_t __le32;
 
+/*
+ * Unit payloads are kept in a content addressed store, so that units carrying
+ * identical data (zeroed calibration blobs, repeated defaults) share one copy.
+ */
+struct blob {
+	struct blob *next;
+
+	uint32_t hash;
+	unsigned refs;
+	size_t len;
+
+	/* size of the compressed payload in data[], or 0 if stored raw */
+	size_t zlen;
+	unsigned hits;
+	struct hot *hot;
+
+	/* offset of the payload in the snapshot being built */
+	uint64_t snap_offset;
+
+	/* reads of the units sharing the payload, and its copy, see ta_compact() */
+	uint64_t heat;
+	struct blob *moved;
+
+	uint8_t data[];
+};
+
+/*
+ * Decompressed copy of a compressed blob, kept in the partition's preallocated
+ * hot ring and evicted in the order the copies were made.
+ */
+struct hot {
+	struct blob *blob;
+
+	uint8_t data[];
+};
+
+/*
+ * Units are listed in the order clients iterate them, and separately in the
+ * order they are looked up in, hottest first once compacted.
+ */
 struct unit {
 	struct unit *next;
+	struct unit *lookup_next;
+	struct blob *blob;
 
 	unsigned id;
-	size_t len;
+	unsigned reads;
+};
+
+/* Scratch entry of ta_compact(), ranking a unit or payload by its reads */
+struct rank {
+	uint64_t heat;
+	void *ptr;
+};
+
+/* Units and payloads are carved out of resident chunks in the residency mode */
+struct chunk {
+	struct chunk *next;
+
+	size_t size;
+	size_t used;
 
 	uint8_t data[];
 };
@@ -62,102 +135,621 @@ struct phys_block {
 	__le32 unknown[2];
 };
 
-static struct unit *units;
+struct ta {
+	struct unit *units;
+	struct unit *lookup;
+	struct blob *blobs[TA_BLOB_HASH_SIZE];
+	struct ta_stats stats;
+
+	struct ring hot;
+
+	struct chunk *chunks;
 
-static void ta_parse_block(void *ptr)
+	/*
+	 * Units and payloads rebuilt by ta_compact(), replacing the above. The
+	 * previous arena is kept as the spare the next round is built in.
+	 */
+	void *arena;
+	size_t arena_size;
+	void *spare;
+	size_t spare_size;
+	struct rank *ranks;
+
+	/* state of an incremental load, see ta_load_step() */
+	int fd;
+	void *block;
+	off_t offset;
+	void *parse;
+	bool loaded;
+};
+
+static size_t compress_min_len;
+static unsigned hot_min_hits;
+static size_t hot_cache_size;
+
+/* Compression scratch buffer, shared by all loaded partitions */
+static uint8_t *scratch;
+static size_t scratch_len;
+
+void ta_set_compression(size_t min_len, unsigned hot_hits, size_t hot_size)
+{
+	compress_min_len = min_len;
+	hot_min_hits = hot_hits;
+	hot_cache_size = hot_size;
+}
+
+static uint32_t ta_hash(const uint8_t *data, size_t len)
+{
+	uint32_t hash = 2166136261u;
+
+	while (len--) {
+		hash ^= *data++;
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+static uint64_t ta_elapsed_ns(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - start->tv_sec) * 1000000000ull +
+	       now.tv_nsec - start->tv_nsec;
+}
+
+static void *ta_mem_alloc(struct ta *ta, size_t size)
+{
+	struct chunk *chunk = ta->chunks;
+	void *ptr;
+
+	if (!resident_enabled())
+		return malloc(size);
+
+	size = (size + 7) & ~7;
+
+	if (!chunk || chunk->used + size > chunk->size) {
+		chunk = resident_alloc(TA_CHUNK_SIZE);
+		if (!chunk)
+			return NULL;
+
+		chunk->size = TA_CHUNK_SIZE - sizeof(*chunk);
+		chunk->used = 0;
+
+		chunk->next = ta->chunks;
+		ta->chunks = chunk;
+	}
+
+	ptr = chunk->data + chunk->used;
+	chunk->used += size;
+
+	return ptr;
+}
+
+static bool ta_blob_equal(struct blob *blob, const uint8_t *data, size_t len)
+{
+	ssize_t n;
+
+	if (blob->len != len)
+		return false;
+
+	if (!blob->zlen)
+		return !memcmp(blob->data, data, len);
+
+	n = lz_decompress(blob->data, blob->zlen, scratch, scratch_len);
+
+	return n == len && !memcmp(scratch, data, len);
+}
+
+static struct blob *ta_blob_get(struct ta *ta, const uint8_t *data, size_t len)
+{
+	struct blob *blob;
+	uint32_t hash;
+	ssize_t zlen = -1;
+
+	hash = ta_hash(data, len);
+
+	for (blob = ta->blobs[hash % TA_BLOB_HASH_SIZE]; blob; blob = blob->next) {
+		if (blob->hash == hash && ta_blob_equal(blob, data, len)) {
+			blob->refs++;
+			return blob;
+		}
+	}
+
+	/* Only keep the compressed form if it actually saves something */
+	if (compress_min_len && len >= compress_min_len)
+		zlen = lz_compress(data, len, scratch, len - 1);
+
+	blob = ta_mem_alloc(ta, sizeof(struct blob) + (zlen > 0 ? zlen : len));
+	if (!blob) {
+		fprintf(stderr, "failed to allocate unit payload");
+		exit(1);
+	}
+
+	blob->hash = hash;
+	blob->refs = 1;
+	blob->len = len;
+	blob->hits = 0;
+	blob->hot = NULL;
+
+	if (zlen > 0) {
+		blob->zlen = zlen;
+		memcpy(blob->data, scratch, zlen);
+
+		ta->stats.compressed++;
+		ta->stats.compressed_bytes += len;
+		ta->stats.stored_bytes += zlen;
+	} else {
+		blob->zlen = 0;
+		memcpy(blob->data, data, len);
+
+		ta->stats.stored_bytes += len;
+	}
+
+	blob->next = ta->blobs[hash % TA_BLOB_HASH_SIZE];
+	ta->blobs[hash % TA_BLOB_HASH_SIZE] = blob;
+
+	ta->stats.blobs++;
+	ta->stats.unique_bytes += len;
+
+	return blob;
+}
+
+static void ta_add_unit(struct ta *ta, unsigned id, const uint8_t *data,
+			size_t len)
 {
-	struct phys_unit *phys_unit;
 	struct unit *unit;
 
-	for (;;) {
-		phys_unit = ptr;
+	unit = ta_mem_alloc(ta, sizeof(struct unit));
+	if (!unit) {
+		fprintf(stderr, "failed to allocate unit");
+		exit(1);
+	}
+
+	unit->id = id;
+	unit->blob = ta_blob_get(ta, data, len);
+	unit->reads = 0;
+
+	ta->stats.units++;
+	ta->stats.total_bytes += len;
+
+	unit->next = ta->units;
+	ta->units = unit;
+
+	unit->lookup_next = ta->lookup;
+	ta->lookup = unit;
+}
+
+/* Index up to budget units of the data block, returns false at its end */
+static bool ta_parse_units(struct ta *ta, unsigned budget)
+{
+	struct phys_unit *phys_unit;
+
+	while (budget--) {
+		phys_unit = ta->parse;
 		if (phys_unit->magic != TA_MAGIC)
-			break;
+			return false;
 
-		unit = malloc(sizeof(struct unit) + phys_unit->len);
-		unit->id = phys_unit->id;
-		unit->len = phys_unit->len;
-		memcpy(unit->data, phys_unit->data, phys_unit->len);
+		ta_add_unit(ta, phys_unit->id, phys_unit->data, phys_unit->len);
 
-		unit->next = units;
-		units = unit;
+		ta->parse += sizeof(struct phys_unit) + ((phys_unit->len + 3) & ~3);
+	}
 
-		ptr += sizeof(struct phys_unit) + ((phys_unit->len + 3) & ~3);
+	return true;
+}
+
+static struct ta *ta_alloc(void)
+{
+	struct ta *ta;
+
+	ta = calloc(1, sizeof(*ta));
+	if (!ta) {
+		fprintf(stderr, "failed to allocate ta");
+		exit(1);
 	}
+
+	ta->fd = -1;
+
+	if (compress_min_len && hot_cache_size) {
+		ring_init(&ta->hot, resident_alloc(hot_cache_size), hot_cache_size);
+		if (!ta->hot.data) {
+			fprintf(stderr, "failed to allocate hot cache");
+			exit(1);
+		}
+	}
+
+	/* No unit can be larger than a block, use that for decompression */
+	if (compress_min_len && !scratch) {
+		scratch_len = TA_BLOCK_SIZE;
+		scratch = resident_alloc(scratch_len);
+		if (!scratch) {
+			fprintf(stderr, "failed to allocate scratch buffer");
+			exit(1);
+		}
+	}
+
+	return ta;
 }
 
-int ta_load(const char *path)
+/*
+ * Open a partition for loading, the units are indexed by subsequent calls to
+ * ta_load_step() and can be looked up while the load is in progress.
+ */
+struct ta *ta_open(const char *path)
 {
-	struct phys_block *phys_block;
-	off_t offset;
-	void *mem;
-	int fd;
-	int n;
+	struct ta *ta;
+
+	ta = ta_alloc();
 
-	mem = malloc(TA_BLOCK_SIZE);
-	if (!mem) {
+	ta->block = malloc(TA_BLOCK_SIZE);
+	if (!ta->block) {
 		fprintf(stderr, "failed to allocate scratch buffer");
 		exit(1);
 	}
 
-	fd = open(path, O_RDONLY);
-	if (fd < 0) {
+	ta->fd = open(path, O_RDONLY);
+	if (ta->fd < 0) {
 		fprintf(stderr, "failed to open %s", path);
 		exit(1);
 	}
 
-	for (offset = 0; ; offset += TA_BLOCK_SIZE) {
-		n = pread(fd, mem, sizeof(struct phys_block), offset);
-		if (n != sizeof(struct phys_block))
-			break;
+	return ta;
+}
+
+static void ta_load_finish(struct ta *ta)
+{
+	if (ta->fd >= 0)
+		close(ta->fd);
+	free(ta->block);
+
+	ta->fd = -1;
+	ta->block = NULL;
+	ta->parse = NULL;
+	ta->loaded = true;
+}
 
-		phys_block = mem;
+/*
+ * Scan for the data block or index its units, doing at most budget blocks or
+ * units of work. Returns 1 while there is more to load and 0 once done.
+ */
+int ta_load_step(struct ta *ta, unsigned budget)
+{
+	struct phys_block *phys_block;
+	int n;
+
+	if (ta->loaded)
+		return 0;
+
+	for (; !ta->parse && budget; budget--, ta->offset += TA_BLOCK_SIZE) {
+		n = pread(ta->fd, ta->block, sizeof(struct phys_block), ta->offset);
+		if (n != sizeof(struct phys_block)) {
+			ta_load_finish(ta);
+			return 0;
+		}
+
+		phys_block = ta->block;
 		if (phys_block->magic == TA_MAGIC) {
-			n = pread(fd, mem, TA_BLOCK_SIZE, offset);
+			n = pread(ta->fd, ta->block, TA_BLOCK_SIZE, ta->offset);
 			if (n < 0) {
 				fprintf(stderr, "failed to read ta phys_block");
 				exit(1);
 			}
 
-			ta_parse_block(mem + sizeof(struct phys_block));
-
+			ta->parse = ta->block + sizeof(struct phys_block);
 			break;
 		}
 	}
 
-	close(fd);
-	free(mem);
+	if (!ta->parse || ta_parse_units(ta, budget))
+		return 1;
 
+	ta_load_finish(ta);
 	return 0;
 }
 
-void *ta_get(unsigned id, size_t *len)
+bool ta_loaded(struct ta *ta)
 {
-	struct unit *unit;
+	return ta->loaded;
+}
+
+/* Read the whole of fd into private memory, NULL if it comes up short */
+static void *ta_import_copy(int fd, size_t size)
+{
+	size_t done = 0;
+	ssize_t n;
+	void *mem;
+
+	mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED)
+		return NULL;
+
+	while (done < size) {
+		n = pread(fd, mem + done, size - done, done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			munmap(mem, size);
+			return NULL;
+		}
+
+		done += n;
+	}
+
+	return mem;
+}
+
+/*
+ * Build the unit store from a snapshot made by ta_snapshot(), e.g. one handed
+ * over by the process being upgraded. Returns NULL if the snapshot is invalid.
+ *
+ * A memfd sealed against writes and shrinking, as handed over on upgrade, is
+ * mapped directly. Anything else, e.g. an archive supplied by a client, is
+ * copied first, so that it can't be truncated or rewritten underneath the
+ * validation.
+ */
+struct ta *ta_import(int fd)
+{
+	const struct ta_snap_header *hdr;
+	const struct ta_snap_entry *index;
+	const struct ta_snap_entry *entry;
+	const uint32_t *order = NULL;
+	struct stat st;
+	struct ta *ta;
+	uint8_t *seen;
+	size_t size;
+	void *mem;
+	unsigned i;
+	int seals;
+
+	if (fstat(fd, &st) < 0 || st.st_size < sizeof(*hdr))
+		return NULL;
+
+	size = st.st_size;
+
+	seals = fcntl(fd, F_GET_SEALS);
+	if (seals >= 0 && (seals & (F_SEAL_WRITE | F_SEAL_SHRINK)) ==
+			  (F_SEAL_WRITE | F_SEAL_SHRINK)) {
+		mem = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+		if (mem == MAP_FAILED)
+			return NULL;
+	} else {
+		mem = ta_import_copy(fd, size);
+		if (!mem)
+			return NULL;
+	}
+
+	hdr = mem;
+	index = mem + sizeof(*hdr);
+	if (hdr->magic != TA_SNAP_MAGIC || hdr->version != TA_SNAP_VERSION ||
+	    hdr->size > size || hdr->size < sizeof(*hdr) ||
+	    hdr->num_units > (hdr->size - sizeof(*hdr)) / sizeof(*entry))
+		goto err_unmap;
+
+	for (i = 0; i < hdr->num_units; i++) {
+		entry = &index[i];
+		if (entry->offset > hdr->size ||
+		    entry->len > hdr->size - entry->offset ||
+		    entry->len > TA_BLOCK_SIZE ||
+		    (i && entry->id < entry[-1].id))
+			goto err_unmap;
+	}
+
+	/* The iteration order has to list every unit exactly once */
+	if (hdr->order_offset) {
+		if (hdr->order_offset > hdr->size ||
+		    hdr->num_units > (hdr->size - hdr->order_offset) / sizeof(*order) ||
+		    hdr->order_offset % sizeof(*order))
+			goto err_unmap;
+
+		order = mem + hdr->order_offset;
+
+		seen = calloc(hdr->num_units ? hdr->num_units : 1, 1);
+		if (!seen)
+			goto err_unmap;
+
+		for (i = 0; i < hdr->num_units; i++) {
+			if (order[i] >= hdr->num_units || seen[order[i]])
+				break;
+			seen[order[i]] = 1;
+		}
+
+		free(seen);
+
+		if (i < hdr->num_units)
+			goto err_unmap;
+	}
+
+	ta = ta_alloc();
+
+	/* Units are prepended, walk backwards to keep their order */
+	for (i = hdr->num_units; i-- > 0;) {
+		entry = &index[order ? order[i] : i];
+		ta_add_unit(ta, entry->id, mem + entry->offset, entry->len);
+	}
+
+	munmap(mem, size);
+
+	ta->loaded = true;
+
+	return ta;
+
+err_unmap:
+	munmap(mem, size);
+	return NULL;
+}
+
+struct ta *ta_load(const char *path)
+{
+	struct ta *ta;
+
+	ta = ta_open(path);
+	while (ta_load_step(ta, UINT_MAX))
+		;
+
+	return ta;
+}
+
+static struct hot *ta_hot_alloc(struct ta *ta, struct blob *blob)
+{
+	struct hot *hot;
+
+	/* Evict the oldest copies until the new one fits */
+	while (!(hot = ring_push(&ta->hot, sizeof(struct hot) + blob->len))) {
+		hot = ring_peek(&ta->hot);
+		if (!hot)
+			return NULL;
+
+		/* Copies that failed to decompress are already detached */
+		if (hot->blob) {
+			hot->blob->hot = NULL;
+			ta->stats.hot_bytes -= hot->blob->len;
+		}
+		ring_pop(&ta->hot);
+	}
+
+	hot->blob = blob;
+	blob->hot = hot;
+	ta->stats.hot_bytes += blob->len;
+
+	return hot;
+}
+
+static void *ta_blob_data(struct ta *ta, struct blob *blob, bool prefetch)
+{
+	struct timespec start;
+	struct hot *hot;
+	uint8_t *data;
+	ssize_t n;
+
+	if (!blob->zlen)
+		return blob->data;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	hot = blob->hot;
+	if (hot) {
+		ta->stats.hot_reads++;
+		ta->stats.hot_ns += ta_elapsed_ns(&start);
+
+		return hot->data;
+	}
+
+	/* Only units read often enough are worth a slot in the hot cache */
+	hot = NULL;
+	if ((++blob->hits >= hot_min_hits || prefetch) &&
+	    ring_fits(&ta->hot, sizeof(struct hot) + blob->len))
+		hot = ta_hot_alloc(ta, blob);
+
+	data = hot ? hot->data : scratch;
 
-	for (unit = units; unit; unit = unit->next) {
-		if (unit->id == id) {
-			*len = unit->len;
-			return unit->data;
+	n = lz_decompress(blob->data, blob->zlen, data, blob->len);
+	if (n != blob->len) {
+		fprintf(stderr, "failed to decompress unit payload\n");
+
+		/* Leave the slot to be evicted, rather than serve its garbage */
+		if (hot) {
+			ta->stats.hot_bytes -= blob->len;
+			blob->hot = NULL;
+			hot->blob = NULL;
 		}
+		return NULL;
+	}
+
+	ta->stats.cold_reads++;
+	ta->stats.cold_ns += ta_elapsed_ns(&start);
+
+	return data;
+}
+
+static struct unit *ta_find(struct ta *ta, unsigned id)
+{
+	struct unit *unit;
+
+	for (unit = ta->lookup; unit; unit = unit->lookup_next) {
+		if (unit->id == id)
+			return unit;
 	}
 
 	return NULL;
 }
 
-int ta_get_next(int id, size_t *len)
+void *ta_get(struct ta *ta, unsigned id, size_t *len)
+{
+	struct unit *unit;
+
+	unit = ta_find(ta, id);
+	if (!unit)
+		return NULL;
+
+	unit->reads++;
+
+	*len = unit->blob->len;
+	return ta_blob_data(ta, unit->blob, false);
+}
+
+/* Like ta_get(), without counting a read, e.g. to prepare a response */
+void *ta_peek(struct ta *ta, unsigned id, size_t *len)
+{
+	struct unit *unit;
+
+	unit = ta_find(ta, id);
+	if (!unit)
+		return NULL;
+
+	*len = unit->blob->len;
+	return ta_blob_data(ta, unit->blob, false);
+}
+
+/* Count a read served without the payload, e.g. from a prepared response */
+void ta_count_read(struct ta *ta, unsigned id)
+{
+	struct unit *unit;
+
+	unit = ta_find(ta, id);
+	if (unit)
+		unit->reads++;
+}
+
+/* Bring a compressed unit into the hot cache ahead of its first read */
+int ta_prefetch(struct ta *ta, unsigned id)
+{
+	struct unit *unit;
+
+	unit = ta_find(ta, id);
+	if (!unit)
+		return -1;
+
+	return ta_blob_data(ta, unit->blob, true) ? 0 : -1;
+}
+
+int ta_get_size(struct ta *ta, unsigned id, size_t *len)
+{
+	struct unit *unit;
+
+	unit = ta_find(ta, id);
+	if (!unit)
+		return -1;
+
+	*len = unit->blob->len;
+	return 0;
+}
+
+int ta_get_next(struct ta *ta, int id, size_t *len)
 {
 	struct unit *unit;
 
-	if (!units)
+	if (!ta->units)
 		return -1;
 
 	if (!id) {
-		*len = units->len;
-		return units->id;
+		*len = ta->units->blob->len;
+		return ta->units->id;
 	}
 
-	for (unit = units; unit; unit = unit->next) {
+	for (unit = ta->units; unit; unit = unit->next) {
 		if (unit->id == id)
 			break;
 	}
@@ -167,6 +759,503 @@ int ta_get_next(int id, size_t *len)
 
 	unit = unit->next;
 
-	*len = unit->len;
+	*len = unit->blob->len;
 	return unit->id;
 }
+
+void ta_get_stats(struct ta *ta, struct ta_stats *stats)
+{
+	*stats = ta->stats;
+}
+
+void ta_free(struct ta *ta)
+{
+	struct chunk *chunk;
+	struct blob *blob;
+	struct unit *unit;
+	unsigned i;
+
+	if (!ta->loaded)
+		ta_load_finish(ta);
+
+	/* The units and payloads go with their chunks, or the compacted arena */
+	if (ta->chunks || ta->arena) {
+		ta->units = NULL;
+		memset(ta->blobs, 0, sizeof(ta->blobs));
+	}
+
+	resident_free(ta->arena, ta->arena_size);
+	resident_free(ta->spare, ta->spare_size);
+	free(ta->ranks);
+
+	while (ta->chunks) {
+		chunk = ta->chunks;
+		ta->chunks = chunk->next;
+		resident_free(chunk, TA_CHUNK_SIZE);
+	}
+
+	while (ta->units) {
+		unit = ta->units;
+		ta->units = unit->next;
+		free(unit);
+	}
+
+	for (i = 0; i < TA_BLOB_HASH_SIZE; i++) {
+		while (ta->blobs[i]) {
+			blob = ta->blobs[i];
+			ta->blobs[i] = blob->next;
+			free(blob);
+		}
+	}
+
+	resident_free(ta->hot.data, ta->hot.size);
+
+	free(ta);
+}
+
+static int ta_snap_entry_cmp(const void *a, const void *b)
+{
+	const struct ta_snap_entry *ea = a;
+	const struct ta_snap_entry *eb = b;
+
+	if (ea->id != eb->id)
+		return ea->id < eb->id ? -1 : 1;
+
+	return ea->offset < eb->offset ? -1 : ea->offset > eb->offset;
+}
+
+/*
+ * Write an immutable snapshot of the unit store into a sealed memfd, returns
+ * the memfd or -1 on failure.
+ */
+int ta_snapshot(struct ta *ta, uint64_t generation)
+{
+	struct ta_snap_header *hdr;
+	struct ta_snap_entry *index;
+	struct ta_snap_entry *entry;
+	struct blob *blob;
+	struct unit *unit;
+	uint32_t *order;
+	uint64_t offset;
+	uint8_t *taken;
+	size_t order_size;
+	size_t size;
+	unsigned lo;
+	unsigned hi;
+	unsigned mid;
+	void *mem;
+	unsigned i;
+	ssize_t n;
+	int fd;
+
+	order_size = (ta->stats.units * sizeof(*order) + 7) & ~7;
+
+	size = sizeof(*hdr) + ta->stats.units * sizeof(*entry) + order_size;
+	for (i = 0; i < TA_BLOB_HASH_SIZE; i++) {
+		for (blob = ta->blobs[i]; blob; blob = blob->next) {
+			blob->snap_offset = 0;
+			size += (blob->len + 7) & ~7;
+		}
+	}
+
+	fd = memfd_create("ta-snapshot", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd < 0)
+		return -1;
+
+	if (ftruncate(fd, size) < 0)
+		goto err_close;
+
+	mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (mem == MAP_FAILED)
+		goto err_close;
+
+	hdr = mem;
+	hdr->magic = TA_SNAP_MAGIC;
+	hdr->version = TA_SNAP_VERSION;
+	hdr->generation = generation;
+	hdr->size = size;
+	hdr->num_units = ta->stats.units;
+	hdr->order_offset = sizeof(*hdr) + ta->stats.units * sizeof(*entry);
+
+	index = mem + sizeof(*hdr);
+	order = mem + hdr->order_offset;
+
+	entry = index;
+	offset = hdr->order_offset + order_size;
+
+	for (unit = ta->units; unit; unit = unit->next, entry++) {
+		blob = unit->blob;
+
+		if (!blob->snap_offset) {
+			if (!blob->zlen) {
+				memcpy(mem + offset, blob->data, blob->len);
+			} else {
+				n = lz_decompress(blob->data, blob->zlen,
+						  mem + offset, blob->len);
+				if (n != blob->len) {
+					fprintf(stderr,
+						"failed to decompress unit payload\n");
+					goto err_unmap;
+				}
+			}
+
+			blob->snap_offset = offset;
+			offset += (blob->len + 7) & ~7;
+		}
+
+		entry->id = unit->id;
+		entry->len = blob->len;
+		entry->offset = blob->snap_offset;
+	}
+
+	qsort(index, ta->stats.units, sizeof(*entry), ta_snap_entry_cmp);
+
+	taken = calloc(ta->stats.units ? ta->stats.units : 1, 1);
+	if (!taken)
+		goto err_unmap;
+
+	/*
+	 * Record where each unit, in iteration order, ended up in the index.
+	 * Partition images may repeat an id; such units are told apart by their
+	 * payload, and units that match in both are interchangeable.
+	 */
+	for (unit = ta->units, i = 0; unit; unit = unit->next, i++) {
+		lo = 0;
+		hi = ta->stats.units;
+		while (lo < hi) {
+			mid = (lo + hi) / 2;
+			if (index[mid].id < unit->id ||
+			    (index[mid].id == unit->id &&
+			     index[mid].offset < unit->blob->snap_offset))
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+
+		while (taken[lo])
+			lo++;
+
+		taken[lo] = 1;
+		order[i] = lo;
+	}
+
+	free(taken);
+
+	munmap(mem, size);
+
+	if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW |
+				   F_SEAL_WRITE | F_SEAL_SEAL) < 0)
+		goto err_close;
+
+	return fd;
+
+err_unmap:
+	munmap(mem, size);
+err_close:
+	close(fd);
+	return -1;
+}
+
+static bool ta_rank_before(const struct rank *a, const struct rank *b)
+{
+	if (a->heat != b->heat)
+		return a->heat > b->heat;
+
+	/* Keep entries of equal heat in their current order */
+	return a->ptr < b->ptr;
+}
+
+static void ta_rank_sift(struct rank *ranks, size_t root, size_t n)
+{
+	struct rank tmp;
+	size_t child;
+
+	while ((child = 2 * root + 1) < n) {
+		if (child + 1 < n && ta_rank_before(&ranks[child], &ranks[child + 1]))
+			child++;
+
+		if (!ta_rank_before(&ranks[root], &ranks[child]))
+			return;
+
+		tmp = ranks[root];
+		ranks[root] = ranks[child];
+		ranks[child] = tmp;
+		root = child;
+	}
+}
+
+/* Sort hottest first, by heapsort as qsort() may allocate */
+static void ta_rank_sort(struct rank *ranks, size_t n)
+{
+	struct rank tmp;
+	size_t i;
+
+	for (i = n / 2; i-- > 0;)
+		ta_rank_sift(ranks, i, n);
+
+	for (i = n; i-- > 1;) {
+		tmp = ranks[0];
+		ranks[0] = ranks[i];
+		ranks[i] = tmp;
+		ta_rank_sift(ranks, 0, i);
+	}
+}
+
+static bool ta_rank_in_place(const struct rank *ranks, size_t n)
+{
+	size_t i;
+
+	for (i = 1; i < n; i++) {
+		if (ranks[i - 1].ptr > ranks[i].ptr)
+			return false;
+	}
+
+	return true;
+}
+
+/* Whether the units read lead the lookup order already, hottest first */
+static bool ta_rank_leads(struct ta *ta, const struct rank *ranks, size_t n)
+{
+	struct unit *unit = ta->lookup;
+	size_t i;
+
+	for (i = 0; i < n && ranks[i].heat; i++, unit = unit->lookup_next) {
+		if (ranks[i].ptr != unit)
+			return false;
+	}
+
+	return true;
+}
+
+static size_t ta_blob_size(struct blob *blob)
+{
+	return sizeof(*blob) + (blob->zlen ? blob->zlen : blob->len);
+}
+
+/*
+ * Rebuild the unit store in one arena: the units, in the order they are looked
+ * up in, followed by the payloads, both ordered by how often they are read,
+ * hottest first. The read counts of a previous run, if given, are added to
+ * the counters first. The order of units seen by clients is unchanged.
+ *
+ * The first compaction of a store allocates the arena, a spare one of the
+ * same size and the scratch space for ranking; it is meant to run right after
+ * loading. Later rounds build in the spare and swap, without allocating. A
+ * store whose lookup order already matches the ranking is not rebuilt on the
+ * first round either, its arena is allocated once the ranking changes.
+ *
+ * Returns 1 if the store was rebuilt, 0 if it already had this layout, or -1
+ * on failure, in which case the store is left as is.
+ */
+int ta_compact(struct ta *ta, const unsigned *ids, const unsigned long *reads,
+	       unsigned count)
+{
+	struct rank *unit_ranks;
+	struct rank *blob_ranks;
+	struct unit *units;
+	struct unit *unit;
+	struct unit *head;
+	struct blob *blob;
+	struct chunk *chunk;
+	size_t arena_size;
+	size_t offset;
+	size_t size;
+	size_t span = 0;
+	bool first = !ta->arena;
+	bool read = false;
+	int rebuilt = 0;
+	void *arena;
+	unsigned i;
+	unsigned n;
+
+	if (!ta->loaded || !ta->units)
+		return 0;
+
+	if (!ta->ranks) {
+		ta->ranks = malloc((ta->stats.units + ta->stats.blobs) *
+				   sizeof(*ta->ranks));
+		if (!ta->ranks)
+			return -1;
+	}
+
+	unit_ranks = ta->ranks;
+	blob_ranks = ta->ranks + ta->stats.units;
+
+	for (i = 0; i < count; i++) {
+		unit = ta_find(ta, ids[i]);
+		if (unit && reads[i] < UINT_MAX - unit->reads)
+			unit->reads += reads[i];
+		else if (unit)
+			unit->reads = UINT_MAX;
+	}
+
+	for (unit = ta->units; unit; unit = unit->next)
+		unit->blob->heat = 0;
+
+	n = 0;
+	for (unit = ta->units; unit; unit = unit->next) {
+		unit->blob->heat += unit->reads;
+		if (unit->reads)
+			read = true;
+
+		unit_ranks[n].heat = unit->reads;
+		unit_ranks[n++].ptr = unit;
+	}
+
+	/* Nothing was read since the last compaction, keep the layout */
+	if (!read && !first)
+		return 0;
+
+	n = 0;
+	for (i = 0; i < TA_BLOB_HASH_SIZE; i++) {
+		for (blob = ta->blobs[i]; blob; blob = blob->next) {
+			blob_ranks[n].heat = blob->heat;
+			blob_ranks[n++].ptr = blob;
+		}
+	}
+
+	ta_rank_sort(unit_ranks, ta->stats.units);
+	ta_rank_sort(blob_ranks, ta->stats.blobs);
+
+	/* A compacted store only moves if the ranking changed */
+	if (!first && ta_rank_in_place(unit_ranks, ta->stats.units) &&
+	    ta_rank_in_place(blob_ranks, ta->stats.blobs))
+		goto decay;
+
+	/* Nor does a loaded one whose hot units are looked up first already */
+	if (first && ta_rank_leads(ta, unit_ranks, ta->stats.units))
+		return 0;
+
+	size = ta->stats.units * sizeof(struct unit);
+	for (i = 0; i < ta->stats.blobs; i++)
+		size += (ta_blob_size(blob_ranks[i].ptr) + 7) & ~7;
+
+	if (ta->spare && ta->spare_size >= size) {
+		arena = ta->spare;
+		arena_size = ta->spare_size;
+		ta->spare = NULL;
+	} else {
+		arena = resident_alloc(size);
+		if (!arena)
+			return -1;
+		arena_size = size;
+	}
+
+	offset = ta->stats.units * sizeof(struct unit);
+
+	memset(ta->blobs, 0, sizeof(ta->blobs));
+	for (i = 0; i < ta->stats.blobs; i++) {
+		blob = arena + offset;
+		memcpy(blob, blob_ranks[i].ptr, ta_blob_size(blob_ranks[i].ptr));
+
+		blob->next = ta->blobs[blob->hash % TA_BLOB_HASH_SIZE];
+		ta->blobs[blob->hash % TA_BLOB_HASH_SIZE] = blob;
+
+		if (blob->hot)
+			blob->hot->blob = blob;
+
+		((struct blob *)blob_ranks[i].ptr)->moved = blob;
+		offset += (ta_blob_size(blob) + 7) & ~7;
+
+		if (blob->heat)
+			span = offset - ta->stats.units * sizeof(struct unit);
+	}
+
+	/* The old lookup order isn't needed anymore, it now points at the copy */
+	units = arena;
+	for (i = 0; i < ta->stats.units; i++) {
+		unit = unit_ranks[i].ptr;
+
+		units[i] = *unit;
+		units[i].blob = unit->blob->moved;
+		units[i].lookup_next = i + 1 < ta->stats.units ? &units[i + 1] : NULL;
+
+		unit->lookup_next = &units[i];
+	}
+
+	for (unit = ta->units; unit; unit = unit->next)
+		unit->lookup_next->next = unit->next ? unit->next->lookup_next : NULL;
+
+	head = ta->units->lookup_next;
+
+	/* Release the previous storage, an arena is kept as the next spare */
+	if (ta->arena) {
+		resident_free(ta->spare, ta->spare_size);
+		ta->spare = ta->arena;
+		ta->spare_size = ta->arena_size;
+	} else if (ta->chunks) {
+		while (ta->chunks) {
+			chunk = ta->chunks;
+			ta->chunks = chunk->next;
+			resident_free(chunk, TA_CHUNK_SIZE);
+		}
+	} else {
+		while (ta->units) {
+			unit = ta->units;
+			ta->units = unit->next;
+			free(unit);
+		}
+
+		for (i = 0; i < ta->stats.blobs; i++)
+			free(blob_ranks[i].ptr);
+	}
+
+	ta->units = head;
+	ta->lookup = units;
+	ta->arena = arena;
+	ta->arena_size = arena_size;
+
+	if (!ta->spare) {
+		ta->spare = resident_alloc(arena_size);
+		ta->spare_size = ta->spare ? arena_size : 0;
+	}
+
+	ta->stats.compactions++;
+	ta->stats.hot_span = span;
+	rebuilt = 1;
+
+decay:
+	/*
+	 * Age the counters, so that the layout follows a changing access
+	 * pattern, but keep those just recorded until the next round.
+	 */
+	for (unit = ta->units; unit && !first; unit = unit->next)
+		unit->reads /= 2;
+
+	return rebuilt;
+}
+
+/*
+ * Fill in up to max ids of the units read since the last compaction, hottest
+ * first, along with their read counts. Returns the number of units filled in.
+ */
+unsigned ta_get_layout(struct ta *ta, unsigned *ids, unsigned long *reads,
+		       unsigned max)
+{
+	struct unit *unit;
+	unsigned n = 0;
+	unsigned i;
+
+	if (!max)
+		return 0;
+
+	for (unit = ta->units; unit; unit = unit->next) {
+		if (!unit->reads)
+			continue;
+
+		if (n == max && reads[max - 1] >= unit->reads)
+			continue;
+
+		/* Insertion sort, the layout is only saved at compaction time */
+		i = n < max ? n++ : max - 1;
+		for (; i > 0 && reads[i - 1] < unit->reads; i--) {
+			ids[i] = ids[i - 1];
+			reads[i] = reads[i - 1];
+		}
+
+		ids[i] = unit->id;
+		reads[i] = unit->reads;
+	}
+
+	return n;
+}
@@ -31,8 +31,58 @@
 #ifndef __TA_H__
 #define __TA_H__
 
-int ta_load(const char *path);
-void *ta_get(unsigned id, size_t *len);
-int ta_get_next(int id, size_t *len);
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct ta;
+
+struct ta_stats {
+	unsigned units;
+	unsigned blobs;
+
+	/* payload bytes as found in the partition vs. actually kept resident */
+	size_t total_bytes;
+	size_t unique_bytes;
+
+	/* compressed storage, see ta_set_compression() */
+	unsigned compressed;
+	size_t compressed_bytes;
+	size_t stored_bytes;
+	size_t hot_bytes;
+
+	unsigned long hot_reads;
+	unsigned long cold_reads;
+	unsigned long long hot_ns;
+	unsigned long long cold_ns;
+
+	/* layout rebuilds, and the payload bytes spanned by units read */
+	unsigned compactions;
+	size_t hot_span;
+};
+
+void ta_set_compression(size_t min_len, unsigned hot_hits, size_t hot_size);
+struct ta *ta_load(const char *path);
+struct ta *ta_open(const char *path);
+struct ta *ta_import(int fd);
+int ta_load_step(struct ta *ta, unsigned budget);
+bool ta_loaded(struct ta *ta);
+void ta_free(struct ta *ta);
+/*
+ * The returned payload may be a decompression buffer shared between all
+ * partitions, it is only valid until the next call to ta_get().
+ */
+void *ta_get(struct ta *ta, unsigned id, size_t *len);
+void *ta_peek(struct ta *ta, unsigned id, size_t *len);
+int ta_get_size(struct ta *ta, unsigned id, size_t *len);
+void ta_count_read(struct ta *ta, unsigned id);
+int ta_prefetch(struct ta *ta, unsigned id);
+int ta_get_next(struct ta *ta, int id, size_t *len);
+void ta_get_stats(struct ta *ta, struct ta_stats *stats);
+int ta_snapshot(struct ta *ta, uint64_t generation);
+int ta_compact(struct ta *ta, const unsigned *ids, const unsigned long *reads,
+	       unsigned count);
+unsigned ta_get_layout(struct ta *ta, unsigned *ids, unsigned long *reads,
+		       unsigned max);
 
 #endif
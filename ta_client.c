@@ -0,0 +1,743 @@
+/*
+ * Copyright (c) 2018, Bjorn Andersson <bjorn@kryo.se>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <sys/socket.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <libqrtr.h>
+
+#include "qmi_ta227.h"
+#include "qmi_ta228.h"
+#include "qmi_size.h"
+#include "ta_client.h"
+
+#define MAX_INFLIGHT		256
+#define DEFAULT_TIMEOUT_MS	5000
+#define LOOKUP_TIMEOUT_MS	1000
+#define REQ_BUF_SIZE		64
+
+#define TA_MSG(svc, id)		((svc) << 16 | (id))
+
+struct ta_server {
+	unsigned service;
+	unsigned node;
+	unsigned port;
+	bool present;
+};
+
+/* An outstanding transaction, the slot index is encoded in its txn id */
+struct ta_txn {
+	struct ta_txn *next;
+
+	unsigned txn;
+	unsigned gen;
+	unsigned msg;
+	unsigned unit;
+	uint64_t deadline;
+
+	ta_client_cb cb;
+	void *cookie;
+};
+
+union ta_resp {
+	struct ta227_open_resp open;
+	struct ta227_iterate_resp iterate;
+	struct ta228_get_size_resp get_size;
+	struct ta228_read_resp read;
+};
+
+struct ta_client {
+	int sock;
+	unsigned instance;
+
+	struct ta_server ta227;
+	struct ta_server ta228;
+
+	struct ta_txn *txns;
+	struct ta_txn *free;
+	unsigned max_inflight;
+	unsigned inflight;
+	unsigned timeout_ms;
+
+	void *rx_buf;
+	size_t rx_size;
+	union ta_resp *resp;
+};
+
+/* Responses the client decodes, its receive buffer fits the largest encoding */
+static struct qmi_elem_info *resp_eis[] = {
+	ta227_open_resp_ei,
+	ta227_iterate_resp_ei,
+	ta228_get_size_resp_ei,
+	ta228_read_resp_ei,
+};
+
+static uint64_t ta_client_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000ull + ts.tv_nsec / 1000000;
+}
+
+static struct ta_server *ta_client_server(struct ta_client *client,
+					  unsigned service)
+{
+	if (service == client->ta227.service)
+		return &client->ta227;
+	if (service == client->ta228.service)
+		return &client->ta228;
+
+	return NULL;
+}
+
+static int ta_client_lookup(struct ta_client *client)
+{
+	struct pollfd pfd = { client->sock, POLLIN };
+	struct sockaddr_qrtr sq;
+	struct ta_server *server;
+	struct qrtr_packet pkt;
+	socklen_t sl;
+	int pending = 2;
+	int ret;
+
+	ret = qrtr_new_lookup(client->sock, client->ta227.service, 1,
+			      client->instance);
+	if (ret < 0)
+		return ret;
+
+	ret = qrtr_new_lookup(client->sock, client->ta228.service, 1,
+			      client->instance);
+	if (ret < 0)
+		return ret;
+
+	while (pending) {
+		ret = poll(&pfd, 1, LOOKUP_TIMEOUT_MS);
+		if (ret <= 0)
+			break;
+
+		sl = sizeof(sq);
+		ret = recvfrom(client->sock, client->rx_buf, client->rx_size, 0,
+			       (void *)&sq, &sl);
+		if (ret < 0)
+			return -errno;
+
+		ret = qrtr_decode(&pkt, client->rx_buf, ret, &sq);
+		if (ret < 0 || pkt.type != QRTR_TYPE_NEW_SERVER)
+			continue;
+
+		/* An empty notification terminates each lookup */
+		if (!pkt.service && !pkt.node && !pkt.port) {
+			pending--;
+			continue;
+		}
+
+		server = ta_client_server(client, pkt.service);
+		if (!server || pkt.instance != client->instance)
+			continue;
+
+		server->node = pkt.node;
+		server->port = pkt.port;
+		server->present = true;
+	}
+
+	return client->ta227.present || client->ta228.present ? 0 : -ENOENT;
+}
+
+/*
+ * Connect to the TA services of the partition published as instance, keeping
+ * up to max_inflight transactions outstanding (at most 256).
+ */
+struct ta_client *ta_client_open(unsigned instance, unsigned max_inflight)
+{
+	struct ta_client *client;
+	size_t size;
+	unsigned i;
+
+	if (!max_inflight || max_inflight > MAX_INFLIGHT)
+		return NULL;
+
+	client = calloc(1, sizeof(*client));
+	if (!client)
+		return NULL;
+
+	client->instance = instance;
+	client->ta227.service = 227;
+	client->ta228.service = 228;
+	client->max_inflight = max_inflight;
+	client->timeout_ms = DEFAULT_TIMEOUT_MS;
+
+	for (i = 0; i < sizeof(resp_eis) / sizeof(resp_eis[0]); i++) {
+		size = qmi_encoded_size(resp_eis[i]);
+		if (size > client->rx_size)
+			client->rx_size = size;
+	}
+
+	client->txns = calloc(max_inflight, sizeof(*client->txns));
+	client->rx_buf = malloc(client->rx_size);
+	client->resp = malloc(sizeof(*client->resp));
+	if (!client->txns || !client->rx_buf || !client->resp)
+		goto err_free;
+
+	for (i = max_inflight; i-- > 0;) {
+		client->txns[i].next = client->free;
+		client->free = &client->txns[i];
+	}
+
+	client->sock = qrtr_open(0);
+	if (client->sock < 0)
+		goto err_free;
+
+	if (ta_client_lookup(client) < 0)
+		goto err_close;
+
+	return client;
+
+err_close:
+	close(client->sock);
+err_free:
+	free(client->resp);
+	free(client->rx_buf);
+	free(client->txns);
+	free(client);
+	return NULL;
+}
+
+void ta_client_close(struct ta_client *client)
+{
+	close(client->sock);
+	free(client->resp);
+	free(client->rx_buf);
+	free(client->txns);
+	free(client);
+}
+
+int ta_client_fd(struct ta_client *client)
+{
+	return client->sock;
+}
+
+unsigned ta_client_inflight(struct ta_client *client)
+{
+	return client->inflight;
+}
+
+void ta_client_set_timeout(struct ta_client *client, unsigned timeout_ms)
+{
+	client->timeout_ms = timeout_ms;
+}
+
+static int ta_client_submit(struct ta_client *client, struct ta_server *server,
+			    unsigned msg_id, unsigned unit, const void *req,
+			    struct qmi_elem_info *ei, ta_client_cb cb,
+			    void *cookie)
+{
+	DEFINE_QRTR_PACKET(req_buf, REQ_BUF_SIZE);
+	struct ta_txn *txn = client->free;
+	int ret;
+
+	if (!server->present)
+		return -ENODEV;
+
+	if (!txn)
+		return -EAGAIN;
+
+	/* A fresh id per use of the slot, late responses are recognized */
+	txn->gen = (txn->gen + 1) % (65535 / client->max_inflight);
+	txn->txn = 1 + (txn - client->txns) + client->max_inflight * txn->gen;
+
+	ret = qmi_encode_message(&req_buf, QMI_REQUEST, msg_id, txn->txn, req,
+				 ei);
+	if (ret < 0)
+		return -EINVAL;
+
+	ret = qrtr_sendto(client->sock, server->node, server->port,
+			  req_buf.data, req_buf.data_len);
+	if (ret < 0)
+		return -errno;
+
+	client->free = txn->next;
+	client->inflight++;
+
+	txn->next = NULL;
+	txn->msg = TA_MSG(server->service, msg_id);
+	txn->unit = unit;
+	txn->deadline = ta_client_now_ms() + client->timeout_ms;
+	txn->cb = cb;
+	txn->cookie = cookie;
+
+	return 0;
+}
+
+/* Release the transaction before the callback, which may submit another */
+static void ta_client_complete(struct ta_client *client, struct ta_txn *txn,
+			       int result, unsigned unit, const void *data,
+			       size_t len)
+{
+	ta_client_cb cb = txn->cb;
+	void *cookie = txn->cookie;
+
+	txn->msg = 0;
+	txn->next = client->free;
+	client->free = txn;
+	client->inflight--;
+
+	cb(cookie, result, unit, data, len);
+}
+
+int ta_client_read(struct ta_client *client, unsigned unit,
+		   ta_client_cb cb, void *cookie)
+{
+	struct ta228_read_req req = { .unit = unit };
+
+	return ta_client_submit(client, &client->ta228, TA228_READ, unit, &req,
+				ta228_read_req_ei, cb, cookie);
+}
+
+int ta_client_get_size(struct ta_client *client, unsigned unit,
+		       ta_client_cb cb, void *cookie)
+{
+	struct ta228_get_size_req req = { .unit = unit };
+
+	return ta_client_submit(client, &client->ta228, TA228_GET_SIZE, unit,
+				&req, ta228_get_size_req_ei, cb, cookie);
+}
+
+/* Reset the partition's iterator to its first unit */
+int ta_client_rewind(struct ta_client *client, ta_client_cb cb, void *cookie)
+{
+	struct ta227_open_req req = {};
+
+	return ta_client_submit(client, &client->ta227, TA227_OPEN, 0, &req,
+				ta227_open_req_ei, cb, cookie);
+}
+
+int ta_client_iterate(struct ta_client *client, ta_client_cb cb, void *cookie)
+{
+	struct ta227_iterate_req req = {};
+
+	return ta_client_submit(client, &client->ta227, TA227_ITERATE, 0, &req,
+				ta227_iterate_req_ei, cb, cookie);
+}
+
+static int ta_client_handle(struct ta_client *client, struct qrtr_packet *pkt)
+{
+	const struct qmi_header *hdr = pkt->data;
+	union ta_resp *resp = client->resp;
+	struct ta_server *server;
+	struct ta_txn *txn;
+	unsigned int msg_id;
+	unsigned int txn_id;
+	int ret;
+
+	if (qmi_decode_header(pkt, &msg_id) < 0 || !hdr->txn_id)
+		return 0;
+
+	/* Responses to transactions that timed out are dropped */
+	txn = &client->txns[(hdr->txn_id - 1) % client->max_inflight];
+	if (!txn->msg || txn->txn != hdr->txn_id || (txn->msg & 0xffff) != msg_id)
+		return 0;
+
+	server = ta_client_server(client, txn->msg >> 16);
+	if (pkt->node != server->node || pkt->port != server->port)
+		return 0;
+
+	switch (txn->msg) {
+	case TA_MSG(227, TA227_OPEN):
+		memset(&resp->open, 0, sizeof(resp->open));
+		ret = qmi_decode_message(&resp->open, &txn_id, pkt, QMI_RESPONSE,
+					 msg_id, ta227_open_resp_ei);
+		if (ret < 0)
+			break;
+
+		ta_client_complete(client, txn, resp->open.result, 0, NULL, 0);
+		return 1;
+	case TA_MSG(227, TA227_ITERATE):
+		memset(&resp->iterate, 0, sizeof(resp->iterate));
+		ret = qmi_decode_message(&resp->iterate, &txn_id, pkt,
+					 QMI_RESPONSE, msg_id,
+					 ta227_iterate_resp_ei);
+		if (ret < 0)
+			break;
+
+		if (!resp->iterate.result && !resp->iterate.unit_valid)
+			resp->iterate.result = 1;
+
+		ta_client_complete(client, txn, resp->iterate.result,
+				   resp->iterate.unit, NULL,
+				   resp->iterate.size);
+		return 1;
+	case TA_MSG(228, TA228_GET_SIZE):
+		memset(&resp->get_size, 0, sizeof(resp->get_size));
+		ret = qmi_decode_message(&resp->get_size, &txn_id, pkt,
+					 QMI_RESPONSE, msg_id,
+					 ta228_get_size_resp_ei);
+		if (ret < 0)
+			break;
+
+		if (!resp->get_size.result && !resp->get_size.size_valid)
+			resp->get_size.result = 1;
+
+		ta_client_complete(client, txn, resp->get_size.result,
+				   txn->unit, NULL, resp->get_size.size);
+		return 1;
+	case TA_MSG(228, TA228_READ):
+		/* Only the header, the data is bounded by data_len */
+		resp->read.result = 0;
+		resp->read.data_len = 0;
+		ret = qmi_decode_message(&resp->read, &txn_id, pkt,
+					 QMI_RESPONSE, msg_id,
+					 ta228_read_resp_ei);
+		if (ret < 0)
+			break;
+
+		ta_client_complete(client, txn, resp->read.result, txn->unit,
+				   resp->read.data, resp->read.data_len);
+		return 1;
+	}
+
+	ta_client_complete(client, txn, -EPROTO, txn->unit, NULL, 0);
+	return 1;
+}
+
+/* Fail the transactions of a service that went away */
+static int ta_client_server_lost(struct ta_client *client,
+				 struct ta_server *server)
+{
+	struct ta_txn *txn;
+	int completed = 0;
+	unsigned i;
+
+	server->present = false;
+
+	for (i = 0; i < client->max_inflight; i++) {
+		txn = &client->txns[i];
+		if (txn->msg && txn->msg >> 16 == server->service) {
+			ta_client_complete(client, txn, -ECONNRESET, txn->unit,
+					   NULL, 0);
+			completed++;
+		}
+	}
+
+	return completed;
+}
+
+static int ta_client_expire(struct ta_client *client)
+{
+	uint64_t now = ta_client_now_ms();
+	struct ta_txn *txn;
+	int completed = 0;
+	unsigned i;
+
+	for (i = 0; i < client->max_inflight; i++) {
+		txn = &client->txns[i];
+		if (txn->msg && now >= txn->deadline) {
+			ta_client_complete(client, txn, -ETIMEDOUT, txn->unit,
+					   NULL, 0);
+			completed++;
+		}
+	}
+
+	return completed;
+}
+
+/* Milliseconds until the next transaction times out, -1 if none is pending */
+static int ta_client_next_timeout(struct ta_client *client)
+{
+	uint64_t now = ta_client_now_ms();
+	uint64_t deadline = UINT64_MAX;
+	unsigned i;
+
+	if (!client->inflight)
+		return -1;
+
+	for (i = 0; i < client->max_inflight; i++) {
+		if (client->txns[i].msg && client->txns[i].deadline < deadline)
+			deadline = client->txns[i].deadline;
+	}
+
+	return deadline > now ? deadline - now : 0;
+}
+
+int ta_client_process(struct ta_client *client)
+{
+	struct sockaddr_qrtr sq;
+	struct ta_server *server;
+	struct qrtr_packet pkt;
+	int completed = 0;
+	int error = 0;
+	socklen_t sl;
+	int ret;
+
+	for (;;) {
+		sl = sizeof(sq);
+		ret = recvfrom(client->sock, client->rx_buf, client->rx_size,
+			       MSG_DONTWAIT, (void *)&sq, &sl);
+		if (ret < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				error = -errno;
+			break;
+		}
+
+		ret = qrtr_decode(&pkt, client->rx_buf, ret, &sq);
+		if (ret < 0)
+			continue;
+
+		switch (pkt.type) {
+		case QRTR_TYPE_DATA:
+			completed += ta_client_handle(client, &pkt);
+			break;
+		case QRTR_TYPE_NEW_SERVER:
+			server = ta_client_server(client, pkt.service);
+			if (!server || pkt.instance != client->instance)
+				break;
+
+			server->node = pkt.node;
+			server->port = pkt.port;
+			server->present = true;
+			break;
+		case QRTR_TYPE_DEL_SERVER:
+			server = ta_client_server(client, pkt.service);
+			if (!server || pkt.instance != client->instance)
+				break;
+
+			completed += ta_client_server_lost(client, server);
+			break;
+		}
+	}
+
+	/* Expired even on errors, so that every transaction completes */
+	completed += ta_client_expire(client);
+
+	return completed ? completed : error;
+}
+
+int ta_client_wait(struct ta_client *client, int timeout_ms)
+{
+	struct pollfd pfd = { client->sock, POLLIN };
+	int next;
+	int ret;
+
+	ret = ta_client_process(client);
+	if (ret)
+		return ret;
+
+	next = ta_client_next_timeout(client);
+	if (next >= 0 && (timeout_ms < 0 || next < timeout_ms))
+		timeout_ms = next;
+
+	ret = poll(&pfd, 1, timeout_ms);
+	if (ret < 0)
+		return errno == EINTR ? 0 : -errno;
+
+	return ta_client_process(client);
+}
+
+struct ta_sync {
+	bool done;
+	int result;
+
+	void *buf;
+	size_t len;
+};
+
+static void ta_sync_done(void *cookie, int result, unsigned unit,
+			 const void *data, size_t len)
+{
+	struct ta_sync *sync = cookie;
+
+	if (!result && sync->buf) {
+		if (len > sync->len)
+			result = -ENOSPC;
+		else
+			memcpy(sync->buf, data, len);
+	}
+
+	sync->done = true;
+	sync->result = result;
+	sync->len = len;
+}
+
+/*
+ * Every transaction completes, at the latest when it times out, so errors of
+ * the socket are not fatal to the wait.
+ */
+static int ta_sync_wait(struct ta_client *client, struct ta_sync *sync)
+{
+	while (!sync->done)
+		ta_client_wait(client, -1);
+
+	return sync->result;
+}
+
+int ta_client_read_sync(struct ta_client *client, unsigned unit,
+			void *buf, size_t *len)
+{
+	struct ta_sync sync = { .buf = buf, .len = *len };
+	int ret;
+
+	while ((ret = ta_client_read(client, unit, ta_sync_done, &sync)) == -EAGAIN)
+		ta_client_wait(client, -1);
+	if (ret < 0)
+		return ret;
+
+	ret = ta_sync_wait(client, &sync);
+	*len = sync.len;
+
+	return ret;
+}
+
+int ta_client_get_size_sync(struct ta_client *client, unsigned unit,
+			    size_t *size)
+{
+	struct ta_sync sync = {};
+	int ret;
+
+	while ((ret = ta_client_get_size(client, unit, ta_sync_done, &sync)) == -EAGAIN)
+		ta_client_wait(client, -1);
+	if (ret < 0)
+		return ret;
+
+	ret = ta_sync_wait(client, &sync);
+	*size = sync.len;
+
+	return ret;
+}
+
+struct ta_read_all {
+	struct ta_client *client;
+	ta_client_cb cb;
+	void *cookie;
+
+	unsigned iterating;
+	unsigned reading;
+	bool end;
+
+	int count;
+	int error;
+};
+
+static void ta_read_all_unit(void *cookie, int result, unsigned unit,
+			     const void *data, size_t len)
+{
+	struct ta_read_all *all = cookie;
+
+	all->reading--;
+
+	if (!result)
+		all->count++;
+	else if (result < 0 && !all->error)
+		all->error = result;
+
+	all->cb(all->cookie, result, unit, data, len);
+}
+
+/* The slot of the iteration step was just released, so the read fits */
+static void ta_read_all_next(void *cookie, int result, unsigned unit,
+			     const void *data, size_t len)
+{
+	struct ta_read_all *all = cookie;
+	int ret;
+
+	all->iterating--;
+
+	if (result) {
+		if (result < 0 && !all->error)
+			all->error = result;
+		all->end = true;
+		return;
+	}
+
+	ret = ta_client_read(all->client, unit, ta_read_all_unit, all);
+	if (ret < 0) {
+		if (!all->error)
+			all->error = ret;
+		all->end = true;
+		return;
+	}
+
+	all->reading++;
+}
+
+int ta_client_read_all(struct ta_client *client, ta_client_cb cb,
+		       void *cookie)
+{
+	struct ta_read_all all = { client, cb, cookie };
+	struct ta_sync sync = {};
+	unsigned window;
+	int ret;
+
+	while ((ret = ta_client_rewind(client, ta_sync_done, &sync)) == -EAGAIN)
+		ta_client_wait(client, -1);
+	if (ret < 0)
+		return ret;
+
+	ret = ta_sync_wait(client, &sync);
+	if (ret)
+		return ret < 0 ? ret : -EIO;
+
+	/*
+	 * The service advances its iterator per request, in the order they
+	 * arrive, so the iteration steps are pipelined as well. Half of the
+	 * window is left for the reads of the units they return.
+	 */
+	window = client->max_inflight / 2 ? client->max_inflight / 2 : 1;
+
+	for (;;) {
+		while (!all.end && all.iterating < window) {
+			ret = ta_client_iterate(client, ta_read_all_next, &all);
+			if (ret == -EAGAIN)
+				break;
+
+			if (ret < 0) {
+				if (!all.error)
+					all.error = ret;
+				all.end = true;
+				break;
+			}
+
+			all.iterating++;
+		}
+
+		if (all.end && !all.iterating && !all.reading)
+			break;
+
+		ta_client_wait(client, -1);
+	}
+
+	return all.error ? all.error : all.count;
+}
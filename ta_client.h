@@ -0,0 +1,98 @@
+/*
+ * Copyright (c) 2018, Bjorn Andersson <bjorn@kryo.se>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef __TA_CLIENT_H__
+#define __TA_CLIENT_H__
+
+#include <stddef.h>
+
+/*
+ * Client of the TA services of one partition. Requests are pipelined, up to
+ * max_inflight transactions are outstanding at a time and their responses are
+ * matched by transaction id, in whatever order they arrive.
+ *
+ * Completions report the QMI result of the response, 0 on success, or a
+ * negative errno: -ETIMEDOUT if no response arrived in time and -ECONNRESET
+ * if the service went away. Callbacks are invoked from ta_client_process()
+ * and ta_client_wait(), and may submit further requests.
+ */
+struct ta_client;
+
+typedef void (*ta_client_cb)(void *cookie, int result, unsigned unit,
+			     const void *data, size_t len);
+
+struct ta_client *ta_client_open(unsigned instance, unsigned max_inflight);
+void ta_client_close(struct ta_client *client);
+
+int ta_client_fd(struct ta_client *client);
+unsigned ta_client_inflight(struct ta_client *client);
+void ta_client_set_timeout(struct ta_client *client, unsigned timeout_ms);
+
+/*
+ * Submit a request, returns 0 once it is sent or -EAGAIN if max_inflight
+ * transactions are already outstanding. A read completes with the unit's
+ * payload, a size query and an iteration step with the size in len, the
+ * latter with the next unit in unit and a failure result at the end.
+ */
+int ta_client_read(struct ta_client *client, unsigned unit,
+		   ta_client_cb cb, void *cookie);
+int ta_client_get_size(struct ta_client *client, unsigned unit,
+		       ta_client_cb cb, void *cookie);
+int ta_client_rewind(struct ta_client *client, ta_client_cb cb, void *cookie);
+int ta_client_iterate(struct ta_client *client, ta_client_cb cb, void *cookie);
+
+/*
+ * Handle the responses received so far, or wait up to timeout_ms (-1 for
+ * no limit) for at least one. Both return the number of transactions
+ * completed, or a negative errno.
+ */
+int ta_client_process(struct ta_client *client);
+int ta_client_wait(struct ta_client *client, int timeout_ms);
+
+/*
+ * Blocking calls, responses to other outstanding transactions are handled
+ * while waiting. A read of a unit larger than *len fails with -ENOSPC, with
+ * *len updated to the unit's size.
+ */
+int ta_client_read_sync(struct ta_client *client, unsigned unit,
+			void *buf, size_t *len);
+int ta_client_get_size_sync(struct ta_client *client, unsigned unit,
+			    size_t *size);
+
+/*
+ * Read all units of the partition, calling cb for each. The enumeration is
+ * pipelined with the reads, returns the number of units read or a negative
+ * errno. The service keeps one iterator per partition, so concurrent
+ * iterations by other clients interfere.
+ */
+int ta_client_read_all(struct ta_client *client, ta_client_cb cb,
+		       void *cookie);
+
+#endif
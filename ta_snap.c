@@ -0,0 +1,375 @@
+/*
+ * Copyright (c) 2018, Bjorn Andersson <bjorn@kryo.se>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ctl.h"
+#include "snapshot.h"
+#include "ta_snap.h"
+
+struct ta_snap {
+	char *path;
+	unsigned instance;
+
+	const struct ta_snap_header *hdr;
+	const struct ta_snap_entry *index;
+	size_t size;
+
+	const struct ta_snap_gen *gen;
+};
+
+static int ta_snap_map(struct ta_snap *snap)
+{
+	struct ta_ctl_req req = { TA_CTL_SNAPSHOT, snap->instance };
+	const struct ta_snap_header *hdr;
+	const struct ta_snap_gen *gen;
+	struct ta_ctl_resp resp;
+	unsigned num_fds = 0;
+	struct stat st;
+	int fds[2];
+	void *mem;
+	int sock;
+	int ret;
+
+	sock = ctl_connect(snap->path);
+	if (sock < 0)
+		return -1;
+
+	ret = ctl_send(sock, &req, sizeof(req), NULL, 0);
+	if (ret == sizeof(req)) {
+		num_fds = 2;
+		ret = ctl_recv(sock, &resp, sizeof(resp), fds, &num_fds);
+	}
+	close(sock);
+
+	if (ret != sizeof(resp) || resp.status || num_fds != 2) {
+		while (num_fds--)
+			close(fds[num_fds]);
+		return -1;
+	}
+
+	if (fstat(fds[0], &st) < 0 || st.st_size < sizeof(*hdr))
+		goto err_close;
+
+	mem = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fds[0], 0);
+	if (mem == MAP_FAILED)
+		goto err_close;
+
+	hdr = mem;
+	if (hdr->magic != TA_SNAP_MAGIC || hdr->version != TA_SNAP_VERSION ||
+	    hdr->size != st.st_size ||
+	    sizeof(*hdr) + hdr->num_units * sizeof(*snap->index) > st.st_size)
+		goto err_unmap;
+
+	gen = mmap(NULL, sizeof(*gen), PROT_READ, MAP_SHARED, fds[1], 0);
+	if (gen == MAP_FAILED)
+		goto err_unmap;
+
+	snap->gen = gen;
+	snap->hdr = hdr;
+	snap->index = mem + sizeof(*hdr);
+	snap->size = st.st_size;
+
+	close(fds[0]);
+	close(fds[1]);
+
+	return 0;
+
+err_unmap:
+	munmap(mem, st.st_size);
+err_close:
+	close(fds[0]);
+	close(fds[1]);
+	return -1;
+}
+
+static void ta_snap_unmap(struct ta_snap *snap)
+{
+	munmap((void *)snap->hdr, snap->size);
+	munmap((void *)snap->gen, sizeof(*snap->gen));
+}
+
+struct ta_snap *ta_snap_open(const char *path, unsigned instance)
+{
+	struct ta_snap *snap;
+
+	snap = calloc(1, sizeof(*snap));
+	if (!snap)
+		return NULL;
+
+	snap->path = strdup(path);
+	snap->instance = instance;
+
+	if (!snap->path || ta_snap_map(snap) < 0) {
+		free(snap->path);
+		free(snap);
+		return NULL;
+	}
+
+	return snap;
+}
+
+void ta_snap_close(struct ta_snap *snap)
+{
+	ta_snap_unmap(snap);
+	free(snap->path);
+	free(snap);
+}
+
+const void *ta_snap_get(struct ta_snap *snap, unsigned id, size_t *len)
+{
+	const struct ta_snap_entry *entry;
+	unsigned lo = 0;
+	unsigned hi = snap->hdr->num_units;
+	unsigned mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		entry = &snap->index[mid];
+
+		if (entry->id == id) {
+			if (entry->offset + entry->len > snap->size)
+				return NULL;
+
+			*len = entry->len;
+			return (const void *)snap->hdr + entry->offset;
+		} else if (entry->id < id) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return NULL;
+}
+
+uint64_t ta_snap_generation(struct ta_snap *snap)
+{
+	return snap->hdr->generation;
+}
+
+int ta_snap_refresh(struct ta_snap *snap)
+{
+	struct ta_snap old = *snap;
+	uint64_t generation;
+
+	generation = atomic_load_explicit((_Atomic uint64_t *)&snap->gen->generation,
+					  memory_order_acquire);
+	if (generation == snap->hdr->generation)
+		return 0;
+
+	if (ta_snap_map(snap) < 0)
+		return -1;
+
+	ta_snap_unmap(&old);
+
+	return 1;
+}
+
+static int ta_snap_transfer(const char *path, unsigned cmd, unsigned instance,
+			    int fd)
+{
+	struct ta_ctl_req req = { cmd, instance };
+	struct ta_ctl_resp resp;
+	int sock;
+	int ret;
+
+	sock = ctl_connect(path);
+	if (sock < 0)
+		return -errno;
+
+	ret = ctl_send(sock, &req, sizeof(req), &fd, 1);
+	if (ret == sizeof(req))
+		ret = ctl_recv(sock, &resp, sizeof(resp), NULL, NULL);
+	close(sock);
+
+	if (ret != sizeof(resp))
+		return -EIO;
+
+	return resp.status;
+}
+
+int ta_snap_export(const char *path, unsigned instance, int fd)
+{
+	return ta_snap_transfer(path, TA_CTL_EXPORT, instance, fd);
+}
+
+int ta_snap_import(const char *path, unsigned instance, int fd)
+{
+	return ta_snap_transfer(path, TA_CTL_IMPORT, instance, fd);
+}
+
+/* Copy the whole of a memfd received from the service to fd */
+static int ta_snap_copy(int in_fd, int fd)
+{
+	char buf[4096];
+	off_t offset = 0;
+	ssize_t len;
+	ssize_t n;
+	char *p;
+
+	while ((len = pread(in_fd, buf, sizeof(buf), offset)) > 0) {
+		offset += len;
+
+		for (p = buf; len; p += n, len -= n) {
+			n = write(fd, p, len);
+			if (n < 0 && errno == EINTR)
+				n = 0;
+			else if (n < 0)
+				return -errno;
+		}
+	}
+
+	return len < 0 ? -errno : 0;
+}
+
+int ta_snap_trace(const char *path, int fd)
+{
+	struct ta_ctl_req req = { TA_CTL_TRACE };
+	struct ta_ctl_resp resp;
+	unsigned num_fds = 1;
+	int trace_fd = -1;
+	int sock;
+	int ret;
+
+	sock = ctl_connect(path);
+	if (sock < 0)
+		return -errno;
+
+	ret = ctl_send(sock, &req, sizeof(req), NULL, 0);
+	if (ret == sizeof(req))
+		ret = ctl_recv(sock, &resp, sizeof(resp), &trace_fd, &num_fds);
+	close(sock);
+
+	if (ret != sizeof(resp))
+		return -EIO;
+
+	if (resp.status)
+		return resp.status;
+
+	if (!num_fds)
+		return -EIO;
+
+	ret = ta_snap_copy(trace_fd, fd);
+	close(trace_fd);
+
+	return ret;
+}
+
+int ta_snap_stats(const char *path, struct ta_snap_stats *stats)
+{
+	struct ta_ctl_req req = { TA_CTL_STATS };
+	struct ta_ctl_stats resp;
+	int sock;
+	int ret;
+
+	sock = ctl_connect(path);
+	if (sock < 0)
+		return -errno;
+
+	ret = ctl_send(sock, &req, sizeof(req), NULL, 0);
+	if (ret == sizeof(req))
+		ret = ctl_recv(sock, &resp, sizeof(resp), NULL, NULL);
+	close(sock);
+
+	if (ret != sizeof(resp))
+		return -EIO;
+
+	if (resp.status)
+		return resp.status;
+
+	stats->requests = resp.requests;
+	stats->allocs = resp.allocs;
+	stats->frees = resp.frees;
+	stats->limit_hits = resp.limit_hits;
+
+	return 0;
+}
+
+int ta_snap_perf(const char *path, struct ta_snap_perf *perf, unsigned max)
+{
+	struct ta_ctl_req req = { TA_CTL_PERF };
+	struct ta_ctl_perf *resp;
+	unsigned stage;
+	unsigned i;
+	unsigned j;
+	int sock;
+	int ret;
+
+	resp = malloc(sizeof(*resp));
+	if (!resp)
+		return -ENOMEM;
+
+	sock = ctl_connect(path);
+	if (sock < 0) {
+		ret = -errno;
+		goto out;
+	}
+
+	ret = ctl_send(sock, &req, sizeof(req), NULL, 0);
+	if (ret == sizeof(req))
+		ret = ctl_recv(sock, resp, sizeof(*resp), NULL, NULL);
+	close(sock);
+
+	if (ret != sizeof(*resp)) {
+		ret = -EIO;
+		goto out;
+	}
+
+	if (resp->status) {
+		ret = resp->status;
+		goto out;
+	}
+
+	for (i = 0; i < resp->num_entries && i < TA_CTL_PERF_ENTRIES && i < max; i++) {
+		perf[i].service = resp->entries[i].service;
+		perf[i].msg_id = resp->entries[i].msg_id;
+		perf[i].samples = resp->entries[i].samples;
+		perf[i].parked = resp->entries[i].parked;
+		perf[i].park_ns = resp->entries[i].park_ns;
+
+		for (stage = 0; stage < TA_SNAP_PERF_STAGES; stage++) {
+			for (j = 0; j < TA_SNAP_PERF_COUNTERS; j++)
+				perf[i].counters[stage][j] =
+					resp->entries[i].counters[stage][j];
+		}
+	}
+	ret = i;
+
+out:
+	free(resp);
+	return ret;
+}
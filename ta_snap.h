@@ -0,0 +1,106 @@
+/*
+ * Copyright (c) 2018, Bjorn Andersson <bjorn@kryo.se>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef __TA_SNAP_H__
+#define __TA_SNAP_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Client side of the ta-service unit store snapshots: units are looked up
+ * directly in a read-only mapping of the service's sealed snapshot, without
+ * any locking or round trips.
+ */
+struct ta_snap;
+
+struct ta_snap *ta_snap_open(const char *path, unsigned instance);
+void ta_snap_close(struct ta_snap *snap);
+
+const void *ta_snap_get(struct ta_snap *snap, unsigned id, size_t *len);
+uint64_t ta_snap_generation(struct ta_snap *snap);
+
+/*
+ * Remaps the snapshot if the service has published a new one, returns 1 if
+ * it did, 0 if the mapping is current and -1 on error. Pointers returned by
+ * ta_snap_get() are invalidated when the snapshot is remapped.
+ */
+int ta_snap_refresh(struct ta_snap *snap);
+
+/*
+ * Write an archive of all units of a partition to fd, which may be a file,
+ * pipe or socket, or replace the partition's units with the archive in the
+ * file fd. Both return 0 on success or a negative errno.
+ */
+int ta_snap_export(const char *path, unsigned instance, int fd);
+int ta_snap_import(const char *path, unsigned instance, int fd);
+
+/*
+ * Write the most recent requests held in the in-memory trace ring of a
+ * service run with tracing but no trace file to fd, in the format of a trace
+ * file. Returns 0 on success or a negative errno.
+ */
+int ta_snap_trace(const char *path, int fd);
+
+/*
+ * Counters of the service, requests served, heap allocations and frees, and
+ * requests or responses turned away by its preallocated limits.
+ */
+struct ta_snap_stats {
+	uint64_t requests;
+	uint64_t allocs;
+	uint64_t frees;
+	uint64_t limit_hits;
+};
+
+int ta_snap_stats(const char *path, struct ta_snap_stats *stats);
+
+#define TA_SNAP_PERF_STAGES	5
+#define TA_SNAP_PERF_COUNTERS	4
+
+/*
+ * Hardware counters of a service run with -C, summed over the requests of one
+ * message. Stages are decode, lookup, copy, encode and send, counters cycles,
+ * instructions, cache misses and branch misses. Requests that had to wait
+ * for their unit to load are counted as parked, with the total wait.
+ * ta_snap_perf() returns the number of entries filled in, or a negative errno.
+ */
+struct ta_snap_perf {
+	unsigned service;
+	unsigned msg_id;
+	uint64_t samples;
+	uint64_t parked;
+	uint64_t park_ns;
+	uint64_t counters[TA_SNAP_PERF_STAGES][TA_SNAP_PERF_COUNTERS];
+};
+
+int ta_snap_perf(const char *path, struct ta_snap_perf *perf, unsigned max);
+
+#endif
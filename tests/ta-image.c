@@ -0,0 +1,93 @@
+/*
+ * Copyright (c) 2018, Bjorn Andersson <bjorn@kryo.se>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ta-image.h"
+
+unsigned failures;
+
+#define TA_MAGIC	0x3bf8e9c1
+#define TA_BLOCK_SIZE	0x20000
+
+/*
+ * Writes a single block TA image holding the given units in order, to a new
+ * file created from the mkstemp() template path. Returns 0 on success.
+ */
+int test_write_image(char *path, const struct test_unit *units,
+		     unsigned count)
+{
+	uint32_t hdr[4] = { TA_MAGIC };
+	uint8_t *block;
+	size_t offset;
+	unsigned i;
+	ssize_t n;
+	int fd;
+
+	block = calloc(1, TA_BLOCK_SIZE);
+	if (!block)
+		return -1;
+
+	memcpy(block, hdr, 3 * sizeof(uint32_t));
+	offset = 3 * sizeof(uint32_t);
+
+	for (i = 0; i < count; i++) {
+		hdr[0] = units[i].id;
+		hdr[1] = units[i].len;
+		hdr[2] = TA_MAGIC;
+		hdr[3] = 0;
+
+		if (offset + sizeof(hdr) + units[i].len + 3 + sizeof(hdr) >
+		    TA_BLOCK_SIZE) {
+			free(block);
+			return -1;
+		}
+
+		memcpy(block + offset, hdr, sizeof(hdr));
+		memcpy(block + offset + sizeof(hdr), units[i].data,
+		       units[i].len);
+		offset += sizeof(hdr) + ((units[i].len + 3) & ~3);
+	}
+
+	fd = mkstemp(path);
+	if (fd < 0) {
+		free(block);
+		return -1;
+	}
+
+	n = write(fd, block, TA_BLOCK_SIZE);
+	close(fd);
+	free(block);
+
+	return n == TA_BLOCK_SIZE ? 0 : -1;
+}
@@ -0,0 +1,359 @@
+/*
+ * Copyright (c) 2018, Bjorn Andersson <bjorn@kryo.se>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#define _GNU_SOURCE
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "snapshot.h"
+#include "ta.h"
+#include "ta-image.h"
+
+#define NUM_UNITS	16
+
+static struct test_unit units[NUM_UNITS];
+static uint8_t payloads[NUM_UNITS][256];
+
+/* a valid archive, and the copy each case corrupts */
+static uint8_t *image;
+static uint8_t *buf;
+static size_t image_size;
+
+#define HDR		((struct ta_snap_header *)buf)
+#define INDEX		((struct ta_snap_entry *)(buf + sizeof(struct ta_snap_header)))
+#define ORDER		((uint32_t *)(buf + HDR->order_offset))
+
+static int make_image(void)
+{
+	char path[] = "/tmp/test-import-XXXXXX";
+	struct stat st;
+	struct ta *ta;
+	unsigned i;
+	int fd;
+
+	for (i = 0; i < NUM_UNITS; i++) {
+		units[i].id = 100 + (i * 7) % NUM_UNITS;
+		units[i].len = 1 + i * 13;
+		units[i].data = payloads[i];
+		memset(payloads[i], i, units[i].len);
+	}
+
+	if (test_write_image(path, units, NUM_UNITS) < 0)
+		return -1;
+
+	ta = ta_load(path);
+	unlink(path);
+	if (!ta)
+		return -1;
+
+	fd = ta_snapshot(ta, 1);
+	ta_free(ta);
+	if (fd < 0 || fstat(fd, &st) < 0)
+		return -1;
+
+	image_size = st.st_size;
+	image = malloc(image_size);
+	buf = malloc(image_size);
+	if (!image || !buf ||
+	    pread(fd, image, image_size, 0) != (ssize_t)image_size)
+		return -1;
+
+	close(fd);
+
+	return 0;
+}
+
+/*
+ * Import len bytes of buf, from a sealed memfd that is validated in place or
+ * from an unsealed one that is copied first, and return whether it worked.
+ */
+static bool import(size_t len, bool sealed)
+{
+	struct ta *ta;
+	int fd;
+
+	fd = memfd_create("test-import", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd < 0 || write(fd, buf, len) != (ssize_t)len) {
+		check(0, "failed to create memfd");
+		return false;
+	}
+
+	if (sealed)
+		fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE);
+
+	ta = ta_import(fd);
+	close(fd);
+	if (!ta)
+		return false;
+
+	ta_free(ta);
+
+	return true;
+}
+
+static void reset(void)
+{
+	memcpy(buf, image, image_size);
+}
+
+#define check_rejected(what) do {					\
+	check(!import(image_size, false), "accepted %s", what);		\
+	check(!import(image_size, true), "accepted sealed %s", what);	\
+} while (0)
+
+static void test_valid(void)
+{
+	char path[] = "/tmp/test-import-XXXXXX";
+	struct ta *ta;
+	size_t len;
+	int id = 0;
+	int fd;
+	int n;
+
+	reset();
+	check(import(image_size, false), "rejected valid archive");
+	check(import(image_size, true), "rejected valid sealed archive");
+
+	/* A regular file, as ta-archive passes it */
+	fd = mkstemp(path);
+	if (fd < 0 || write(fd, buf, image_size) != (ssize_t)image_size) {
+		check(0, "failed to write archive");
+		return;
+	}
+
+	ta = ta_import(fd);
+	close(fd);
+	unlink(path);
+
+	check(ta, "rejected valid archive file");
+	if (!ta)
+		return;
+
+	for (n = 0; (id = ta_get_next(ta, id, &len)) > 0; n++)
+		;
+	check(n == NUM_UNITS, "imported %d units", n);
+
+	ta_free(ta);
+}
+
+static void test_truncated(void)
+{
+	size_t lens[] = {
+		0, 1, sizeof(struct ta_snap_header) - 1,
+		sizeof(struct ta_snap_header), image_size / 2, image_size - 1,
+	};
+	unsigned i;
+
+	reset();
+	for (i = 0; i < sizeof(lens) / sizeof(lens[0]); i++) {
+		check(!import(lens[i], false), "accepted %zu of %zu bytes",
+		      lens[i], image_size);
+		check(!import(lens[i], true), "accepted sealed %zu of %zu bytes",
+		      lens[i], image_size);
+	}
+}
+
+static void test_header(void)
+{
+	reset();
+	HDR->magic ^= 1;
+	check_rejected("bad magic");
+
+	reset();
+	HDR->version++;
+	check_rejected("bad version");
+
+	reset();
+	HDR->size = image_size + 1;
+	check_rejected("size beyond the file");
+
+	reset();
+	HDR->num_units = (image_size - sizeof(*HDR)) / sizeof(*INDEX) + 1;
+	check_rejected("index beyond the file");
+
+	/* A header claiming less than itself doesn't make room for an index */
+	reset();
+	HDR->size = 0;
+	HDR->num_units = 1;
+	HDR->order_offset = 0;
+	check(!import(sizeof(*HDR), false), "accepted index past a bare header");
+	check(!import(sizeof(*HDR), true),
+	      "accepted sealed index past a bare header");
+}
+
+static void test_index(void)
+{
+	reset();
+	INDEX[3].offset = HDR->size + 1;
+	check_rejected("offset beyond the file");
+
+	reset();
+	INDEX[3].offset = HDR->size - 1;
+	INDEX[3].len = 2;
+	check_rejected("payload running past the file");
+
+	reset();
+	INDEX[3].offset = UINT64_MAX - 1;
+	check_rejected("overflowing offset");
+
+	reset();
+	INDEX[3].len = UINT32_MAX;
+	check_rejected("oversized payload");
+
+	/* Partition images may repeat ids, ta_load() accepts them */
+	reset();
+	INDEX[3].id = INDEX[2].id;
+	check(import(image_size, false), "rejected duplicate id");
+	check(import(image_size, true), "rejected sealed duplicate id");
+
+	reset();
+	INDEX[3].id = INDEX[4].id + 1;
+	check_rejected("unsorted index");
+}
+
+static void test_order(void)
+{
+	reset();
+	check(HDR->order_offset, "no order table");
+	if (!HDR->order_offset)
+		return;
+
+	ORDER[1] = ORDER[0];
+	check_rejected("unit listed twice in the order");
+
+	reset();
+	ORDER[1] = NUM_UNITS;
+	check_rejected("order past the index");
+
+	reset();
+	HDR->order_offset += 2;
+	check_rejected("misaligned order table");
+
+	reset();
+	HDR->order_offset = HDR->size - sizeof(uint32_t);
+	check_rejected("order table past the file");
+
+	/* Archives without a table are iterated in index order */
+	reset();
+	HDR->order_offset = 0;
+	check(import(image_size, false), "rejected archive without order");
+}
+
+/* A store with repeated ids is handed over unit for unit */
+static void test_duplicates(void)
+{
+	char path[] = "/tmp/test-import-XXXXXX";
+	struct test_unit dups[4];
+	struct ta_stats stats;
+	struct ta *imported;
+	struct ta *ta;
+	void *first;
+	void *again;
+	size_t size;
+	int fd;
+
+	/* the last repeats the first, payload included */
+	dups[0] = (struct test_unit){ .id = 7, .data = payloads[1], .len = 4 };
+	dups[1] = (struct test_unit){ .id = 3, .data = payloads[2], .len = 14 };
+	dups[2] = (struct test_unit){ .id = 7, .data = payloads[3], .len = 27 };
+	dups[3] = dups[0];
+
+	if (test_write_image(path, dups, 4) < 0) {
+		check(0, "failed to write image with duplicate ids");
+		return;
+	}
+
+	ta = ta_load(path);
+	unlink(path);
+	check(ta, "failed to load image with duplicate ids");
+	if (!ta)
+		return;
+
+	fd = ta_snapshot(ta, 1);
+	ta_free(ta);
+	check(fd >= 0, "failed to snapshot duplicate ids");
+	if (fd < 0)
+		return;
+
+	imported = ta_import(fd);
+	size = lseek(fd, 0, SEEK_END);
+	first = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	check(imported, "rejected snapshot with duplicate ids");
+	if (!imported || first == MAP_FAILED)
+		return;
+
+	ta_get_stats(imported, &stats);
+	check(stats.units == 4, "imported %u of 4 units", stats.units);
+
+	/* The same units in the same order give the same snapshot */
+	fd = ta_snapshot(imported, 1);
+	ta_free(imported);
+	again = fd >= 0 ? mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+	check(again != MAP_FAILED && lseek(fd, 0, SEEK_END) == (off_t)size &&
+	      !memcmp(first, again, size), "duplicate ids changed on import");
+
+	if (again != MAP_FAILED)
+		munmap(again, size);
+	munmap(first, size);
+	if (fd >= 0)
+		close(fd);
+}
+
+int main(void)
+{
+	if (make_image() < 0) {
+		fprintf(stderr, "test-import: failed to create archive\n");
+		return 1;
+	}
+
+	test_valid();
+	test_truncated();
+	test_header();
+	test_index();
+	test_order();
+	test_duplicates();
+
+	free(image);
+	free(buf);
+
+	if (failures) {
+		fprintf(stderr, "test-import: %u failures\n", failures);
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,176 @@
+/*
+ * Copyright (c) 2018, Bjorn Andersson <bjorn@kryo.se>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lz.h"
+#include "ta-image.h"
+
+#define MAX_LEN		(256 * 1024)
+
+static uint8_t src[MAX_LEN];
+static uint8_t packed[MAX_LEN + MAX_LEN / 255 + 16];
+static uint8_t unpacked[MAX_LEN];
+
+static void fill_random(uint8_t *buf, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		buf[i] = rand();
+}
+
+/* Runs of a few distinct phrases, roughly what calibration units look like */
+static void fill_text(uint8_t *buf, size_t len)
+{
+	static const char * const words[] = {
+		"calibration", "default", "rf-", "0x00", ";", "band",
+	};
+	const char *word;
+	size_t n;
+	size_t i;
+
+	for (i = 0; i < len; i += n) {
+		word = words[rand() % 6];
+		n = strlen(word);
+		if (n > len - i)
+			n = len - i;
+		memcpy(buf + i, word, n);
+	}
+}
+
+static void round_trip(const char *name, size_t len)
+{
+	ssize_t zlen;
+	ssize_t n;
+
+	zlen = lz_compress(src, len, packed, sizeof(packed));
+	check(zlen >= 0, "%s %zu: failed to compress", name, len);
+	if (zlen < 0)
+		return;
+
+	memset(unpacked, 0xa5, sizeof(unpacked));
+	n = lz_decompress(packed, zlen, unpacked, len);
+	check(n == (ssize_t)len, "%s %zu: decompressed %zd bytes", name, len, n);
+	check(!memcmp(src, unpacked, len), "%s %zu: payload differs", name, len);
+}
+
+static void test_round_trip(void)
+{
+	static const size_t lens[] = {
+		0, 1, 4, 5, 12, 13, 17, 255, 256, 4096, 65535, 65536, 70000,
+		MAX_LEN,
+	};
+	unsigned i;
+
+	for (i = 0; i < sizeof(lens) / sizeof(lens[0]); i++) {
+		memset(src, 0, lens[i]);
+		round_trip("zeroes", lens[i]);
+
+		fill_random(src, lens[i]);
+		round_trip("random", lens[i]);
+
+		fill_text(src, lens[i]);
+		round_trip("text", lens[i]);
+	}
+}
+
+static void test_compresses(void)
+{
+	ssize_t zlen;
+
+	memset(src, 0, 4096);
+	zlen = lz_compress(src, 4096, packed, sizeof(packed));
+	check(zlen > 0 && zlen < 64, "zeroes: compressed to %zd bytes", zlen);
+}
+
+/* Output that doesn't fit is an error, not an overflow */
+static void test_short_buffers(void)
+{
+	ssize_t zlen;
+	ssize_t n;
+
+	fill_random(src, 4096);
+	n = lz_compress(src, 4096, packed, 1024);
+	check(n < 0, "compressed incompressible data into 1024 bytes");
+
+	fill_text(src, 4096);
+	zlen = lz_compress(src, 4096, packed, sizeof(packed));
+	check(zlen > 0, "failed to compress text");
+
+	n = lz_decompress(packed, zlen, unpacked, 4095);
+	check(n < 0, "decompressed into a short buffer: %zd", n);
+}
+
+/* Truncated and corrupted input must fail cleanly or stay within bounds */
+static void test_corrupt(void)
+{
+	ssize_t zlen;
+	ssize_t n;
+	ssize_t i;
+
+	fill_text(src, 4096);
+	zlen = lz_compress(src, 4096, packed, sizeof(packed));
+	check(zlen > 0, "failed to compress text");
+
+	for (i = 0; i < zlen; i++) {
+		n = lz_decompress(packed, i, unpacked, 4096);
+		check(n < 4096, "truncated to %zd bytes decompressed fully", i);
+	}
+
+	for (i = 0; i < 10000; i++) {
+		fill_text(src, 4096);
+		zlen = lz_compress(src, 4096, packed, sizeof(packed));
+		packed[rand() % zlen] ^= 1 << (rand() % 8);
+
+		n = lz_decompress(packed, zlen, unpacked, 4096);
+		check(n <= 4096, "corrupt input decompressed to %zd bytes", n);
+	}
+}
+
+int main(void)
+{
+	srand(1);
+
+	test_round_trip();
+	test_compresses();
+	test_short_buffers();
+	test_corrupt();
+
+	if (failures) {
+		fprintf(stderr, "test-lz: %u failures\n", failures);
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,284 @@
+/*
+ * Copyright (c) 2018, Bjorn Andersson <bjorn@kryo.se>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#define _GNU_SOURCE
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "snapshot.h"
+#include "ta.h"
+#include "ta-image.h"
+
+#define NUM_UNITS	64
+
+static struct test_unit units[NUM_UNITS];
+static uint8_t payloads[NUM_UNITS][4096];
+
+/*
+ * Units in no particular id order, of assorted sizes, every third sharing
+ * its payload with another unit so that deduplication is exercised.
+ */
+static void make_units(void)
+{
+	unsigned i;
+	size_t j;
+
+	for (i = 0; i < NUM_UNITS; i++) {
+		units[i].id = 1000 + (i * 37) % NUM_UNITS;
+		units[i].len = 1 + (i * 613) % sizeof(payloads[i]);
+
+		for (j = 0; j < units[i].len; j++)
+			payloads[i][j] = i % 2 ? rand() : "calibration"[j % 11];
+
+		if (i % 3 == 2) {
+			units[i].len = units[i - 1].len;
+			memcpy(payloads[i], payloads[i - 1], units[i].len);
+		}
+
+		units[i].data = payloads[i];
+	}
+}
+
+static const struct test_unit *find_unit(unsigned id)
+{
+	unsigned i;
+
+	for (i = 0; i < NUM_UNITS; i++) {
+		if (units[i].id == id)
+			return &units[i];
+	}
+
+	return NULL;
+}
+
+static void check_store(const char *name, struct ta *ta)
+{
+	const struct test_unit *unit;
+	uint8_t *data;
+	unsigned i;
+	size_t len;
+
+	for (i = 0; i < NUM_UNITS; i++) {
+		unit = &units[i];
+
+		data = ta_get(ta, unit->id, &len);
+		check(data, "%s: unit %u missing", name, unit->id);
+		if (!data)
+			continue;
+
+		check(len == unit->len && !memcmp(data, unit->data, len),
+		      "%s: unit %u differs", name, unit->id);
+	}
+
+	check(!ta_get(ta, 1000 + NUM_UNITS, &len), "%s: found unknown unit",
+	      name);
+}
+
+static void check_same_order(const char *name, struct ta *a, struct ta *b)
+{
+	size_t len;
+	int id_a = 0;
+	int id_b = 0;
+
+	do {
+		id_a = ta_get_next(a, id_a, &len);
+		id_b = ta_get_next(b, id_b, &len);
+		check(id_a == id_b, "%s: iterated %d, expected %d", name, id_b,
+		      id_a);
+	} while (id_a > 0 && id_a == id_b);
+}
+
+/* Check the image itself, as a reader mapping the memfd would see it */
+static void check_image(const char *name, struct ta *ta, int fd)
+{
+	const struct ta_snap_entry *index;
+	const struct ta_snap_header *hdr;
+	const struct test_unit *unit;
+	const uint32_t *order;
+	struct stat st;
+	size_t len;
+	int seals;
+	int id = 0;
+	unsigned i;
+	void *map;
+
+	seals = fcntl(fd, F_GET_SEALS);
+	check(seals >= 0 && (seals & (F_SEAL_WRITE | F_SEAL_SHRINK)) ==
+	      (F_SEAL_WRITE | F_SEAL_SHRINK), "%s: not sealed (%#x)", name,
+	      seals);
+
+	if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(*hdr)) {
+		check(0, "%s: image too small", name);
+		return;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		check(0, "%s: failed to map image", name);
+		return;
+	}
+
+	hdr = map;
+	index = map + sizeof(*hdr);
+
+	check(hdr->magic == TA_SNAP_MAGIC && hdr->version == TA_SNAP_VERSION,
+	      "%s: bad header", name);
+	check(hdr->generation == 42, "%s: generation %llu", name,
+	      (unsigned long long)hdr->generation);
+	check(hdr->size == (uint64_t)st.st_size, "%s: size %llu of %lld", name,
+	      (unsigned long long)hdr->size, (long long)st.st_size);
+	check(hdr->num_units == NUM_UNITS, "%s: %u units", name,
+	      hdr->num_units);
+	if (hdr->num_units != NUM_UNITS)
+		goto out;
+
+	for (i = 0; i < NUM_UNITS; i++) {
+		check(!i || index[i - 1].id < index[i].id,
+		      "%s: index not sorted at %u", name, i);
+		check(index[i].offset + index[i].len <= hdr->size,
+		      "%s: unit %u out of bounds", name, index[i].id);
+
+		unit = find_unit(index[i].id);
+		check(unit && unit->len == index[i].len &&
+		      !memcmp(map + index[i].offset, unit->data, unit->len),
+		      "%s: unit %u differs", name, index[i].id);
+	}
+
+	check(hdr->order_offset, "%s: no order table", name);
+	if (!hdr->order_offset)
+		goto out;
+
+	order = map + hdr->order_offset;
+	for (i = 0; i < NUM_UNITS; i++) {
+		id = ta_get_next(ta, id, &len);
+		check(order[i] < NUM_UNITS && (int)index[order[i]].id == id,
+		      "%s: order entry %u is not unit %d", name, i, id);
+	}
+
+out:
+	munmap(map, st.st_size);
+}
+
+static void check_shared(const char *name, int fd)
+{
+	const struct ta_snap_entry *index;
+	unsigned offsets = 0;
+	struct stat st;
+	unsigned i;
+	unsigned j;
+	void *map;
+
+	fstat(fd, &st);
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+		return;
+
+	index = map + sizeof(struct ta_snap_header);
+	for (i = 0; i < NUM_UNITS; i++) {
+		for (j = 0; j < i && index[j].offset != index[i].offset; j++)
+			;
+		if (j == i)
+			offsets++;
+	}
+
+	/* Every third unit repeats the payload of the one before it */
+	check(offsets == NUM_UNITS - NUM_UNITS / 3,
+	      "%s: %u distinct payloads", name, offsets);
+
+	munmap(map, st.st_size);
+}
+
+static void test_round_trip(const char *name, const char *path)
+{
+	struct ta *imported;
+	struct ta *ta;
+	int fd;
+
+	ta = ta_load(path);
+	check(ta, "%s: failed to load", name);
+	if (!ta)
+		return;
+
+	check_store(name, ta);
+
+	fd = ta_snapshot(ta, 42);
+	check(fd >= 0, "%s: failed to snapshot", name);
+	if (fd < 0)
+		goto out;
+
+	check_image(name, ta, fd);
+	check_shared(name, fd);
+
+	imported = ta_import(fd);
+	check(imported, "%s: failed to import snapshot", name);
+	if (imported) {
+		check(ta_loaded(imported), "%s: import not loaded", name);
+		check_store(name, imported);
+		check_same_order(name, ta, imported);
+		ta_free(imported);
+	}
+
+	close(fd);
+out:
+	ta_free(ta);
+}
+
+int main(void)
+{
+	char path[] = "/tmp/test-snapshot-XXXXXX";
+
+	srand(1);
+	make_units();
+
+	if (test_write_image(path, units, NUM_UNITS) < 0) {
+		fprintf(stderr, "test-snapshot: failed to write image\n");
+		return 1;
+	}
+
+	test_round_trip("plain", path);
+
+	ta_set_compression(64, 2, 65536);
+	test_round_trip("compressed", path);
+
+	unlink(path);
+
+	if (failures) {
+		fprintf(stderr, "test-snapshot: %u failures\n", failures);
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,292 @@
+/*
+ * Copyright (c) 2018, Bjorn Andersson <bjorn@kryo.se>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+#define TRACE_FLUSH_INTERVAL_MS	100
+
+#define MIN(x, y) ((x) < (y) ? (x) : (y))
+
+/*
+ * Requests are traced into a single producer, single consumer ring. Without
+ * a trace file the ring acts as a flight recorder and keeps the most recent
+ * records, with a trace file a background thread drains it and records are
+ * dropped rather than overwritten when it falls behind.
+ */
+static struct trace_record *ring;
+static unsigned ring_size;
+static _Atomic uint64_t ring_head;
+static _Atomic uint64_t ring_tail;
+static _Atomic unsigned long dropped;
+
+static int trace_fd = -1;
+
+static struct trace_record cur;
+static struct timespec cur_mark;
+static int tracing;
+
+static uint64_t trace_now(struct timespec *ts)
+{
+	clock_gettime(CLOCK_MONOTONIC, ts);
+
+	return ts->tv_sec * 1000000000ull + ts->tv_nsec;
+}
+
+static void trace_write(int fd, const void *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len) {
+		n = write(fd, buf, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return;
+
+		buf += n;
+		len -= n;
+	}
+}
+
+static void *trace_flush_thread(void *data)
+{
+	struct timespec interval = { 0, TRACE_FLUSH_INTERVAL_MS * 1000000 };
+	uint64_t head;
+	uint64_t tail;
+	unsigned idx;
+	unsigned n;
+
+	for (;;) {
+		head = atomic_load_explicit(&ring_head, memory_order_acquire);
+		tail = atomic_load_explicit(&ring_tail, memory_order_relaxed);
+
+		while (tail != head) {
+			idx = tail % ring_size;
+			n = ring_size - idx;
+			if (n > head - tail)
+				n = head - tail;
+
+			trace_write(trace_fd, &ring[idx],
+				    n * sizeof(struct trace_record));
+			tail += n;
+
+			atomic_store_explicit(&ring_tail, tail,
+					      memory_order_release);
+		}
+
+		nanosleep(&interval, NULL);
+	}
+
+	return NULL;
+}
+
+int trace_init(unsigned entries, const char *path)
+{
+	struct trace_header hdr = {
+		.magic = TRACE_MAGIC,
+		.version = TRACE_VERSION,
+		.record_size = sizeof(struct trace_record),
+	};
+	pthread_t thread;
+	int ret;
+
+	ring = calloc(entries, sizeof(*ring));
+	if (!ring)
+		return -1;
+
+	ring_size = entries;
+	tracing = 1;
+
+	if (!path)
+		return 0;
+
+	trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (trace_fd < 0)
+		return -1;
+
+	trace_write(trace_fd, &hdr, sizeof(hdr));
+
+	ret = pthread_create(&thread, NULL, trace_flush_thread, NULL);
+	if (ret)
+		return -1;
+
+	pthread_detach(thread);
+
+	return 0;
+}
+
+/*
+ * Write the flight recorder, oldest record first, in the format of a trace
+ * file. Only available without a trace file, as the ring is drained into it
+ * otherwise.
+ */
+int trace_dump(int fd)
+{
+	struct trace_header hdr = {
+		.magic = TRACE_MAGIC,
+		.version = TRACE_VERSION,
+		.record_size = sizeof(struct trace_record),
+	};
+	uint64_t head;
+	uint64_t tail;
+	unsigned idx;
+	unsigned n;
+
+	if (!tracing)
+		return -EOPNOTSUPP;
+	if (trace_fd >= 0)
+		return -EBUSY;
+
+	head = atomic_load_explicit(&ring_head, memory_order_relaxed);
+	tail = atomic_load_explicit(&ring_tail, memory_order_relaxed);
+
+	trace_write(fd, &hdr, sizeof(hdr));
+
+	while (tail != head) {
+		idx = tail % ring_size;
+		n = ring_size - idx;
+		if (n > head - tail)
+			n = head - tail;
+
+		trace_write(fd, &ring[idx], n * sizeof(struct trace_record));
+		tail += n;
+	}
+
+	return 0;
+}
+
+void trace_dump_stats(FILE *fp)
+{
+	if (!tracing)
+		return;
+
+	fprintf(fp, "trace records: %llu (%lu dropped)\n",
+		(unsigned long long)atomic_load(&ring_head),
+		atomic_load(&dropped));
+}
+
+/*
+ * Start tracing a request, dispatched before at since if non-zero, and return
+ * the time it is traced from.
+ */
+uint64_t trace_begin(const struct qrtr_packet *pkt, unsigned service,
+		     unsigned instance, uint64_t since)
+{
+	const struct qmi_header *hdr = pkt->data;
+	uint64_t now;
+
+	if (!tracing)
+		return 0;
+
+	now = trace_now(&cur_mark);
+
+	memset(&cur, 0, sizeof(cur));
+	cur.timestamp = since ? since : now;
+	cur.stage_ns[TRACE_PARK] = now - cur.timestamp;
+	cur.node = pkt->node;
+	cur.port = pkt->port;
+	cur.service = service;
+	cur.instance = instance;
+
+	if (pkt->data_len >= sizeof(*hdr)) {
+		cur.msg_id = hdr->msg_id;
+		cur.txn = hdr->txn_id;
+	}
+
+	cur.req_len = pkt->data_len;
+	memcpy(cur.req, pkt->data, MIN(pkt->data_len, sizeof(cur.req)));
+
+	return cur.timestamp;
+}
+
+void trace_mark(int stage)
+{
+	struct timespec now;
+
+	if (!tracing)
+		return;
+
+	trace_now(&now);
+
+	cur.stage_ns[stage] += (now.tv_sec - cur_mark.tv_sec) * 1000000000ull +
+			       now.tv_nsec - cur_mark.tv_nsec;
+	cur_mark = now;
+}
+
+void trace_unit(unsigned unit)
+{
+	cur.unit = unit;
+}
+
+void trace_result(int result)
+{
+	cur.result = result;
+}
+
+void trace_disposition(int disposition)
+{
+	cur.disposition = disposition;
+}
+
+void trace_end(void)
+{
+	uint64_t head;
+	uint64_t tail;
+
+	if (!tracing)
+		return;
+
+	head = atomic_load_explicit(&ring_head, memory_order_relaxed);
+	tail = atomic_load_explicit(&ring_tail, memory_order_acquire);
+
+	if (head - tail >= ring_size) {
+		if (trace_fd >= 0) {
+			atomic_fetch_add(&dropped, 1);
+			return;
+		}
+
+		/* No consumer, overwrite the oldest record */
+		atomic_store_explicit(&ring_tail, tail + 1, memory_order_relaxed);
+	}
+
+	ring[head % ring_size] = cur;
+
+	atomic_store_explicit(&ring_head, head + 1, memory_order_release);
+}
@@ -0,0 +1,104 @@
+/*
+ * Copyright (c) 2018, Bjorn Andersson <bjorn@kryo.se>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <stdint.h>
+#include <stdio.h>
+#include <libqrtr.h>
+
+#define TRACE_MAGIC	0x52544154	/* "TATR" */
+#define TRACE_VERSION	3
+
+#define TRACE_REQ_SIZE	64
+
+enum {
+	TRACE_DECODE,
+	TRACE_HANDLE,
+	TRACE_ENCODE,
+	TRACE_SEND,
+	TRACE_PARK,
+	TRACE_NUM_STAGES,
+};
+
+/* How a request was answered */
+enum {
+	TRACE_SERVED,		/* dispatched to its handler */
+	TRACE_CACHED,		/* a retransmit, answered from the response cache */
+	TRACE_DUPLICATE,	/* a copy of a request still queued, dropped */
+	TRACE_SHED,		/* no request slot or queue space, answered busy */
+};
+
+struct trace_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t record_size;
+	uint32_t reserved;
+};
+
+struct trace_record {
+	uint64_t timestamp;
+
+	uint32_t node;
+	uint32_t port;
+	uint16_t service;
+	uint16_t instance;
+	uint16_t msg_id;
+	uint16_t txn;
+	uint32_t unit;
+	int32_t result;
+	uint32_t disposition;
+
+	/* the request as received, only its first TRACE_REQ_SIZE bytes kept */
+	uint32_t req_len;
+	uint8_t req[TRACE_REQ_SIZE];
+
+	/*
+	 * Time spent in each stage, in nanoseconds. Parked requests are traced
+	 * from when they were first dispatched, the wait counting as parked.
+	 */
+	uint64_t stage_ns[TRACE_NUM_STAGES];
+};
+
+int trace_init(unsigned entries, const char *path);
+int trace_dump(int fd);
+
+uint64_t trace_begin(const struct qrtr_packet *pkt, unsigned service,
+		     unsigned instance, uint64_t since);
+void trace_mark(int stage);
+void trace_unit(unsigned unit);
+void trace_result(int result);
+void trace_disposition(int disposition);
+void trace_end(void);
+
+void trace_dump_stats(FILE *fp);
+
+#endif
@@ -0,0 +1,268 @@
+/*
+ * Copyright (c) 2018, Bjorn Andersson <bjorn@kryo.se>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#define _GNU_SOURCE
+#include <sys/timerfd.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "warmup.h"
+
+/*
+ * The modem reads mostly the same units, in mostly the same order, on every
+ * boot. The first accesses of each boot are recorded to a manifest, and on the
+ * next start the units listed there are prefetched and their responses
+ * encoded before the services are published. The manifest is saved once
+ * enough accesses are recorded, the boot window ends or the service exits,
+ * whichever comes first.
+ */
+static const char *manifest_path;
+static char *manifest_tmp;
+static unsigned max_accesses;
+static int timer_fd = -1;
+static bool saved;
+
+/* warmup set, as read from the manifest at startup */
+static struct warm_unit *warm;
+static unsigned num_warm;
+
+/* accesses recorded during this boot */
+static struct warm_unit *recorded;
+static unsigned num_recorded;
+static unsigned num_accesses;
+static unsigned num_hits;
+static unsigned long served_warm;
+
+int warmup_init(const char *path, unsigned max_records, unsigned window_s)
+{
+	struct itimerspec its = {};
+	unsigned instance;
+	unsigned unit;
+	FILE *fp;
+
+	manifest_path = path;
+	max_accesses = max_records;
+
+	if (asprintf(&manifest_tmp, "%s.tmp", path) < 0)
+		return -1;
+
+	warm = calloc(max_records, sizeof(*warm));
+	recorded = calloc(max_records, sizeof(*recorded));
+	if (!warm || !recorded)
+		return -1;
+
+	if (window_s) {
+		timer_fd = timerfd_create(CLOCK_MONOTONIC,
+					  TFD_NONBLOCK | TFD_CLOEXEC);
+		if (timer_fd < 0)
+			return -1;
+
+		its.it_value.tv_sec = window_s;
+		if (timerfd_settime(timer_fd, 0, &its, NULL) < 0)
+			return -1;
+	}
+
+	fp = fopen(path, "r");
+	if (!fp)
+		return errno == ENOENT ? 0 : -1;
+
+	while (num_warm < max_records &&
+	       fscanf(fp, "%u %u", &instance, &unit) == 2) {
+		warm[num_warm].instance = instance;
+		warm[num_warm].unit = unit;
+		num_warm++;
+	}
+
+	fclose(fp);
+
+	return 0;
+}
+
+unsigned warmup_count(void)
+{
+	return num_warm;
+}
+
+struct warm_unit *warmup_entry(unsigned idx)
+{
+	return &warm[idx];
+}
+
+static struct warm_unit *warmup_lookup(struct warm_unit *set, unsigned count,
+				       unsigned instance, unsigned unit)
+{
+	unsigned i;
+
+	for (i = 0; i < count; i++) {
+		if (set[i].instance == instance && set[i].unit == unit)
+			return &set[i];
+	}
+
+	return NULL;
+}
+
+void *warmup_response(unsigned instance, unsigned unit, int kind, size_t *len)
+{
+	struct warm_unit *entry;
+
+	entry = warmup_lookup(warm, num_warm, instance, unit);
+	if (!entry || !entry->resp[kind])
+		return NULL;
+
+	served_warm++;
+
+	*len = entry->resp_len[kind];
+	return entry->resp[kind];
+}
+
+int warmup_set_response(struct warm_unit *entry, int kind, const void *data,
+			size_t len)
+{
+	free(entry->resp[kind]);
+	entry->resp_len[kind] = 0;
+
+	entry->resp[kind] = malloc(len);
+	if (!entry->resp[kind])
+		return -1;
+
+	memcpy(entry->resp[kind], data, len);
+	entry->resp_len[kind] = len;
+
+	return 0;
+}
+
+static void warmup_drop(struct warm_unit *entry)
+{
+	int kind;
+
+	for (kind = 0; kind < WARM_NUM_RESPONSES; kind++) {
+		free(entry->resp[kind]);
+		entry->resp[kind] = NULL;
+		entry->resp_len[kind] = 0;
+	}
+}
+
+/* Drop the prepared responses, e.g. when the partitions have been reloaded */
+void warmup_reset(void)
+{
+	unsigned i;
+
+	for (i = 0; i < num_warm; i++)
+		warmup_drop(&warm[i]);
+}
+
+/* Drop the prepared responses of one partition, e.g. replaced by an import */
+void warmup_reset_instance(unsigned instance)
+{
+	unsigned i;
+
+	for (i = 0; i < num_warm; i++) {
+		if (warm[i].instance == instance)
+			warmup_drop(&warm[i]);
+	}
+}
+
+static void warmup_save(void)
+{
+	unsigned i;
+	FILE *fp;
+
+	fp = fopen(manifest_tmp, "w");
+	if (!fp) {
+		log_err("failed to write warmup manifest %s", manifest_tmp);
+		return;
+	}
+
+	for (i = 0; i < num_recorded; i++)
+		fprintf(fp, "%u %u\n", recorded[i].instance, recorded[i].unit);
+
+	if (fclose(fp) || rename(manifest_tmp, manifest_path))
+		log_err("failed to write warmup manifest %s", manifest_path);
+}
+
+/* Save the accesses recorded so far, and stop recording */
+void warmup_finish(void)
+{
+	if (!manifest_path || saved || !num_recorded)
+		return;
+
+	saved = true;
+	warmup_save();
+}
+
+int warmup_fd(void)
+{
+	return timer_fd;
+}
+
+/* The boot window ended */
+void warmup_expired(void)
+{
+	close(timer_fd);
+	timer_fd = -1;
+
+	warmup_finish();
+}
+
+void warmup_record(unsigned instance, unsigned unit)
+{
+	if (!manifest_path || saved || num_accesses >= max_accesses)
+		return;
+
+	if (warmup_lookup(warm, num_warm, instance, unit))
+		num_hits++;
+
+	if (!warmup_lookup(recorded, num_recorded, instance, unit)) {
+		recorded[num_recorded].instance = instance;
+		recorded[num_recorded].unit = unit;
+		num_recorded++;
+	}
+
+	if (++num_accesses == max_accesses)
+		warmup_finish();
+}
+
+void warmup_dump_stats(FILE *fp)
+{
+	if (!manifest_path)
+		return;
+
+	fprintf(fp, "warmup set: %u units\n", num_warm);
+	fprintf(fp, "warmup hits: %u of %u recorded accesses (%u%%)\n",
+		num_hits, num_accesses,
+		num_accesses ? num_hits * 100 / num_accesses : 0);
+	fprintf(fp, "warmup responses served: %lu\n", served_warm);
+}
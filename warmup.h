@@ -0,0 +1,67 @@
+/*
+ * Copyright (c) 2018, Bjorn Andersson <bjorn@kryo.se>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef __WARMUP_H__
+#define __WARMUP_H__
+
+#include <stdio.h>
+
+enum {
+	WARM_TA227_READ,
+	WARM_TA228_READ,
+	WARM_NUM_RESPONSES,
+};
+
+struct warm_unit {
+	unsigned instance;
+	unsigned unit;
+
+	/* responses encoded ahead of time, with a zero transaction id */
+	void *resp[WARM_NUM_RESPONSES];
+	size_t resp_len[WARM_NUM_RESPONSES];
+};
+
+int warmup_init(const char *path, unsigned max_records, unsigned window_s);
+unsigned warmup_count(void);
+struct warm_unit *warmup_entry(unsigned idx);
+void *warmup_response(unsigned instance, unsigned unit, int kind, size_t *len);
+void warmup_reset(void);
+void warmup_reset_instance(unsigned instance);
+int warmup_set_response(struct warm_unit *warm, int kind, const void *data,
+			size_t len);
+
+void warmup_record(unsigned instance, unsigned unit);
+void warmup_finish(void);
+int warmup_fd(void);
+void warmup_expired(void);
+
+void warmup_dump_stats(FILE *fp);
+
+#endif